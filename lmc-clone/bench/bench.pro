@@ -0,0 +1,13 @@
+#-----------------------------------------------------------------------------
+#
+# bench.pro
+#   benchmarks of the message paths, each prints its timings when run
+#
+#-----------------------------------------------------------------------------
+
+TEMPLATE = subdirs
+
+SUBDIRS += \
+    crypto \
+    frames \
+    xmlparse
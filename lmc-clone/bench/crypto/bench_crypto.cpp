@@ -0,0 +1,301 @@
+/*
+    lmc-clone
+    http://code.google.com/p/lmc-clone
+
+    lmc is a lan messenger, instant messaging client.
+    http://lanmsngr.sourceforge.net/
+    http://sourceforge.net/projects/lanmsngr/
+
+    GNU LESSER GENERAL PUBLIC LICENSE
+    Version 3, 29 June 2007
+    Copyright (c) 2007 Free Software Foundation, Inc. <http://fsf.org/>
+    Everyone is permitted to copy and distribute verbatim copies of this license document, but changing it is not allowed.
+    This version of the GNU Lesser General Public License incorporates the terms and conditions of version 3 of the GNU General Public License, supplemented by the additional permissions listed below.
+     0. Additional Definitions.
+    As used herein, “this License” refers to version 3 of the GNU Lesser General Public License, and the “GNU GPL” refers to version 3 of the GNU General Public License.
+    “The Library” refers to a covered work governed by this License, other than an Application or a Combined Work as defined below.
+    An “Application” is any work that makes use of an interface provided by the Library, but which is not otherwise based on the Library. Defining a subclass of a class defined by the Library is deemed a mode of using an interface provided by the Library.
+    A “Combined Work” is a work produced by combining or linking an Application with the Library. The particular version of the Library with which the Combined Work was made is also called the “Linked Version”.
+    The “Minimal Corresponding Source” for a Combined Work means the Corresponding Source for the Combined Work, excluding any source code for portions of the Combined Work that, considered in isolation, are based on the Application, and not on the Linked Version.
+    The “Corresponding Application Code” for a Combined Work means the object code and/or source code for the Application, including any data and utility programs needed for reproducing the Combined Work from the Application, but excluding the System Libraries of the Combined Work.
+     1. Exception to Section 3 of the GNU GPL.
+    You may convey a covered work under sections 3 and 4 of this License without being bound by section 3 of the GNU GPL.
+     2. Conveying Modified Versions.
+    If you modify a copy of the Library, and, in your modifications, a facility refers to a function or data to be supplied by an Application that uses the facility (other than as an argument passed when the facility is invoked), then you may convey a copy of the modified version:
+    a) under this License, provided that you make a good faith effort to ensure that, in the event an Application does not supply the function or data, the facility still operates, and performs whatever part of its purpose remains meaningful, or
+    b) under the GNU GPL, with none of the additional permissions of this License applicable to that copy.
+     3. Object Code Incorporating Material from Library Header Files.
+    The object code form of an Application may incorporate material from a header file that is part of the Library. You may convey such object code under terms of your choice, provided that, if the incorporated material is not limited to numerical parameters, data structure layouts and accessors, or small macros, inline functions and templates (ten or fewer lines in length), you do both of the following:
+    a) Give prominent notice with each copy of the object code that the Library is used in it and that the Library and its use are covered by this License.
+    b) Accompany the object code with a copy of the GNU GPL and this license document.
+     4. Combined Works.
+    You may convey a Combined Work under terms of your choice that, taken together, effectively do not restrict modification of the portions of the Library contained in the Combined Work and reverse engineering for debugging such modifications, if you also do each of the following:
+    a) Give prominent notice with each copy of the Combined Work that the Library is used in it and that the Library and its use are covered by this License.
+    b) Accompany the Combined Work with a copy of the GNU GPL and this license document.
+    c) For a Combined Work that displays copyright notices during execution, include the copyright notice for the Library among these notices, as well as a reference directing the user to the copies of the GNU GPL and this license document.
+    d) Do one of the following:
+        0) Convey the Minimal Corresponding Source under the terms of this License, and the Corresponding Application Code in a form suitable for, and under terms that permit, the user to recombine or relink the Application with a modified version of the Linked Version to produce a modified Combined Work, in the manner specified by section 6 of the GNU GPL for conveying Corresponding Source.
+        1) Use a suitable shared library mechanism for linking with the Library. A suitable mechanism is one that (a) uses at run time a copy of the Library already present on the user's computer system, and (b) will operate properly with a modified version of the Library that is interface-compatible with the Linked Version.
+    e) Provide Installation Information, but only if you would otherwise be required to provide such information under section 6 of the GNU GPL, and only to the extent that such information is necessary to install and execute a modified version of the Combined Work produced by recombining or relinking the Application with a modified version of the Linked Version. (If you use option 4d0, the Installation Information must accompany the Minimal Corresponding Source and Corresponding Application Code. If you use option 4d1, you must provide the Installation Information in the manner specified by section 6 of the GNU GPL for conveying Corresponding Source.)
+     5. Combined Libraries.
+    You may place library facilities that are a work based on the Library side by side in a single library together with other library facilities that are not Applications and are not covered by this License, and convey such a combined library under terms of your choice, if you do both of the following:
+    a) Accompany the combined library with a copy of the same work based on the Library, uncombined with any other library facilities, conveyed under the terms of this License.
+    b) Give prominent notice with the combined library that part of it is a work based on the Library, and explaining where to find the accompanying uncombined form of the same work.
+     6. Revised Versions of the GNU Lesser General Public License.
+    The Free Software Foundation may publish revised and/or new versions of the GNU Lesser General Public License from time to time. Such new versions will be similar in spirit to the present version, but may differ in detail to address new problems or concerns.
+    Each version is given a distinguishing version number. If the Library as you received it specifies that a certain numbered version of the GNU Lesser General Public License “or any later version” applies to it, you have the option of following the terms and conditions either of that published version or of any later version published by the Free Software Foundation. If the Library as you received it does not specify a version number of the GNU Lesser General Public License, you may choose any version of the GNU Lesser General Public License ever published by the Free Software Foundation.
+    If the Library as you received it specifies that a proxy can decide whether future versions of the GNU Lesser General Public License shall apply, that proxy's public statement of acceptance of any version is permanent authorization for you to choose that version for the Library.
+*/
+
+#include <QtTest>
+#include <QElapsedTimer>
+#include "crypto.h"
+
+#define BC_MESSAGES		1000	// messages encrypted or decrypted in one round
+#define BC_MINTIME		200		// milliseconds of rounds a result is taken over
+
+/****************************************************************************
+** Class: bench_Crypto
+** Description: Times the session ciphers of lmcCrypto, gcm against cbc, in
+**	rounds of BC_MESSAGES messages. The contexts of a session are set up once
+**	and kept. baseline times the path messages took before, with a context
+**	copied out of a map and an output buffer allocated for every message,
+**	and freshContext one with a context set up for every message. Each result
+**	is in nanoseconds per message, the throughput is printed with it.
+****************************************************************************/
+class bench_Crypto : public QObject
+{
+	Q_OBJECT
+
+private slots:
+	void initTestCase(void);
+	void encrypt_data(void);
+	void encrypt(void);
+	void decrypt_data(void);
+	void decrypt(void);
+	void baseline_data(void);
+	void baseline(void);
+	void freshContext_data(void);
+	void freshContext(void);
+
+private:
+	lmcCrypto sender;
+	lmcCrypto receiver;
+	QString senderId;
+	QString receiverId;
+	QByteArray keyIv;
+
+	void addRows(void);
+	void setSession(CipherMode mode);
+	void report(qint64 nNanoseconds, qint64 nMessages, int nSize);
+};
+
+void bench_Crypto::initTestCase(void) {
+	senderId = "001122334455johndoe";
+	receiverId = "66778899aabbjanedoe";
+
+	//	a message must come through once, and neither a changed one nor the
+	//	same one again
+	setSession(CM_Gcm);
+	QByteArray clearData(300, 'm');
+	QByteArray cipherData = sender.encrypt(&receiverId, clearData);
+	QByteArray outData;
+	QVERIFY(receiver.decrypt(&senderId, cipherData, outData));
+	QCOMPARE(outData, clearData);
+	QVERIFY(!receiver.decrypt(&senderId, cipherData, outData));
+	cipherData = sender.encrypt(&receiverId, clearData);
+	cipherData[cipherData.length() - 1] = (char)(cipherData.at(cipherData.length() - 1) ^ 0x01);
+	QVERIFY(!receiver.decrypt(&senderId, cipherData, outData));
+}
+
+void bench_Crypto::addRows(void) {
+	QTest::addColumn<int>("mode");
+	QTest::addColumn<int>("size");
+	QTest::newRow("gcm chat 200 bytes") << (int)CM_Gcm << 200;
+	QTest::newRow("gcm user data 2 KB") << (int)CM_Gcm << 2048;
+	QTest::newRow("gcm file data 16 KB") << (int)CM_Gcm << 16384;
+	QTest::newRow("cbc chat 200 bytes") << (int)CM_Cbc << 200;
+	QTest::newRow("cbc user data 2 KB") << (int)CM_Cbc << 2048;
+	QTest::newRow("cbc file data 16 KB") << (int)CM_Cbc << 16384;
+}
+
+//	Sets up both ends again, a receiver takes each message only once
+void bench_Crypto::setSession(CipherMode mode) {
+	keyIv = sender.newSessionKey(mode);
+	sender.setSessionKey(&receiverId, keyIv, true);
+	receiver.setSessionKey(&senderId, keyIv, false);
+}
+
+//	The time per message is the result, the throughput in MB/s is printed
+void bench_Crypto::report(qint64 nNanoseconds, qint64 nMessages, int nSize) {
+	double nsPerMessage = (double)nNanoseconds / nMessages;
+	double mbPerSecond = (double)nMessages * nSize * 1000 / nNanoseconds;
+	qDebug("%.0f ns/message, %.1f MB/s", nsPerMessage, mbPerSecond);
+	QTest::setBenchmarkResult(nsPerMessage, QTest::WalltimeNanoseconds);
+}
+
+void bench_Crypto::encrypt_data(void) {
+	addRows();
+}
+
+void bench_Crypto::encrypt(void) {
+	QFETCH(int, mode);
+	QFETCH(int, size);
+	setSession((CipherMode)mode);
+	QByteArray clearData(size, 'm');
+	QByteArray cipherData;
+	cipherData.reserve(size + LC_MAXOVERHEAD + AES_BLOCK_SIZE);
+
+	qint64 messages = 0;
+	QElapsedTimer timer;
+	timer.start();
+	do {
+		for(int index = 0; index < BC_MESSAGES; index++) {
+			cipherData.resize(0);
+			sender.encrypt(&receiverId, clearData, cipherData);
+		}
+		messages += BC_MESSAGES;
+	} while(timer.elapsed() < BC_MINTIME);
+	report(timer.nsecsElapsed(), messages, size);
+}
+
+void bench_Crypto::decrypt_data(void) {
+	addRows();
+}
+
+//	Every round decrypts messages made for it with a new key, outside the time
+//	taken, since a message is only taken in once
+void bench_Crypto::decrypt(void) {
+	QFETCH(int, mode);
+	QFETCH(int, size);
+	QByteArray clearData(size, 'm');
+	QByteArray outData;
+	QList<QByteArray> messages;
+
+	qint64 elapsed = 0;
+	qint64 decrypted = 0;
+	while(elapsed < (qint64)BC_MINTIME * 1000000) {
+		setSession((CipherMode)mode);
+		messages.clear();
+		for(int index = 0; index < BC_MESSAGES; index++)
+			messages.append(sender.encrypt(&receiverId, clearData));
+
+		int round = 0;
+		QElapsedTimer timer;
+		timer.start();
+		for(int index = 0; index < BC_MESSAGES; index++) {
+			if(receiver.decrypt(&senderId, messages.at(index), outData))
+				round++;
+		}
+		elapsed += timer.nsecsElapsed();
+		QCOMPARE(round, BC_MESSAGES);
+		decrypted += round;
+	}
+	report(elapsed, decrypted, size);
+}
+
+void bench_Crypto::baseline_data(void) {
+	QTest::addColumn<int>("size");
+	QTest::newRow("cbc chat 200 bytes") << 200;
+	QTest::newRow("cbc user data 2 KB") << 2048;
+	QTest::newRow("cbc file data 16 KB") << 16384;
+}
+
+//	The path messages took before the sessions were kept, which only knew cbc.
+//	The context was copied out of a map for every message, and the cipher text
+//	written to a buffer allocated for it and then copied into the result.
+//	OpenSSL 1.1 no longer lets a context be copied by value, a copy is made
+//	with EVP_CIPHER_CTX_copy there instead.
+void bench_Crypto::baseline(void) {
+	QFETCH(int, size);
+	setSession(CM_Cbc);
+	const unsigned char* key = (const unsigned char*)keyIv.constData();
+	QByteArray clearData(size, 'm');
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+	QMap<QString, EVP_CIPHER_CTX> encryptMap;
+	EVP_CIPHER_CTX sessionCtx;
+	EVP_CIPHER_CTX_init(&sessionCtx);
+	EVP_EncryptInit_ex(&sessionCtx, EVP_aes_256_cbc(), NULL, key, key + LC_KEYLENGTH);
+	encryptMap.insert(receiverId, sessionCtx);
+#else
+	QMap<QString, EVP_CIPHER_CTX*> encryptMap;
+	EVP_CIPHER_CTX* sessionCtx = EVP_CIPHER_CTX_new();
+	EVP_EncryptInit_ex(sessionCtx, EVP_aes_256_cbc(), NULL, key, key + LC_KEYLENGTH);
+	encryptMap.insert(receiverId, sessionCtx);
+	EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+#endif
+
+	qint64 messages = 0;
+	QElapsedTimer timer;
+	timer.start();
+	do {
+		for(int index = 0; index < BC_MESSAGES; index++) {
+			int outLen = clearData.length() + AES_BLOCK_SIZE;
+			unsigned char* outBuffer = (unsigned char*)malloc(outLen);
+			int foutLen = 0;
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+			EVP_CIPHER_CTX copy = encryptMap.value(receiverId);
+			EVP_CIPHER_CTX* ctx = &copy;
+#else
+			EVP_CIPHER_CTX_copy(ctx, encryptMap.value(receiverId));
+#endif
+			EVP_EncryptInit_ex(ctx, NULL, NULL, NULL, NULL);
+			EVP_EncryptUpdate(ctx, outBuffer, &outLen, (const unsigned char*)clearData.constData(), clearData.length());
+			EVP_EncryptFinal_ex(ctx, outBuffer + outLen, &foutLen);
+			QByteArray cipherData((char*)outBuffer, outLen + foutLen);
+			free(outBuffer);
+		}
+		messages += BC_MESSAGES;
+	} while(timer.elapsed() < BC_MINTIME);
+	report(timer.nsecsElapsed(), messages, size);
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+	EVP_CIPHER_CTX_cleanup(&sessionCtx);
+#else
+	EVP_CIPHER_CTX_free(ctx);
+	EVP_CIPHER_CTX_free(sessionCtx);
+#endif
+}
+
+void bench_Crypto::freshContext_data(void) {
+	addRows();
+}
+
+//	The same messages as encrypt, with the context and key set up again for
+//	each of them
+void bench_Crypto::freshContext(void) {
+	QFETCH(int, mode);
+	QFETCH(int, size);
+	setSession((CipherMode)mode);
+	const EVP_CIPHER* cipher = (mode == CM_Gcm) ? EVP_aes_256_gcm() : EVP_aes_256_cbc();
+	const unsigned char* key = (const unsigned char*)keyIv.constData();
+	unsigned char nonce[LC_NONCELENGTH];
+	memcpy(nonce, key + LC_KEYLENGTH, LC_NONCELENGTH);
+	QByteArray clearData(size, 'm');
+	QByteArray cipherData(size + LC_MAXOVERHEAD + AES_BLOCK_SIZE, 0);
+	unsigned char* outBuffer = (unsigned char*)cipherData.data();
+
+	qint64 messages = 0;
+	QElapsedTimer timer;
+	timer.start();
+	do {
+		for(int index = 0; index < BC_MESSAGES; index++) {
+			int outLen = 0;
+			int foutLen = 0;
+			EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+			EVP_EncryptInit_ex(ctx, cipher, NULL, key, (mode == CM_Gcm) ? nonce : key + LC_KEYLENGTH);
+			EVP_EncryptUpdate(ctx, outBuffer, &outLen, (const unsigned char*)clearData.constData(), size);
+			EVP_EncryptFinal_ex(ctx, outBuffer + outLen, &foutLen);
+			if(mode == CM_Gcm)
+				EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, LC_TAGLENGTH, outBuffer + outLen + foutLen);
+			EVP_CIPHER_CTX_free(ctx);
+		}
+		messages += BC_MESSAGES;
+	} while(timer.elapsed() < BC_MINTIME);
+	report(timer.nsecsElapsed(), messages, size);
+}
+
+QTEST_MAIN(bench_Crypto)
+
+#include "bench_crypto.moc"
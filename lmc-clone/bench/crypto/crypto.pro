@@ -0,0 +1,33 @@
+#-----------------------------------------------------------------------------
+#
+# crypto.pro
+#   times the session ciphers, gcm against cbc, and a context kept for the
+#   session against one set up for every message
+#
+#-----------------------------------------------------------------------------
+
+TARGET = bench_crypto
+
+TEMPLATE = app
+
+QT += core testlib
+
+CONFIG += console
+CONFIG -= app_bundle
+
+LMC = $$PWD/../..
+
+INCLUDEPATH += \
+    $$LMC/trace \
+    $$LMC/crypto
+
+win32:INCLUDEPATH += $$LMC/openssl/include
+win32:LIBS += -L$$LMC/openssl/lib/ -llibeay32
+unix:LIBS += -lcrypto
+
+HEADERS += \
+    $$LMC/crypto/crypto.h
+
+SOURCES += \
+    bench_crypto.cpp \
+    $$LMC/crypto/crypto.cpp
@@ -0,0 +1,277 @@
+/*
+    lmc-clone
+    http://code.google.com/p/lmc-clone
+
+    lmc is a lan messenger, instant messaging client.
+    http://lanmsngr.sourceforge.net/
+    http://sourceforge.net/projects/lanmsngr/
+
+    GNU LESSER GENERAL PUBLIC LICENSE
+    Version 3, 29 June 2007
+    Copyright (c) 2007 Free Software Foundation, Inc. <http://fsf.org/>
+    Everyone is permitted to copy and distribute verbatim copies of this license document, but changing it is not allowed.
+    This version of the GNU Lesser General Public License incorporates the terms and conditions of version 3 of the GNU General Public License, supplemented by the additional permissions listed below.
+     0. Additional Definitions.
+    As used herein, “this License” refers to version 3 of the GNU Lesser General Public License, and the “GNU GPL” refers to version 3 of the GNU General Public License.
+    “The Library” refers to a covered work governed by this License, other than an Application or a Combined Work as defined below.
+    An “Application” is any work that makes use of an interface provided by the Library, but which is not otherwise based on the Library. Defining a subclass of a class defined by the Library is deemed a mode of using an interface provided by the Library.
+    A “Combined Work” is a work produced by combining or linking an Application with the Library. The particular version of the Library with which the Combined Work was made is also called the “Linked Version”.
+    The “Minimal Corresponding Source” for a Combined Work means the Corresponding Source for the Combined Work, excluding any source code for portions of the Combined Work that, considered in isolation, are based on the Application, and not on the Linked Version.
+    The “Corresponding Application Code” for a Combined Work means the object code and/or source code for the Application, including any data and utility programs needed for reproducing the Combined Work from the Application, but excluding the System Libraries of the Combined Work.
+     1. Exception to Section 3 of the GNU GPL.
+    You may convey a covered work under sections 3 and 4 of this License without being bound by section 3 of the GNU GPL.
+     2. Conveying Modified Versions.
+    If you modify a copy of the Library, and, in your modifications, a facility refers to a function or data to be supplied by an Application that uses the facility (other than as an argument passed when the facility is invoked), then you may convey a copy of the modified version:
+    a) under this License, provided that you make a good faith effort to ensure that, in the event an Application does not supply the function or data, the facility still operates, and performs whatever part of its purpose remains meaningful, or
+    b) under the GNU GPL, with none of the additional permissions of this License applicable to that copy.
+     3. Object Code Incorporating Material from Library Header Files.
+    The object code form of an Application may incorporate material from a header file that is part of the Library. You may convey such object code under terms of your choice, provided that, if the incorporated material is not limited to numerical parameters, data structure layouts and accessors, or small macros, inline functions and templates (ten or fewer lines in length), you do both of the following:
+    a) Give prominent notice with each copy of the object code that the Library is used in it and that the Library and its use are covered by this License.
+    b) Accompany the object code with a copy of the GNU GPL and this license document.
+     4. Combined Works.
+    You may convey a Combined Work under terms of your choice that, taken together, effectively do not restrict modification of the portions of the Library contained in the Combined Work and reverse engineering for debugging such modifications, if you also do each of the following:
+    a) Give prominent notice with each copy of the Combined Work that the Library is used in it and that the Library and its use are covered by this License.
+    b) Accompany the Combined Work with a copy of the GNU GPL and this license document.
+    c) For a Combined Work that displays copyright notices during execution, include the copyright notice for the Library among these notices, as well as a reference directing the user to the copies of the GNU GPL and this license document.
+    d) Do one of the following:
+        0) Convey the Minimal Corresponding Source under the terms of this License, and the Corresponding Application Code in a form suitable for, and under terms that permit, the user to recombine or relink the Application with a modified version of the Linked Version to produce a modified Combined Work, in the manner specified by section 6 of the GNU GPL for conveying Corresponding Source.
+        1) Use a suitable shared library mechanism for linking with the Library. A suitable mechanism is one that (a) uses at run time a copy of the Library already present on the user's computer system, and (b) will operate properly with a modified version of the Library that is interface-compatible with the Linked Version.
+    e) Provide Installation Information, but only if you would otherwise be required to provide such information under section 6 of the GNU GPL, and only to the extent that such information is necessary to install and execute a modified version of the Combined Work produced by recombining or relinking the Application with a modified version of the Linked Version. (If you use option 4d0, the Installation Information must accompany the Minimal Corresponding Source and Corresponding Application Code. If you use option 4d1, you must provide the Installation Information in the manner specified by section 6 of the GNU GPL for conveying Corresponding Source.)
+     5. Combined Libraries.
+    You may place library facilities that are a work based on the Library side by side in a single library together with other library facilities that are not Applications and are not covered by this License, and convey such a combined library under terms of your choice, if you do both of the following:
+    a) Accompany the combined library with a copy of the same work based on the Library, uncombined with any other library facilities, conveyed under the terms of this License.
+    b) Give prominent notice with the combined library that part of it is a work based on the Library, and explaining where to find the accompanying uncombined form of the same work.
+     6. Revised Versions of the GNU Lesser General Public License.
+    The Free Software Foundation may publish revised and/or new versions of the GNU Lesser General Public License from time to time. Such new versions will be similar in spirit to the present version, but may differ in detail to address new problems or concerns.
+    Each version is given a distinguishing version number. If the Library as you received it specifies that a certain numbered version of the GNU Lesser General Public License “or any later version” applies to it, you have the option of following the terms and conditions either of that published version or of any later version published by the Free Software Foundation. If the Library as you received it does not specify a version number of the GNU Lesser General Public License, you may choose any version of the GNU Lesser General Public License ever published by the Free Software Foundation.
+    If the Library as you received it specifies that a proxy can decide whether future versions of the GNU Lesser General Public License shall apply, that proxy's public statement of acceptance of any version is permanent authorization for you to choose that version for the Library.
+*/
+
+#include <QtTest>
+#include <QtEndian>
+#include <QElapsedTimer>
+#include "crypto.h"
+#include "datagram.h"
+
+#define BF_FRAMEHEADER	4		// length prefix of a frame, as MS_FRAMEHEADER
+#define BF_FRAMES		1000	// frames built or parsed in one round
+#define BF_MINTIME		200		// milliseconds of rounds a result is taken over
+
+/****************************************************************************
+** Class: bench_Frames
+** Description: Builds and parses rounds of BF_FRAMES encrypted message
+**	frames, once with the copies messages used to go through and once in
+**	place, as lmcTcpNetwork and MsgStream handle them now. Each result is in
+**	frames per second, the time per frame is printed with it. The frames are
+**	built by one end of a session and parsed by the other, which is set up
+**	again for each round, as it takes every frame only once.
+****************************************************************************/
+class bench_Frames : public QObject
+{
+	Q_OBJECT
+
+private slots:
+	void initTestCase(void);
+	void buildCopied_data(void);
+	void buildCopied(void);
+	void buildInPlace_data(void);
+	void buildInPlace(void);
+	void parseCopied_data(void);
+	void parseCopied(void);
+	void parseInPlace_data(void);
+	void parseInPlace(void);
+
+private:
+	lmcCrypto sender;
+	lmcCrypto receiver;
+	QString peerId;
+	QByteArray keyIv;
+
+	void addSizes(void);
+	void report(qint64 nNanoseconds, qint64 nFrames);
+	QByteArray frameCopied(QByteArray& clearData);
+	QByteArray frameInPlace(const QByteArray& clearData);
+	QByteArray stream(int nSize);
+	int parseFramesCopied(const QByteArray& data);
+	int parseFramesInPlace(const QByteArray& data, QByteArray& clearData);
+};
+
+void bench_Frames::initTestCase(void) {
+	peerId = "66778899aabbjanedoe";
+	keyIv = sender.newSessionKey(CM_Gcm);
+	sender.setSessionKey(&peerId, keyIv, true);
+
+	//	both ways must put the same bytes on the wire, apart from the nonce
+	QByteArray clearData(300, 'm');
+	QByteArray copied = frameCopied(clearData);
+	QByteArray inPlace = frameInPlace(clearData);
+	QCOMPARE(copied.length(), inPlace.length());
+	QCOMPARE(copied.left(BF_FRAMEHEADER + DT_TYPELENGTH), inPlace.left(BF_FRAMEHEADER + DT_TYPELENGTH));
+}
+
+void bench_Frames::addSizes(void) {
+	QTest::addColumn<int>("size");
+	QTest::newRow("100 bytes") << 100;
+	QTest::newRow("chat 200 bytes") << 200;
+	QTest::newRow("user data 2 KB") << 2048;
+	QTest::newRow("file data 16 KB") << 16384;
+	QTest::newRow("64 KiB") << 65536;
+}
+
+//	Frames per second is the result, the time per frame is printed
+void bench_Frames::report(qint64 nNanoseconds, qint64 nFrames) {
+	double nsPerFrame = (double)nNanoseconds / nFrames;
+	qDebug("%.0f ns/frame", nsPerFrame);
+	QTest::setBenchmarkResult(1000000000.0 / nsPerFrame, QTest::FramesPerSecond);
+}
+
+//	The type was put in front of the cipher text, then the whole of it was
+//	copied again behind the length
+QByteArray bench_Frames::frameCopied(QByteArray& clearData) {
+	QByteArray datagram = sender.encrypt(&peerId, clearData);
+	datagram.insert(0, DatagramTypeNames[DT_Message].toLatin1());
+
+	QByteArray frame;
+	frame.resize(BF_FRAMEHEADER);
+	qToBigEndian<quint32>(datagram.length(), (uchar*)frame.data());
+	frame.append(datagram);
+	return frame;
+}
+
+//	The frame is laid out in one buffer and the cipher text written into it
+QByteArray bench_Frames::frameInPlace(const QByteArray& clearData) {
+	QByteArray frame;
+	frame.reserve(BF_FRAMEHEADER + DT_TYPELENGTH + clearData.length() + LC_MAXOVERHEAD);
+	frame.resize(BF_FRAMEHEADER);
+	frame.append(DatagramTypeNames[DT_Message].toLatin1());
+	sender.encrypt(&peerId, clearData, frame);
+	qToBigEndian<quint32>(frame.length() - BF_FRAMEHEADER, (uchar*)frame.data());
+	return frame;
+}
+
+//	A round of frames as they come in from the socket, for a receiving end
+//	set up for them
+QByteArray bench_Frames::stream(int nSize) {
+	receiver.setSessionKey(&peerId, keyIv, false);
+	QByteArray clearData(nSize, 'm');
+	QByteArray data;
+	for(int index = 0; index < BF_FRAMES; index++)
+		data.append(frameInPlace(clearData));
+	return data;
+}
+
+//	Each frame was cut out of the receive buffer, then the type and the cipher
+//	text were cut out of the frame, and the cipher text decrypted into a new array
+int bench_Frames::parseFramesCopied(const QByteArray& data) {
+	QByteArray inData = data;
+	int frames = 0;
+	while(inData.length() >= BF_FRAMEHEADER) {
+		quint32 frameLen = qFromBigEndian<quint32>((const uchar*)inData.constData());
+		QByteArray frame = inData.mid(BF_FRAMEHEADER, frameLen);
+		inData.remove(0, BF_FRAMEHEADER + frameLen);
+		QString type = QString::fromLatin1(frame.mid(0, DT_TYPELENGTH));
+		QByteArray cipherData = frame.mid(DT_TYPELENGTH);
+		if(type == DatagramTypeNames[DT_Message] && !receiver.decrypt(&peerId, cipherData).isEmpty())
+			frames++;
+	}
+	return frames;
+}
+
+//	Frames and their cipher text are read through views into the receive buffer,
+//	and decrypted into one buffer that is reused
+int bench_Frames::parseFramesInPlace(const QByteArray& data, QByteArray& clearData) {
+	QByteArray type = DatagramTypeNames[DT_Message].toLatin1();
+	int pos = 0;
+	int frames = 0;
+	while(data.length() - pos >= BF_FRAMEHEADER) {
+		quint32 frameLen = qFromBigEndian<quint32>((const uchar*)data.constData() + pos);
+		const char* frame = data.constData() + pos + BF_FRAMEHEADER;
+		pos += BF_FRAMEHEADER + frameLen;
+		QByteArray cipherData = QByteArray::fromRawData(frame + DT_TYPELENGTH, frameLen - DT_TYPELENGTH);
+		if(memcmp(frame, type.constData(), DT_TYPELENGTH) == 0 && receiver.decrypt(&peerId, cipherData, clearData))
+			frames++;
+	}
+	return frames;
+}
+
+void bench_Frames::buildCopied_data(void) {
+	addSizes();
+}
+
+void bench_Frames::buildCopied(void) {
+	QFETCH(int, size);
+	QByteArray clearData(size, 'm');
+	qint64 frames = 0;
+	QElapsedTimer timer;
+	timer.start();
+	do {
+		for(int index = 0; index < BF_FRAMES; index++)
+			frameCopied(clearData);
+		frames += BF_FRAMES;
+	} while(timer.elapsed() < BF_MINTIME);
+	report(timer.nsecsElapsed(), frames);
+}
+
+void bench_Frames::buildInPlace_data(void) {
+	addSizes();
+}
+
+void bench_Frames::buildInPlace(void) {
+	QFETCH(int, size);
+	QByteArray clearData(size, 'm');
+	qint64 frames = 0;
+	QElapsedTimer timer;
+	timer.start();
+	do {
+		for(int index = 0; index < BF_FRAMES; index++)
+			frameInPlace(clearData);
+		frames += BF_FRAMES;
+	} while(timer.elapsed() < BF_MINTIME);
+	report(timer.nsecsElapsed(), frames);
+}
+
+void bench_Frames::parseCopied_data(void) {
+	addSizes();
+}
+
+//	Each round parses frames made for it, outside the time taken
+void bench_Frames::parseCopied(void) {
+	QFETCH(int, size);
+	qint64 elapsed = 0;
+	qint64 frames = 0;
+	while(elapsed < (qint64)BF_MINTIME * 1000000) {
+		QByteArray data = stream(size);
+		QElapsedTimer timer;
+		timer.start();
+		int parsed = parseFramesCopied(data);
+		elapsed += timer.nsecsElapsed();
+		QCOMPARE(parsed, BF_FRAMES);
+		frames += parsed;
+	}
+	report(elapsed, frames);
+}
+
+void bench_Frames::parseInPlace_data(void) {
+	addSizes();
+}
+
+void bench_Frames::parseInPlace(void) {
+	QFETCH(int, size);
+	QByteArray clearData;
+	qint64 elapsed = 0;
+	qint64 frames = 0;
+	while(elapsed < (qint64)BF_MINTIME * 1000000) {
+		QByteArray data = stream(size);
+		QElapsedTimer timer;
+		timer.start();
+		int parsed = parseFramesInPlace(data, clearData);
+		elapsed += timer.nsecsElapsed();
+		QCOMPARE(parsed, BF_FRAMES);
+		frames += parsed;
+	}
+	report(elapsed, frames);
+}
+
+QTEST_MAIN(bench_Frames)
+
+#include "bench_frames.moc"
@@ -0,0 +1,34 @@
+#-----------------------------------------------------------------------------
+#
+# frames.pro
+#   times building and parsing message frames in place against copying them
+#
+#-----------------------------------------------------------------------------
+
+TARGET = bench_frames
+
+TEMPLATE = app
+
+QT += core network testlib
+
+CONFIG += console
+CONFIG -= app_bundle
+
+LMC = $$PWD/../..
+
+INCLUDEPATH += \
+    $$LMC/trace \
+    $$LMC/crypto \
+    $$LMC/messaging
+
+win32:INCLUDEPATH += $$LMC/openssl/include
+win32:LIBS += -L$$LMC/openssl/lib/ -llibeay32
+unix:LIBS += -lcrypto
+
+HEADERS += \
+    $$LMC/crypto/crypto.h \
+    $$LMC/messaging/datagram.h
+
+SOURCES += \
+    bench_frames.cpp \
+    $$LMC/crypto/crypto.cpp
@@ -0,0 +1,197 @@
+/*
+    lmc-clone
+    http://code.google.com/p/lmc-clone
+
+    lmc is a lan messenger, instant messaging client.
+    http://lanmsngr.sourceforge.net/
+    http://sourceforge.net/projects/lanmsngr/
+
+    GNU LESSER GENERAL PUBLIC LICENSE
+    Version 3, 29 June 2007
+    Copyright (c) 2007 Free Software Foundation, Inc. <http://fsf.org/>
+    Everyone is permitted to copy and distribute verbatim copies of this license document, but changing it is not allowed.
+    This version of the GNU Lesser General Public License incorporates the terms and conditions of version 3 of the GNU General Public License, supplemented by the additional permissions listed below.
+     0. Additional Definitions.
+    As used herein, “this License” refers to version 3 of the GNU Lesser General Public License, and the “GNU GPL” refers to version 3 of the GNU General Public License.
+    “The Library” refers to a covered work governed by this License, other than an Application or a Combined Work as defined below.
+    An “Application” is any work that makes use of an interface provided by the Library, but which is not otherwise based on the Library. Defining a subclass of a class defined by the Library is deemed a mode of using an interface provided by the Library.
+    A “Combined Work” is a work produced by combining or linking an Application with the Library. The particular version of the Library with which the Combined Work was made is also called the “Linked Version”.
+    The “Minimal Corresponding Source” for a Combined Work means the Corresponding Source for the Combined Work, excluding any source code for portions of the Combined Work that, considered in isolation, are based on the Application, and not on the Linked Version.
+    The “Corresponding Application Code” for a Combined Work means the object code and/or source code for the Application, including any data and utility programs needed for reproducing the Combined Work from the Application, but excluding the System Libraries of the Combined Work.
+     1. Exception to Section 3 of the GNU GPL.
+    You may convey a covered work under sections 3 and 4 of this License without being bound by section 3 of the GNU GPL.
+     2. Conveying Modified Versions.
+    If you modify a copy of the Library, and, in your modifications, a facility refers to a function or data to be supplied by an Application that uses the facility (other than as an argument passed when the facility is invoked), then you may convey a copy of the modified version:
+    a) under this License, provided that you make a good faith effort to ensure that, in the event an Application does not supply the function or data, the facility still operates, and performs whatever part of its purpose remains meaningful, or
+    b) under the GNU GPL, with none of the additional permissions of this License applicable to that copy.
+     3. Object Code Incorporating Material from Library Header Files.
+    The object code form of an Application may incorporate material from a header file that is part of the Library. You may convey such object code under terms of your choice, provided that, if the incorporated material is not limited to numerical parameters, data structure layouts and accessors, or small macros, inline functions and templates (ten or fewer lines in length), you do both of the following:
+    a) Give prominent notice with each copy of the object code that the Library is used in it and that the Library and its use are covered by this License.
+    b) Accompany the object code with a copy of the GNU GPL and this license document.
+     4. Combined Works.
+    You may convey a Combined Work under terms of your choice that, taken together, effectively do not restrict modification of the portions of the Library contained in the Combined Work and reverse engineering for debugging such modifications, if you also do each of the following:
+    a) Give prominent notice with each copy of the Combined Work that the Library is used in it and that the Library and its use are covered by this License.
+    b) Accompany the Combined Work with a copy of the GNU GPL and this license document.
+    c) For a Combined Work that displays copyright notices during execution, include the copyright notice for the Library among these notices, as well as a reference directing the user to the copies of the GNU GPL and this license document.
+    d) Do one of the following:
+        0) Convey the Minimal Corresponding Source under the terms of this License, and the Corresponding Application Code in a form suitable for, and under terms that permit, the user to recombine or relink the Application with a modified version of the Linked Version to produce a modified Combined Work, in the manner specified by section 6 of the GNU GPL for conveying Corresponding Source.
+        1) Use a suitable shared library mechanism for linking with the Library. A suitable mechanism is one that (a) uses at run time a copy of the Library already present on the user's computer system, and (b) will operate properly with a modified version of the Library that is interface-compatible with the Linked Version.
+    e) Provide Installation Information, but only if you would otherwise be required to provide such information under section 6 of the GNU GPL, and only to the extent that such information is necessary to install and execute a modified version of the Combined Work produced by recombining or relinking the Application with a modified version of the Linked Version. (If you use option 4d0, the Installation Information must accompany the Minimal Corresponding Source and Corresponding Application Code. If you use option 4d1, you must provide the Installation Information in the manner specified by section 6 of the GNU GPL for conveying Corresponding Source.)
+     5. Combined Libraries.
+    You may place library facilities that are a work based on the Library side by side in a single library together with other library facilities that are not Applications and are not covered by this License, and convey such a combined library under terms of your choice, if you do both of the following:
+    a) Accompany the combined library with a copy of the same work based on the Library, uncombined with any other library facilities, conveyed under the terms of this License.
+    b) Give prominent notice with the combined library that part of it is a work based on the Library, and explaining where to find the accompanying uncombined form of the same work.
+     6. Revised Versions of the GNU Lesser General Public License.
+    The Free Software Foundation may publish revised and/or new versions of the GNU Lesser General Public License from time to time. Such new versions will be similar in spirit to the present version, but may differ in detail to address new problems or concerns.
+    Each version is given a distinguishing version number. If the Library as you received it specifies that a certain numbered version of the GNU Lesser General Public License “or any later version” applies to it, you have the option of following the terms and conditions either of that published version or of any later version published by the Free Software Foundation. If the Library as you received it does not specify a version number of the GNU Lesser General Public License, you may choose any version of the GNU Lesser General Public License ever published by the Free Software Foundation.
+    If the Library as you received it specifies that a proxy can decide whether future versions of the GNU Lesser General Public License shall apply, that proxy's public statement of acceptance of any version is permanent authorization for you to choose that version for the Library.
+*/
+
+#include <QtTest>
+#include <QDomDocument>
+#include "xmlmessage.h"
+
+/****************************************************************************
+** Class: bench_XmlParse
+** Description: Parses representative messages and reads the fields the
+**	messaging layer reads for each, once into a document tree with
+**	elementsByTagName() lookups as messages used to be read, and once
+**	into the field table of XmlMessage.
+****************************************************************************/
+class bench_XmlParse : public QObject
+{
+	Q_OBJECT
+
+private slots:
+	void initTestCase(void);
+	void domParse_data(void);
+	void domParse(void);
+	void tableParse_data(void);
+	void tableParse(void);
+
+private:
+	QList<QString> samples;
+	QStringList sampleNames;
+	QStringList lookupSections;
+	QStringList lookupNames;
+
+	void addSamples(void);
+	static QString domValue(const QDomDocument& document, const QString& szSection, const QString& szName);
+	static QString tableValue(const XmlMessage& message, const QString& szSection, const QString& szName);
+};
+
+void bench_XmlParse::initTestCase(void) {
+	XmlMessage chat;
+	chat.addHeader(XN_FROM, "001122334455johndoe");
+	chat.addHeader(XN_TO, "66778899aabbjanedoe");
+	chat.addHeader(XN_MESSAGEID, "1042");
+	chat.addHeader(XN_TYPE, "message");
+	chat.addData(XN_MESSAGE, "Are we still meeting at three? I have the figures for the review ready.");
+	chat.addData(XN_FONT, "MS Shell Dlg 2,8.25,-1,5,50,0,0,0,0,0");
+	chat.addData(XN_COLOR, "#000000");
+	samples.append(chat.toString());
+	sampleNames.append("chat");
+
+	XmlMessage userData;
+	userData.addHeader(XN_FROM, "001122334455johndoe");
+	userData.addHeader(XN_TO, "66778899aabbjanedoe");
+	userData.addHeader(XN_MESSAGEID, "1043");
+	userData.addHeader(XN_TYPE, "userdata");
+	userData.addData(XN_USERID, "001122334455johndoe");
+	userData.addData(XN_NAME, "John Doe");
+	userData.addData(XN_ADDRESS, "192.168.1.20");
+	userData.addData(XN_VERSION, "2.0.5");
+	userData.addData(XN_STATUS, "chat");
+	userData.addData(XN_NOTE, "Back at two");
+	userData.addData(XN_QUERYOP, "get");
+	samples.append(userData.toString());
+	sampleNames.append("userdata");
+
+	XmlMessage file;
+	file.addHeader(XN_FROM, "001122334455johndoe");
+	file.addHeader(XN_TO, "66778899aabbjanedoe");
+	file.addHeader(XN_MESSAGEID, "1044");
+	file.addHeader(XN_TYPE, "file");
+	file.addData(XN_MODE, "send");
+	file.addData(XN_FILETYPE, "file");
+	file.addData(XN_FILEOP, "request");
+	file.addData(XN_FILEID, "5f0c1d9e2b7a4c3d8e6f1a2b3c4d5e6f");
+	file.addData(XN_FILEPATH, "/home/john/documents/quarterly figures.xlsx");
+	file.addData(XN_FILENAME, "quarterly figures.xlsx");
+	file.addData(XN_FILESIZE, "482133");
+	samples.append(file.toString());
+	sampleNames.append("file");
+
+	//	what dispatching a message reads, the body field is the last one of each sample
+	lookupSections << XN_HEAD << XN_HEAD << XN_HEAD << XN_BODY << XN_BODY << XN_BODY;
+	lookupNames << XN_FROM << XN_TYPE << XN_MESSAGEID << XN_MESSAGE << XN_QUERYOP << XN_FILESIZE;
+
+	//	both ways must read the same values before their times mean anything
+	for(int index = 0; index < samples.count(); index++) {
+		QDomDocument document;
+		QVERIFY(document.setContent(samples[index]));
+		XmlMessage message(samples[index]);
+		QVERIFY(message.isValid());
+		for(int field = 0; field < lookupNames.count(); field++)
+			QCOMPARE(tableValue(message, lookupSections[field], lookupNames[field]),
+				domValue(document, lookupSections[field], lookupNames[field]));
+	}
+}
+
+void bench_XmlParse::addSamples(void) {
+	QTest::addColumn<QString>("text");
+	for(int index = 0; index < samples.count(); index++)
+		QTest::newRow(sampleNames[index].toLatin1().constData()) << samples[index];
+}
+
+void bench_XmlParse::domParse_data(void) {
+	addSamples();
+}
+
+void bench_XmlParse::domParse(void) {
+	QFETCH(QString, text);
+	QBENCHMARK {
+		QDomDocument document;
+		document.setContent(text);
+		for(int field = 0; field < lookupNames.count(); field++)
+			domValue(document, lookupSections[field], lookupNames[field]);
+	}
+}
+
+void bench_XmlParse::tableParse_data(void) {
+	addSamples();
+}
+
+void bench_XmlParse::tableParse(void) {
+	QFETCH(QString, text);
+	QBENCHMARK {
+		XmlMessage message(text);
+		for(int field = 0; field < lookupNames.count(); field++)
+			tableValue(message, lookupSections[field], lookupNames[field]);
+	}
+}
+
+//	A field looked up as XmlMessage did while it was a QDomDocument
+QString bench_XmlParse::domValue(const QDomDocument& document, const QString& szSection, const QString& szName) {
+	QDomElement root = document.documentElement();
+	if(root.isNull())
+		return QString::null;
+
+	QDomNodeList nodes = root.elementsByTagName(szSection);
+	if(nodes.isEmpty())
+		return QString::null;
+
+	nodes = nodes.at(0).toElement().elementsByTagName(szName);
+	if(nodes.isEmpty())
+		return QString::null;
+
+	return nodes.at(0).toElement().text();
+}
+
+QString bench_XmlParse::tableValue(const XmlMessage& message, const QString& szSection, const QString& szName) {
+	return (szSection == XN_HEAD) ? message.header(szName) : message.data(szName);
+}
+
+QTEST_MAIN(bench_XmlParse)
+
+#include "bench_xmlparse.moc"
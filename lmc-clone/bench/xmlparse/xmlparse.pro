@@ -0,0 +1,30 @@
+#-----------------------------------------------------------------------------
+#
+# xmlparse.pro
+#   times parsing a message into a document tree against the field table
+#
+#-----------------------------------------------------------------------------
+
+TARGET = bench_xmlparse
+
+TEMPLATE = app
+
+QT += core network xml testlib
+
+CONFIG += console
+CONFIG -= app_bundle
+
+LMC = $$PWD/../..
+
+INCLUDEPATH += \
+    $$LMC/messaging
+
+HEADERS += \
+    $$LMC/messaging/nametable.h \
+    $$LMC/messaging/typedmessage.h \
+    $$LMC/messaging/xmlmessage.h
+
+SOURCES += \
+    bench_xmlparse.cpp \
+    $$LMC/messaging/nametable.cpp \
+    $$LMC/messaging/xmlmessage.cpp
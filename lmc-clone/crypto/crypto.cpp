@@ -54,13 +54,33 @@
 
 #include "crypto.h"
 
+#include <QMutex>
+#include <QStringList>
+#include <QtEndian>
+#include <cstring>
+
+//	OpenSSL 1.0 is only safe to use from several threads with locks supplied
+//	by the application
+static QMutex* cryptoLocks = NULL;
+
+static void lockingCallback(int mode, int n, const char* file, int line)
+{
+	Q_UNUSED(file);
+	Q_UNUSED(line);
+
+	if(mode & CRYPTO_LOCK)
+		cryptoLocks[n].lock();
+	else
+		cryptoLocks[n].unlock();
+}
+
 //-----------------------------------------------------------------------------
 
 lmcCrypto::lmcCrypto(void)
 {
+	initThreading();
 	pRsa = NULL;
-	encryptMap.clear();
-	decryptMap.clear();
+	sessions.clear();
 	bits = 1024;
 	exponent = 65537;
 }
@@ -74,10 +94,15 @@ lmcCrypto::~lmcCrypto(void)
         RSA_free(pRsa);
         pRsa = NULL;
     }
+
+	QStringList userIds = sessions.keys();
+	for(int index = 0; index < userIds.count(); index++)
+		removeKeys(&userIds[index]);
 }
 
 //-----------------------------------------------------------------------------
-//	creates an RSA key pair and returns the string representation of the public key
+//	creates an RSA key pair and returns the string representation of the public key.
+//	The gcm marker after the key is passed over by versions that do not know it.
 QByteArray lmcCrypto::generateRSA(void)
 {
 	unsigned char* buf = (unsigned char*)malloc(bits);
@@ -90,6 +115,7 @@ QByteArray lmcCrypto::generateRSA(void)
 	char* pem_key = (char*)calloc(keylen + 1, 1);
 	BIO_read(bio, pem_key, keylen);
 	publicKey = QByteArray(pem_key, keylen);
+	publicKey.append(LC_GCMMARKER "\n");
 	BIO_free_all(bio);
 	free(pem_key);
 	free(buf);
@@ -101,130 +127,315 @@ QByteArray lmcCrypto::generateRSA(void)
 //	generates a random aes key and iv, and encrypts it with the public key
 QByteArray lmcCrypto::generateAES(QString* lpszUserId, QByteArray& pubKey)
 {
-	char* pemKey = pubKey.data();
-	RSA* rsa = RSA_new();
-	BIO* bio = BIO_new_mem_buf(pemKey, pubKey.length());
-	PEM_read_bio_RSAPublicKey(bio, &rsa, NULL, NULL);
-	
+	QByteArray keyIv = newSessionKey(modeFor(pubKey));
+	setSessionKey(lpszUserId, keyIv, true);
+	return sealSessionKey(pubKey, keyIv);
+}
+
+//-----------------------------------------------------------------------------
+//	decrypts the aes key and iv with the private key, fails for a key that was
+//	encrypted with another public key
+bool lmcCrypto::retreiveAES(QString* lpszUserId, QByteArray& aesKeyIv)
+{
+	QByteArray keyIv = openSessionKey(aesKeyIv);
+	if(keyIv.isEmpty())
+		return false;
+
+	setSessionKey(lpszUserId, keyIv, false);
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+//	returns a random aes key followed by its iv, and the mode byte for any mode
+//	other than cbc
+QByteArray lmcCrypto::newSessionKey(CipherMode mode)
+{
 	int keyDataLen = 32;
 	unsigned char* keyData = (unsigned char*)malloc(keyDataLen);
 	RAND_bytes(keyData, keyDataLen);
-	int keyLen = 32;
-	int ivLen = EVP_CIPHER_iv_length(EVP_aes_256_cbc());
-	int keyIvLen = keyLen + ivLen;
-	unsigned char* keyIv = (unsigned char*)malloc(keyIvLen);
+	int keyLen = LC_KEYLENGTH;
+	QByteArray keyIv(LC_KEYIVLENGTH, 0);
+	unsigned char* pKeyIv = (unsigned char*)keyIv.data();
 	int rounds = 5;
-	keyLen = EVP_BytesToKey(EVP_aes_256_cbc(), EVP_sha1(), NULL, keyData, keyDataLen, rounds, keyIv, keyIv + keyLen);
+	EVP_BytesToKey(EVP_aes_256_cbc(), EVP_sha1(), NULL, keyData, keyDataLen, rounds, pKeyIv, pKeyIv + keyLen);
+	free(keyData);
 
-	EVP_CIPHER_CTX ectx, dctx;
-	EVP_CIPHER_CTX_init(&ectx);
-	EVP_EncryptInit_ex(&ectx, EVP_aes_256_cbc(), NULL, keyIv, keyIv + keyLen);
-	encryptMap.insert(*lpszUserId, ectx);
-	EVP_CIPHER_CTX_init(&dctx);
-	EVP_DecryptInit_ex(&dctx, EVP_aes_256_cbc(), NULL, keyIv, keyIv + keyLen);
-	decryptMap.insert(*lpszUserId, dctx);
+	if(mode != CM_Cbc)
+		keyIv.append((char)mode);
+	return keyIv;
+}
 
-	unsigned char* eKeyIv = (unsigned char*)malloc(RSA_size(rsa));
-	int eKeyIvLen = RSA_public_encrypt(keyIvLen, keyIv, eKeyIv, rsa, RSA_PKCS1_OAEP_PADDING);
-	QByteArray baKeyIv((char*)eKeyIv, eKeyIvLen);
+//-----------------------------------------------------------------------------
+//	sets up the cipher contexts of a user with a key made by newSessionKey or
+//	read by openSessionKey, replacing those of an earlier key. The contexts are
+//	kept for the session, only the iv is set again for each message. bSender
+//	is true on the side that made the key, so that the gcm nonces of the two
+//	directions never meet.
+void lmcCrypto::setSessionKey(QString* lpszUserId, const QByteArray& keyIv, bool bSender)
+{
+	removeKeys(lpszUserId);
+
+	const unsigned char* key = (const unsigned char*)keyIv.constData();
+	CipherSession* session = new CipherSession;
+	session->mode = CM_Cbc;
+	if(keyIv.length() > LC_KEYIVLENGTH && (quint8)keyIv.at(LC_KEYIVLENGTH) == CM_Gcm)
+		session->mode = CM_Gcm;
+	session->encryptCtx = EVP_CIPHER_CTX_new();
+	session->decryptCtx = EVP_CIPHER_CTX_new();
+	session->counter = 0;
+	session->nextCounter = 0;
+	session->loopback = false;
+
+	if(session->mode == CM_Gcm) {
+		//	the nonce starts with the side it is sent from, the rest of the iv
+		//	keeps it unpredictable, the message counter follows
+		memcpy(session->nonce, key + LC_KEYLENGTH, LC_NONCEPREFIX);
+		memcpy(session->peerPrefix, key + LC_KEYLENGTH, LC_NONCEPREFIX);
+		session->nonce[0] = bSender ? 0x01 : 0x02;
+		session->peerPrefix[0] = bSender ? 0x02 : 0x01;
+		EVP_EncryptInit_ex(session->encryptCtx, EVP_aes_256_gcm(), NULL, key, NULL);
+		EVP_DecryptInit_ex(session->decryptCtx, EVP_aes_256_gcm(), NULL, key, NULL);
+	} else {
+		memset(session->nonce, 0, LC_NONCELENGTH);
+		memset(session->peerPrefix, 0, LC_NONCEPREFIX);
+		EVP_EncryptInit_ex(session->encryptCtx, EVP_aes_256_cbc(), NULL, key, key + LC_KEYLENGTH);
+		EVP_DecryptInit_ex(session->decryptCtx, EVP_aes_256_cbc(), NULL, key, key + LC_KEYLENGTH);
+	}
+	sessions.insert(*lpszUserId, session);
 
+#ifdef USE_LMC_TRACE
+	lmctrace("Session cipher with user " + *lpszUserId + " is " + CipherModeNames[session->mode]);
+#endif
+}
+
+//-----------------------------------------------------------------------------
+//	encrypts an aes key and iv with a public key, returns an empty array if the
+//	public key cannot be read. Safe to call from any thread.
+QByteArray lmcCrypto::sealSessionKey(const QByteArray& pubKey, const QByteArray& keyIv)
+{
+	BIO* bio = BIO_new_mem_buf((void*)pubKey.constData(), pubKey.length());
+	RSA* rsa = PEM_read_bio_RSAPublicKey(bio, NULL, NULL, NULL);
 	BIO_free_all(bio);
+	if(!rsa)
+		return QByteArray();
+
+	unsigned char* eKeyIv = (unsigned char*)malloc(RSA_size(rsa));
+	int eKeyIvLen = RSA_public_encrypt(keyIv.length(), (const unsigned char*)keyIv.constData(), eKeyIv, rsa, RSA_PKCS1_OAEP_PADDING);
+	QByteArray baKeyIv;
+	if(eKeyIvLen > 0)
+		baKeyIv = QByteArray((char*)eKeyIv, eKeyIvLen);
+
 	RSA_free(rsa);
-	free(keyIv);
 	free(eKeyIv);
-	free(keyData);
 
 	return baKeyIv;
 }
 
 //-----------------------------------------------------------------------------
-//	decrypts the aes key and iv with the private key
-void lmcCrypto::retreiveAES(QString* lpszUserId, QByteArray& aesKeyIv)
+//	decrypts an aes key and iv with the private key, returns an empty array for
+//	a key that was encrypted with another public key. Safe to call from any
+//	thread once the key pair has been generated.
+QByteArray lmcCrypto::openSessionKey(const QByteArray& aesKeyIv)
 {
 	unsigned char* keyIv = (unsigned char*)malloc(RSA_size(pRsa));
-    RSA_private_decrypt(aesKeyIv.length(), (unsigned char*)aesKeyIv.data(), keyIv, pRsa, RSA_PKCS1_OAEP_PADDING);
-
-	int keyLen = 32;
-	EVP_CIPHER_CTX ectx, dctx;
-	EVP_CIPHER_CTX_init(&ectx);
-	EVP_EncryptInit_ex(&ectx, EVP_aes_256_cbc(), NULL, keyIv, keyIv + keyLen);
-	encryptMap.insert(*lpszUserId, ectx);
-	EVP_CIPHER_CTX_init(&dctx);
-	EVP_DecryptInit_ex(&dctx, EVP_aes_256_cbc(), NULL, keyIv, keyIv + keyLen);
-	decryptMap.insert(*lpszUserId, dctx);
+	int keyIvLen = RSA_private_decrypt(aesKeyIv.length(), (const unsigned char*)aesKeyIv.constData(), keyIv, pRsa, RSA_PKCS1_OAEP_PADDING);
 
+	QByteArray baKeyIv;
+	if(keyIvLen >= LC_KEYIVLENGTH)
+		baKeyIv = QByteArray((char*)keyIv, keyIvLen);
 	free(keyIv);
+
+	return baKeyIv;
 }
 
 //-----------------------------------------------------------------------------
+//	gcm is used with an instance that marks its public key as reading it,
+//	older versions only know cbc
+CipherMode lmcCrypto::modeFor(const QByteArray& pubKey)
+{
+	return pubKey.contains(LC_GCMMARKER) ? CM_Gcm : CM_Cbc;
+}
 
-QByteArray lmcCrypto::encrypt(QString* lpszUserId, QByteArray& clearData)
+//-----------------------------------------------------------------------------
+//	the connection of an instance to itself reads the messages of both its ends
+//	with one session, so the nonces it reads are its own and come in the order
+//	the two connections deliver them
+void lmcCrypto::setLoopback(QString* lpszUserId)
 {
-	int outLen = clearData.length() + AES_BLOCK_SIZE;
-	unsigned char* outBuffer = (unsigned char*)malloc(outLen);
-    if(outBuffer == NULL)
-    {
+	CipherSession* session = sessions.value(*lpszUserId, NULL);
+	if(session)
+		session->loopback = true;
+}
+
+//-----------------------------------------------------------------------------
+//	a gcm message must come from the other end of the session, and carry a
+//	counter above that of the last message accepted, so that a recorded message
+//	is neither taken again nor sent back to the end it came from
+bool lmcCrypto::acceptNonce(CipherSession* session, const unsigned char* nonce)
+{
+	if(session->loopback)
+		return true;
+
+	return memcmp(nonce, session->peerPrefix, LC_NONCEPREFIX) == 0 &&
+		qFromBigEndian<quint64>(nonce + LC_NONCEPREFIX) >= session->nextCounter;
+}
+
+//-----------------------------------------------------------------------------
+//	releases the cipher contexts of a user whose connection has been closed,
+//	a new key is exchanged when the user is connected again
+void lmcCrypto::removeKeys(QString* lpszUserId)
+{
+	CipherSession* session = sessions.take(*lpszUserId);
+	if(!session)
+		return;
+
+	EVP_CIPHER_CTX_free(session->encryptCtx);
+	EVP_CIPHER_CTX_free(session->decryptCtx);
+	delete session;
+}
+
+//-----------------------------------------------------------------------------
+
+//	encrypts straight into the end of outData, so that a caller can build a
+//	whole frame in one buffer without copying the cipher text afterwards.
+//	A gcm message is laid out as nonce, cipher text and tag.
+bool lmcCrypto::encrypt(QString* lpszUserId, const QByteArray& clearData, QByteArray& outData)
+{
+	CipherSession* session = sessions.value(*lpszUserId, NULL);
+	if(!session) {
 #ifdef USE_LMC_TRACE
-        lmctrace("Error: Buffer not allocated");
+		lmctrace("Error: Message encryption failed, no session key");
 #endif
-		return QByteArray();
+		return false;
 	}
+
+	EVP_CIPHER_CTX* ctx = session->encryptCtx;
+	const unsigned char* inBuffer = (const unsigned char*)clearData.constData();
+	int offset = outData.length();
+	int outLen = 0;
 	int foutLen = 0;
 
-	EVP_CIPHER_CTX ctx = encryptMap.value(*lpszUserId);
-	if(EVP_EncryptInit_ex(&ctx, NULL, NULL, NULL, NULL)) {
-		if(EVP_EncryptUpdate(&ctx, outBuffer, &outLen, (unsigned char*)clearData.data(), clearData.length())) {
-			if(EVP_EncryptFinal_ex(&ctx, outBuffer + outLen, &foutLen)) {
-				outLen += foutLen;
-				QByteArray byteArray((char*)outBuffer, outLen);
-				free(outBuffer);
-				return byteArray;
+	if(session->mode == CM_Gcm) {
+		outData.resize(offset + LC_NONCELENGTH + clearData.length() + LC_TAGLENGTH);
+		unsigned char* nonce = (unsigned char*)outData.data() + offset;
+		unsigned char* outBuffer = nonce + LC_NONCELENGTH;
+		qToBigEndian<quint64>(session->counter++, session->nonce + LC_NONCEPREFIX);
+		memcpy(nonce, session->nonce, LC_NONCELENGTH);
+		if(EVP_EncryptInit_ex(ctx, NULL, NULL, NULL, nonce)) {
+			if(EVP_EncryptUpdate(ctx, outBuffer, &outLen, inBuffer, clearData.length())) {
+				if(EVP_EncryptFinal_ex(ctx, outBuffer + outLen, &foutLen)) {
+					if(EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, LC_TAGLENGTH, outBuffer + outLen + foutLen)) {
+						outData.resize(offset + LC_NONCELENGTH + outLen + foutLen + LC_TAGLENGTH);
+						return true;
+					}
+				}
+			}
+		}
+	} else {
+		outData.resize(offset + clearData.length() + AES_BLOCK_SIZE);
+		unsigned char* outBuffer = (unsigned char*)outData.data() + offset;
+		if(EVP_EncryptInit_ex(ctx, NULL, NULL, NULL, NULL)) {
+			if(EVP_EncryptUpdate(ctx, outBuffer, &outLen, inBuffer, clearData.length())) {
+				if(EVP_EncryptFinal_ex(ctx, outBuffer + outLen, &foutLen)) {
+					outData.resize(offset + outLen + foutLen);
+					return true;
+				}
 			}
 		}
 	}
 
+	outData.resize(offset);
 #ifdef USE_LMC_TRACE
     lmctrace("Error: Message encryption failed");
 #endif
 
-	return QByteArray();
+	return false;
 }
 
 //-----------------------------------------------------------------------------
 
-QByteArray lmcCrypto::decrypt(QString* lpszUserId, QByteArray& cipherData)
+QByteArray lmcCrypto::encrypt(QString* lpszUserId, QByteArray& clearData)
 {
-	int outLen = cipherData.length();
-	unsigned char* outBuffer = (unsigned char*)malloc(outLen);
-    if(outBuffer == NULL)
-    {
+	QByteArray cipherData;
+	cipherData.reserve(clearData.length() + LC_MAXOVERHEAD);
+	encrypt(lpszUserId, clearData, cipherData);
+	return cipherData;
+}
+
+//-----------------------------------------------------------------------------
+
+//	decrypts into outData, which is resized to the clear text. The buffer of
+//	outData is reused when it is large enough. A gcm message whose tag does not
+//	match is refused, as is one that was replayed or sent back to its sender.
+bool lmcCrypto::decrypt(QString* lpszUserId, const QByteArray& cipherData, QByteArray& outData)
+{
+	CipherSession* session = sessions.value(*lpszUserId, NULL);
+	if(!session) {
 #ifdef USE_LMC_TRACE
-        lmctrace("Error: Buffer not allocated");
+		lmctrace("Error: Message decryption failed, no session key");
 #endif
-		return QByteArray();
+		outData.clear();
+		return false;
 	}
+
+	EVP_CIPHER_CTX* ctx = session->decryptCtx;
+	const unsigned char* inBuffer = (const unsigned char*)cipherData.constData();
+	int outLen = 0;
 	int foutLen = 0;
 
-	EVP_CIPHER_CTX ctx = decryptMap.value(*lpszUserId);
-    if ( EVP_DecryptInit_ex(&ctx, NULL, NULL, NULL, NULL) )
-    {
-        if(EVP_DecryptUpdate(&ctx, outBuffer, &outLen, (unsigned char*)cipherData.data(), cipherData.length()))
-        {
-            if(EVP_DecryptFinal_ex(&ctx, outBuffer + outLen, &foutLen))
-            {
-				outLen += foutLen;
-				QByteArray byteArray((char*)outBuffer, outLen);
-				free(outBuffer);
-				return byteArray;
+	if(session->mode == CM_Gcm) {
+		int textLen = cipherData.length() - LC_NONCELENGTH - LC_TAGLENGTH;
+		if(textLen >= 0 && !acceptNonce(session, inBuffer)) {
+#ifdef USE_LMC_TRACE
+			lmctrace("Warning: Message from user " + *lpszUserId + " refused, it was replayed or reflected");
+#endif
+			outData.clear();
+			return false;
+		}
+		if(textLen >= 0) {
+			outData.resize(textLen);
+			unsigned char* outBuffer = (unsigned char*)outData.data();
+			unsigned char* tag = (unsigned char*)inBuffer + LC_NONCELENGTH + textLen;
+			if(EVP_DecryptInit_ex(ctx, NULL, NULL, NULL, inBuffer)) {
+				if(EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, LC_TAGLENGTH, tag)) {
+					if(EVP_DecryptUpdate(ctx, outBuffer, &outLen, inBuffer + LC_NONCELENGTH, textLen)) {
+						if(EVP_DecryptFinal_ex(ctx, outBuffer + outLen, &foutLen)) {
+							outData.resize(outLen + foutLen);
+							session->nextCounter = qFromBigEndian<quint64>(inBuffer + LC_NONCEPREFIX) + 1;
+							return true;
+						}
+					}
+				}
+			}
+		}
+	} else {
+		outData.resize(cipherData.length() + AES_BLOCK_SIZE);
+		unsigned char* outBuffer = (unsigned char*)outData.data();
+		if(EVP_DecryptInit_ex(ctx, NULL, NULL, NULL, NULL)) {
+			if(EVP_DecryptUpdate(ctx, outBuffer, &outLen, inBuffer, cipherData.length())) {
+				if(EVP_DecryptFinal_ex(ctx, outBuffer + outLen, &foutLen)) {
+					outData.resize(outLen + foutLen);
+					return true;
+				}
 			}
 		}
 	}
 
+	outData.clear();
 #ifdef USE_LMC_TRACE
     lmctrace("Error: Message decryption failed");
 #endif
 
-	return QByteArray();
+	return false;
+}
+
+//-----------------------------------------------------------------------------
+
+QByteArray lmcCrypto::decrypt(QString* lpszUserId, QByteArray& cipherData)
+{
+	QByteArray clearData;
+	decrypt(lpszUserId, cipherData, clearData);
+	return clearData;
 }
 
 //-----------------------------------------------------------------------------
@@ -235,3 +446,14 @@ QByteArray lmcCrypto::getPublicKey()
 }
 
 //-----------------------------------------------------------------------------
+//	installs the locks once, unless the application has set its own
+void lmcCrypto::initThreading(void)
+{
+	if(cryptoLocks || CRYPTO_get_locking_callback())
+		return;
+
+	cryptoLocks = new QMutex[CRYPTO_num_locks()];
+	CRYPTO_set_locking_callback(lockingCallback);
+}
+
+//-----------------------------------------------------------------------------
@@ -62,6 +62,43 @@
 #include <openssl/rsa.h>
 #include <openssl/pem.h>
 #include <openssl/aes.h>
+#include <openssl/evp.h>
+
+#define LC_KEYLENGTH		32	// aes-256
+#define LC_KEYIVLENGTH		48	// key followed by the cbc iv, a mode byte may follow
+#define LC_NONCELENGTH		12	// gcm nonce sent in front of every message
+#define LC_NONCEPREFIX		4	// direction byte and iv bytes in front of the message counter of a nonce
+#define LC_TAGLENGTH		16	// gcm authentication tag sent after every message
+#define LC_MAXOVERHEAD		(LC_NONCELENGTH + LC_TAGLENGTH)	// most a message grows by when encrypted
+#define LC_GCMMARKER		"Cipher: AES-256-GCM"	// follows the public key of an instance that reads gcm
+
+//	Session cipher modes. The mode byte is sent with the session key, a key
+//	without it is for cbc.
+enum CipherMode
+{
+    CM_Cbc = 0,		// fixed iv for the whole session, understood by all versions
+    CM_Gcm,			// nonce and tag with every message
+    CM_Max
+};
+
+const QString CipherModeNames[] =
+{
+    "AES-256-CBC",
+    "AES-256-GCM"
+};
+
+//	Cipher contexts with one peer, set up once for the session
+struct CipherSession
+{
+	CipherMode mode;
+	EVP_CIPHER_CTX* encryptCtx;
+	EVP_CIPHER_CTX* decryptCtx;
+	unsigned char nonce[LC_NONCELENGTH];	// sender prefix followed by the message counter
+	quint64 counter;
+	unsigned char peerPrefix[LC_NONCEPREFIX];	// prefix of the nonces the peer sends
+	quint64 nextCounter;	// lowest counter of a message from the peer still accepted
+	bool loopback;			// both ends are this instance, its own nonces come back
+};
 
 // note: we can use other library. such as ctypto++
 class lmcCrypto
@@ -75,18 +112,32 @@ public:
 	QByteArray generateRSA(void);
 
 	QByteArray generateAES(QString* lpszUserId, QByteArray& pubKey);
-	void retreiveAES(QString* lpszUserId, QByteArray& aesKeyIv);
+	bool retreiveAES(QString* lpszUserId, QByteArray& aesKeyIv);
+	void removeKeys(QString* lpszUserId);
+
+	//	the exchange above in steps, so that the public key operations can run
+	//	on a worker thread while the contexts are set up on the calling one
+	QByteArray newSessionKey(CipherMode mode = CM_Cbc);
+	void setSessionKey(QString* lpszUserId, const QByteArray& keyIv, bool bSender);
+	static QByteArray sealSessionKey(const QByteArray& pubKey, const QByteArray& keyIv);
+	QByteArray openSessionKey(const QByteArray& aesKeyIv);
+	static CipherMode modeFor(const QByteArray& pubKey);
+	void setLoopback(QString* lpszUserId);
 
 	QByteArray encrypt(QString* lpszUserId, QByteArray& clearData);
+	bool encrypt(QString* lpszUserId, const QByteArray& clearData, QByteArray& outData);
 	QByteArray decrypt(QString* lpszUserId, QByteArray& cipherData);
+	bool decrypt(QString* lpszUserId, const QByteArray& cipherData, QByteArray& outData);
 
     QByteArray getPublicKey();
 
 protected:
+	static void initThreading(void);
+	static bool acceptNonce(CipherSession* session, const unsigned char* nonce);
+
 	QByteArray publicKey;
 	RSA* pRsa;
-	QMap<QString, EVP_CIPHER_CTX> encryptMap;
-	QMap<QString, EVP_CIPHER_CTX> decryptMap;
+	QMap<QString, CipherSession*> sessions;
 	int bits;
 	long exponent;
 
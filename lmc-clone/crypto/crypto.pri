@@ -8,8 +8,10 @@ INCLUDEPATH += \
         ./crypto
 
 HEADERS += \
-        ./crypto/crypto.h
+        ./crypto/crypto.h \
+        ./crypto/cryptopool.h
 
 SOURCES += \
-        ./crypto/crypto.cpp
+        ./crypto/crypto.cpp \
+        ./crypto/cryptopool.cpp
 
@@ -43,14 +43,26 @@ DEFINES += IDA_DOMAIN=\"\\\"http://code.project.com/p/lmc-clone\\\"\"
 #-----------------------------------------------------------------------------
 # version
 
-VERSION = 2.0.0
+VERSION = 2.0.5
 
-DEFINES += IDA_VERSION=\"\\\"2.0.0\\\"\"
+DEFINES += IDA_VERSION=\"\\\"2.0.5\\\"\"
 
 DEFINES += IDS_VERSION_VAL=\"\\\"1.2.10\\\"\"
 
 DEFINES += GROUPMSGVERSION=\"\\\"1.2.16\\\"\"
 
+DEFINES += BINARYMSGVERSION=\"\\\"2.0.1\\\"\"
+
+DEFINES += COMPRESSMSGVERSION=\"\\\"2.0.2\\\"\"
+
+DEFINES += STREAMFILEVERSION=\"\\\"2.0.3\\\"\"
+
+DEFINES += IDLECLOSEVERSION=\"\\\"2.0.4\\\"\"
+
+DEFINES += FRAMEDIDVERSION=\"\\\"2.0.5\\\"\"
+
+DEFINES += TIEBREAKVERSION=\"\\\"2.0.5\\\"\"
+
 #-----------------------------------------------------------------------------
 
 ### Qt version should be 4.8.2, or over.
@@ -111,6 +123,7 @@ win32:win32-msvc2012: LIBS += -llibeay32
 win32:win32-msvc2012: LIBS += -L./openssl/lib/
 
 win32:LIBS += -liphlpapi
+win32:LIBS += -lws2_32
 
 # TODO: check mac & linux
 
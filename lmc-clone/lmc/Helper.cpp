@@ -4,28 +4,6 @@
 namespace Helper
 {
 
-int indexOf(const QString array[], int size, const QString& value)
-{
-    for(int index = 0; index < size; index++)
-    {
-        if(value == array[index])
-            return index;
-    }
-
-    return (-1);
-}
-
-int statusIndexFromCode(QString status)
-{
-    for( int index = 0; index < ST_COUNT; index++ )
-    {
-        if( statusCode[index].compare(status) == 0 )
-            return index;
-    }
-
-    return -1;
-}
-
 QString  formatSize(qint64 size)
 {
     qint64 gb = 1073741824;
@@ -203,4 +181,9 @@ bool  copyFile(const QString& source, const QString& destination)
 
 }; // namespace Helper
 
-
+//	Chat states live in the application layer, so their table is kept here
+template<> int nameIndex<ChatState>(const QString& name)
+{
+	static const NameTable table(ChatStateNames, CS_Max);
+	return table.indexOf(name);
+}
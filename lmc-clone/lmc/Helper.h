@@ -19,11 +19,13 @@
 #endif
 
 #include "StatusType.h"
+#include "nametable.h"
+#include "chatdefinitions.h"
+
+template<> int nameIndex<ChatState>(const QString& name);
 
 namespace Helper
 {
-    int indexOf(const QString array[], int size, const QString& value);
-    int statusIndexFromCode(QString status);
     QString formatSize(qint64 size);
     QString getUuid(void);
     QString getLogonName(void);
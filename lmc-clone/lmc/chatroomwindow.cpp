@@ -201,7 +201,7 @@ void lmcChatRoomWindow::addUser(User* pUser)
 	peerIds.insert(pUser->id, pUser->id);
 	peerNames.insert(pUser->id, pUser->name);
 
-	int index = Helper::statusIndexFromCode(pUser->status);
+	int index = statusIndexFromCode(pUser->status);
 
 	lmcUserTreeWidgetUserItem *pItem = new lmcUserTreeWidgetUserItem();
 	pItem->setData(0, IdRole, pUser->id);
@@ -232,7 +232,7 @@ void lmcChatRoomWindow::addUser(User* pUser)
 
 	//	Local user cannot participate in public chat if status is offline
 	if(!groupMode && pUser->id.compare(localId) == 0) {
-		bool offline = (statusType[Helper::statusIndexFromCode(pUser->status)] == StatusTypeOffline);
+		bool offline = (statusType[statusIndexFromCode(pUser->status)] == StatusTypeOffline);
 		ui.txtMessage->setEnabled(!offline);
 		ui.txtMessage->setFocus();
 	}
@@ -245,7 +245,7 @@ void lmcChatRoomWindow::updateUser(User* pUser) {
 	QTreeWidgetItem* pItem = getUserItem(&pUser->id);
 	if(pItem) {
 		updateStatusImage(pItem, &pUser->status);
-		pItem->setData(0, StatusRole, Helper::statusIndexFromCode(pUser->status));
+		pItem->setData(0, StatusRole, statusIndexFromCode(pUser->status));
 		pItem->setData(0, SubtextRole, pUser->note);
 		pItem->setText(0, pUser->name);
 		QTreeWidgetItem* pGroupItem = pItem->parent();
@@ -257,7 +257,7 @@ void lmcChatRoomWindow::updateUser(User* pUser) {
 
 	//	Local user cannot participate in public chat if status is offline
 	if(!groupMode && pUser->id.compare(localId) == 0) {
-		bool offline = (statusType[Helper::statusIndexFromCode(pUser->status)] == StatusTypeOffline);
+		bool offline = (statusType[statusIndexFromCode(pUser->status)] == StatusTypeOffline);
 		ui.txtMessage->setEnabled(!offline);
 		ui.txtMessage->setFocus();
 	}
@@ -314,7 +314,7 @@ void lmcChatRoomWindow::receiveMessage(MessageType type, QString* lpszUserId, Xm
 		}
 		break;
 	case MT_LocalAvatar:
-		data = pMessage->data(XN_FILEPATH);
+		data = pMessage->file().path;
 		// this message may come with or without user id. NULL user id means avatar change
 		// by local user, while non NULL user id means avatar change by a peer.
 		setUserAvatar(&senderId, &data);
@@ -658,7 +658,7 @@ void lmcChatRoomWindow::sendMessage(void) {
 
 		MessageType type = groupMode ? MT_GroupMessage : MT_PublicMessage;
 		XmlMessage xmlMessage;
-		xmlMessage.addHeader(XN_TIME, QString::number(QDateTime::currentDateTime().toMSecsSinceEpoch()));
+		xmlMessage.setTime(QDateTime::currentDateTime().toMSecsSinceEpoch());
 		xmlMessage.addData(XN_FONT, font.toString());
 		xmlMessage.addData(XN_COLOR, messageColor.name());
 		xmlMessage.addData(XN_MESSAGE, szMessage);
@@ -743,7 +743,7 @@ void lmcChatRoomWindow::setMessageFont(QFont& font) {
 }
 
 void lmcChatRoomWindow::updateStatusImage(QTreeWidgetItem* pItem, QString* lpszStatus) {
-	int index = Helper::statusIndexFromCode(*lpszStatus);
+	int index = statusIndexFromCode(*lpszStatus);
 	if(index != -1)
 		pItem->setIcon(0, QIcon(QPixmap(statusPic[index], "PNG")));
 }
@@ -100,7 +100,7 @@ void lmcChatWindow::init(User* pLocalUser, User* pRemoteUser, bool connected) {
 	if(!bConnected)
 		showStatus(IT_Disconnected, true);
 
-	int index = Helper::statusIndexFromCode(pRemoteUser->status);
+	int index = statusIndexFromCode(pRemoteUser->status);
     if(index != -1)
     {
         setWindowIcon( QIcon( bubblePic[index]  ) );
@@ -193,7 +193,7 @@ void lmcChatWindow::receiveMessage(
 
 	case MT_Status:
 		data = pMessage->data(XN_STATUS);
-		statusIndex = Helper::statusIndexFromCode(data);
+		statusIndex = statusIndexFromCode(data);
         if(statusIndex != -1)
         {
             setWindowIcon( QIcon(bubblePic[statusIndex]) );
@@ -207,7 +207,7 @@ void lmcChatWindow::receiveMessage(
 		break;
 
 	case MT_LocalAvatar:
-		data = pMessage->data(XN_FILEPATH);
+		data = pMessage->file().path;
 		// this message may come with or without user id. NULL user id means avatar change
 		// by local user, while non NULL user id means avatar change by a peer.
 		pMessageLog->updateAvatar(&senderId, &data);
@@ -225,7 +225,7 @@ void lmcChatWindow::receiveMessage(
 		break;
 
 	case MT_File:
-        if ( pMessage->data(XN_FILEOP) == FileOpNames[FO_Request] )
+        if ( pMessage->file().op == FO_Request )
         {
 			//	a file request has been received
 			appendMessageLog(type, lpszUserId, &senderName, pMessage);
@@ -241,9 +241,9 @@ void lmcChatWindow::receiveMessage(
 		break;
 
 	case MT_LocalFile:
-        if(pMessage->data(XN_FILEOP) == FileOpNames[FO_Request])
+        if(pMessage->file().op == FO_Request)
         {
-			data = pMessage->data(XN_FILEPATH);
+			data = pMessage->file().path;
 			sendFile(&data);
 		}
 		break;
@@ -551,7 +551,7 @@ void lmcChatWindow::sendMessage(void) {
 		
 		MessageType type = groupMode ? MT_GroupMessage : MT_Message;
 		XmlMessage xmlMessage;
-		xmlMessage.addHeader(XN_TIME, QString::number(QDateTime::currentDateTime().toMSecsSinceEpoch()));
+		xmlMessage.setTime(QDateTime::currentDateTime().toMSecsSinceEpoch());
 		xmlMessage.addData(XN_FONT, font.toString());
 		xmlMessage.addData(XN_COLOR, messageColor.name());
 		if(groupMode) {
@@ -604,9 +604,9 @@ void lmcChatWindow::encodeMessage(QString* lpszMessage) {
 }
 
 void lmcChatWindow::processFileOp(XmlMessage* pMessage) {
-    int fileOp =  Helper::indexOf(FileOpNames, FO_Max, pMessage->data(XN_FILEOP));
-    int fileMode =  Helper::indexOf(FileModeNames, FM_Max, pMessage->data(XN_MODE));
-	QString fileId = pMessage->data(XN_FILEID);
+    int fileOp =  pMessage->file().op;
+    int fileMode =  pMessage->file().mode;
+	QString fileId = pMessage->file().id;
 
     switch(fileOp) {
     case FO_Cancel:
@@ -345,8 +345,6 @@ void lmcCore::startChatRoom(QString* lpszThreadId) {
 }
 
 void lmcCore::sendMessage(MessageType type, QString* lpszUserId, XmlMessage* pMessage) {
-	QString data;
-
 	switch(type) {
 	case MT_Broadcast:
 	case MT_UserName:
@@ -369,11 +367,10 @@ void lmcCore::sendMessage(MessageType type, QString* lpszUserId, XmlMessage* pMe
 		pMessaging->update();
 		break;
 	case MT_LocalFile:
-		data = pMessage->data(XN_FILEOP);
-		if(data == FileOpNames[FO_Request]) {
+		if(pMessage->file().op == FO_Request) {
 			// this request message was sent from main window, route to chat window
 			routeMessage(type, lpszUserId, pMessage);
-		} else if(data == FileOpNames[FO_Accept]) { // accept message sent from chat window
+		} else if(pMessage->file().op == FO_Accept) { // accept message sent from chat window
 			// init file transfer, transfer window will send message to messaging layer after validating filepath
 			initFileTransfer(FM_Receive, lpszUserId, pMessage);
 		} else {
@@ -382,8 +379,7 @@ void lmcCore::sendMessage(MessageType type, QString* lpszUserId, XmlMessage* pMe
 		}
 		break;
 	case MT_File:
-		data = pMessage->data(XN_FILEOP);
-		if(data == FileOpNames[FO_Request]) {
+		if(pMessage->file().op == FO_Request) {
 			// this request message was sent from chat window
 			initFileTransfer(FM_Send, lpszUserId, pMessage);
 		}
@@ -690,7 +686,7 @@ void lmcCore::processMessage( MessageType type, QString* lpszUserId, XmlMessage*
 }
 
 void lmcCore::processFile(MessageType type, QString *lpszUserId, XmlMessage* pMessage) {
-    int fileOp =  Helper::indexOf(FileOpNames, FO_Max, pMessage->data(XN_FILEOP));
+    int fileOp =  pMessage->file().op;
 	switch(fileOp) {
 	case FO_Accept:
 		showTransferWindow();
@@ -705,8 +701,8 @@ void lmcCore::processFile(MessageType type, QString *lpszUserId, XmlMessage* pMe
 void lmcCore::routeMessage(MessageType type, QString* lpszUserId, XmlMessage* pMessage) {
 	bool windowExists = false;
 	bool needsNotice = (type == MT_Message || type == MT_Broadcast || type == MT_Failed
-		|| (type == MT_File && pMessage->data(XN_FILEOP) == FileOpNames[FO_Request])
-		|| (type == MT_LocalFile && pMessage->data(XN_FILEOP) == FileOpNames[FO_Request])
+		|| (type == MT_File && pMessage->file().op == FO_Request)
+		|| (type == MT_LocalFile && pMessage->file().op == FO_Request)
 		|| type == MT_GroupMessage);
 
 	//	If no specific user is specified, send this message to all windows
@@ -715,7 +711,7 @@ void lmcCore::routeMessage(MessageType type, QString* lpszUserId, XmlMessage* pM
 			chatWindows[index]->receiveMessage(type, lpszUserId, pMessage);
 		}
 	} else {
-		QString threadId = pMessage->data(XN_THREAD);
+		QString threadId = pMessage->chat().thread;
 		
 		switch(type) {
 		case MT_LocalAvatar:
@@ -786,8 +782,8 @@ void lmcCore::routeGroupMessage(MessageType type, QString* lpszUserId, XmlMessag
 					chatRoomWindows[index]->receiveMessage(type, lpszUserId, pMessage);
 			break;
 		default:
-			threadId = pMessage->data(XN_THREAD);
-            op =  Helper::indexOf(GroupMsgOpNames, GMO_Max, pMessage->data(XN_GROUPMSGOP));
+			threadId = pMessage->chat().thread;
+            op =  pMessage->chat().groupMsgOp;
 
 			if(op == GMO_Request) {
 				//	Check if a chat room with the thread id already exists
@@ -71,7 +71,7 @@ void lmcMainWindow::init(User* pLocalUser, QList<Group>* pGroupList, bool connec
 	ui.tvUserList->header()->setStretchLastSection(false);
     ui.tvUserList->header()->setSectionResizeMode(0, QHeaderView::Stretch);
 	btnStatus->setIconSize(QSize(20, 20));
-	int index = Helper::statusIndexFromCode(pLocalUser->status);
+	int index = statusIndexFromCode(pLocalUser->status);
 	//	if status is not recognized, default to available
 	index = qMax(index, 0);
 	btnStatus->setIcon(QIcon(QPixmap(statusPic[index], "PNG")));
@@ -165,7 +165,7 @@ void lmcMainWindow::addUser(User* pUser) {
 	if(!pUser)
 		return;
 
-	int index = Helper::statusIndexFromCode(pUser->status);
+	int index = statusIndexFromCode(pUser->status);
 
 	lmcUserTreeWidgetUserItem *pItem = new lmcUserTreeWidgetUserItem();
 	pItem->setData(0, IdRole, pUser->id);
@@ -202,7 +202,7 @@ void lmcMainWindow::updateUser(User* pUser) {
 	QTreeWidgetItem* pItem = getUserItem(&pUser->id);
 	if(pItem) {
 		updateStatusImage(pItem, &pUser->status);
-		int index = Helper::statusIndexFromCode(pUser->status);
+		int index = statusIndexFromCode(pUser->status);
 		pItem->setData(0, StatusRole, index);
 		pItem->setData(0, SubtextRole, pUser->note);
 		pItem->setText(0, pUser->name);
@@ -242,8 +242,8 @@ void lmcMainWindow::receiveMessage(MessageType type, QString* lpszUserId, XmlMes
 
 	switch(type) {
 	case MT_Avatar:
-        fileOp =  Helper::indexOf(FileOpNames, FO_Max, pMessage->data(XN_FILEOP));
-        fileMode =  Helper::indexOf(FileModeNames, FM_Max, pMessage->data(XN_MODE));
+        fileOp =  pMessage->file().op;
+        fileMode =  pMessage->file().mode;
 		if(fileOp == FO_Request) {
 			cacheDir = QDir(StdLocation::cacheDir());
 			fileName = "avt_" + * lpszUserId + "_part.png";
@@ -251,7 +251,7 @@ void lmcMainWindow::receiveMessage(MessageType type, QString* lpszUserId, XmlMes
 			reply.addData(XN_MODE, FileModeNames[FM_Receive]);
 			reply.addData(XN_FILETYPE, FileTypeNames[FT_Avatar]);
 			reply.addData(XN_FILEOP, FileOpNames[FO_Accept]);
-			reply.addData(XN_FILEID, pMessage->data(XN_FILEID));
+			reply.addData(XN_FILEID, pMessage->file().id);
 			reply.addData(XN_FILEPATH, filePath);
 			reply.addData(XN_FILENAME, fileName);
 			reply.addData(XN_FILESIZE, pMessage->data(XN_FILESIZE));
@@ -424,7 +424,7 @@ void lmcMainWindow::trayExitAction_triggered(void) {
 
 void lmcMainWindow::statusAction_triggered(QAction* action) {
 	QString status = action->data().toString();
-	int index = Helper::statusIndexFromCode(status);
+	int index = statusIndexFromCode(status);
 	if(index != -1) {
 		btnStatus->setIcon(QIcon(QPixmap(statusPic[index], "PNG")));
 		ui.lblStatus->setText(statusGroup->checkedAction()->text());
@@ -938,7 +938,7 @@ void lmcMainWindow::initGroups(QList<Group>* pGroupList) {
 
 void lmcMainWindow::updateStatusImage(QTreeWidgetItem* pItem, QString* lpszStatus)
 {
-	int index = Helper::statusIndexFromCode(*lpszStatus);
+	int index = statusIndexFromCode(*lpszStatus);
 	if(index != -1)
 		pItem->setIcon(0, QIcon(QPixmap(statusPic[index], "PNG")));
 }
@@ -119,31 +119,31 @@ void lmcMessageLog::appendMessageLog(
 
 	switch(type) {
 	case MT_Message:
-		time.setMSecsSinceEpoch(pMessage->header(XN_TIME).toLongLong());
-		message = pMessage->data(XN_MESSAGE);
-		font.fromString(pMessage->data(XN_FONT));
-		color.setNamedColor(pMessage->data(XN_COLOR));
+		time.setMSecsSinceEpoch(pMessage->time());
+		message = pMessage->chat().message;
+		font.fromString(pMessage->chat().font);
+		color.setNamedColor(pMessage->chat().color);
 		appendMessage(lpszUserId, lpszUserName, &message, &time, &font, &color);
 		lastId = *lpszUserId;
 		break;
 	case MT_PublicMessage:
 	case MT_GroupMessage:
-		time.setMSecsSinceEpoch(pMessage->header(XN_TIME).toLongLong());
-		message = pMessage->data(XN_MESSAGE);
-		font.fromString(pMessage->data(XN_FONT));
-		color.setNamedColor(pMessage->data(XN_COLOR));
+		time.setMSecsSinceEpoch(pMessage->time());
+		message = pMessage->chat().message;
+		font.fromString(pMessage->chat().font);
+		color.setNamedColor(pMessage->chat().color);
 		appendPublicMessage(lpszUserId, lpszUserName, &message, &time, &font, &color);
 		lastId = *lpszUserId;
 		break;
 	case MT_Broadcast:
-		time.setMSecsSinceEpoch(pMessage->header(XN_TIME).toLongLong());
-		message = pMessage->data(XN_BROADCAST);
+		time.setMSecsSinceEpoch(pMessage->time());
+		message = pMessage->chat().broadcast;
 		appendBroadcast(lpszUserId, lpszUserName, &message, &time);
 		lastId  = QString::null;
 		break;
 	case MT_ChatState:
-		message = pMessage->data(XN_CHATSTATE);
-        caption = getChatStateMessage((ChatState) Helper::indexOf(ChatStateNames, CS_Max, message));
+		message = pMessage->chat().chatState;
+        caption = getChatStateMessage((ChatState) nameIndex<ChatState>(message));
 		if(!caption.isNull()) {
 			html = themeData.stateMsg;
 			html.replace("%iconpath%", "qrc"IDR_BLANK);
@@ -154,9 +154,9 @@ void lmcMessageLog::appendMessageLog(
 		addToLog = false;
 		break;
 	case MT_Failed:
-		message = pMessage->data(XN_MESSAGE);
-		font.fromString(pMessage->data(XN_FONT));
-		color.setNamedColor(pMessage->data(XN_COLOR));
+		message = pMessage->chat().message;
+		font.fromString(pMessage->chat().font);
+		color.setNamedColor(pMessage->chat().color);
 		html = themeData.sysMsg;
 		caption = tr("This message was not delivered to %1:");
 		fontStyle = getFontStyle(&font, &color, true);
@@ -186,8 +186,7 @@ void lmcMessageLog::appendMessageLog(
 		break;
 	case MT_Join:
 	case MT_Leave:
-		message = pMessage->data(XN_GROUPMSGOP);
-        caption = getChatRoomMessage((GroupMsgOp) Helper::indexOf(GroupMsgOpNames, GMO_Max, message));
+        caption = getChatRoomMessage(pMessage->chat().groupMsgOp);
 		if(!caption.isNull()) {
 			html = themeData.sysMsg;
 			html.replace("%iconpath%", "qrc"IDR_BLANK);
@@ -201,7 +200,7 @@ void lmcMessageLog::appendMessageLog(
 	}
 
 	if(!bReload && addToLog && pMessage) {
-		XmlMessage xmlMessage = pMessage->clone();
+		XmlMessage xmlMessage = *pMessage;
 		QString userId = lpszUserId ? *lpszUserId : QString::null;
 		QString userName = lpszUserName ? *lpszUserName : QString::null;
 		messageLog.append(SingleMessage(type, userId, userName, xmlMessage, id));
@@ -222,12 +221,10 @@ void lmcMessageLog::updateFileMessage(FileMode mode, FileOp op, QString fileId)
 
 	//	update the entry in message log
 	for(int index = 0; index < messageLog.count(); index++) {
-		SingleMessage msg = messageLog.at(index);
-		if(tempId.compare(msg.id) == 0) {
-			XmlMessage xmlMessage = msg.message;
-			xmlMessage.removeData(XN_FILEOP);
-			xmlMessage.addData(XN_FILEOP, FileOpNames[op]);
-			msg.message = xmlMessage;
+		if(tempId.compare(messageLog.at(index).id) == 0) {
+			XmlMessage* pMessage = &messageLog[index].message;
+			pMessage->removeData(XN_FILEOP);
+			pMessage->addData(XN_FILEOP, FileOpNames[op]);
 			break;
 		}
 	}
@@ -274,8 +271,8 @@ QString lmcMessageLog::prepareMessageLogForSave(OutputFormat format)
 		for(int index = 0; index < messageLog.count(); index++) {
 			SingleMessage msg = messageLog.at(index);
 			if(msg.type == MT_Message || msg.type == MT_GroupMessage) {
-				time.setMSecsSinceEpoch(msg.message.header(XN_TIME).toLongLong());
-				QString messageText = msg.message.data(XN_MESSAGE);
+				time.setMSecsSinceEpoch(msg.message.time());
+				QString messageText = msg.message.chat().message;
 				decodeMessage(&messageText, true);
 				QString htmlMsg =
 					"<p><span class='salutation'>" + msg.userName + ":</span>"\
@@ -292,10 +289,10 @@ QString lmcMessageLog::prepareMessageLogForSave(OutputFormat format)
 		for(int index = 0; index < messageLog.count(); index++) {
 			SingleMessage msg = messageLog.at(index);
 			if(msg.type == MT_Message || msg.type == MT_GroupMessage) {
-				time.setMSecsSinceEpoch(msg.message.header(XN_TIME).toLongLong());
+				time.setMSecsSinceEpoch(msg.message.time());
 				QString textMsg =
 					msg.userName + " [" + time.time().toString(Qt::SystemLocaleShortDate) + "]:\n" +
-					msg.message.data(XN_MESSAGE) + "\n\n";
+					msg.message.chat().message + "\n\n";
 				text.append(textMsg);
 			}
 		}
@@ -521,19 +518,19 @@ void lmcMessageLog::appendFileMessage(MessageType type, QString* lpszUserName, X
 									  bool bReload) {
 	QString htmlMsg;
 	QString caption;
-	QString fileId = pMessage->data(XN_FILEID);
+	QString fileId = pMessage->file().id;
 	QString tempId;
 	QString szStatus;
 
 	htmlMsg = themeData.reqMsg;
 	htmlMsg.replace("%iconpath%", "qrc"IDR_FILEMSG);
 
-    FileOp fileOp = (FileOp) Helper::indexOf(FileOpNames, FO_Max, pMessage->data(XN_FILEOP));
+    FileOp fileOp = pMessage->file().op;
 
 	if(type == MT_LocalFile) {
 		tempId = "send" + fileId;
 		caption = tr("Sending '%1' to %2.");
-		htmlMsg.replace("%sender%", caption.arg(pMessage->data(XN_FILENAME), *lpszUserName));
+		htmlMsg.replace("%sender%", caption.arg(pMessage->file().name, *lpszUserName));
 		htmlMsg.replace("%message%", "");
 		htmlMsg.replace("%fileid%", tempId);
 
@@ -559,14 +556,14 @@ void lmcMessageLog::appendFileMessage(MessageType type, QString* lpszUserName, X
 		if(autoFile) {
 			caption = tr("%1 is sending you a file:");
 			htmlMsg.replace("%sender%", caption.arg(*lpszUserName));
-			htmlMsg.replace("%message%", pMessage->data(XN_FILENAME) + " (" +
-				Helper::formatSize(pMessage->data(XN_FILESIZE).toLongLong()) + ")");
+			htmlMsg.replace("%message%", pMessage->file().name + " (" +
+				Helper::formatSize(pMessage->file().size) + ")");
 			htmlMsg.replace("%fileid%", "");
 		} else {
 			caption = tr("%1 sends you a file:");
 			htmlMsg.replace("%sender%", caption.arg(*lpszUserName));
-			htmlMsg.replace("%message%", pMessage->data(XN_FILENAME) + " (" +
-				Helper::formatSize(pMessage->data(XN_FILESIZE).toLongLong()) + ")");
+			htmlMsg.replace("%message%", pMessage->file().name + " (" +
+				Helper::formatSize(pMessage->file().size) + ")");
 			htmlMsg.replace("%fileid%", tempId);
 		}
 
@@ -687,9 +684,9 @@ void lmcMessageLog::fileOperation(QString fileId, QString action) {
 		xmlMessage.addData(XN_MODE, FileModeNames[FM_Receive]);
 		xmlMessage.addData(XN_FILETYPE, FileTypeNames[FT_Normal]);
 		xmlMessage.addData(XN_FILEOP, FileOpNames[FO_Accept]);
-		xmlMessage.addData(XN_FILEID, fileData.data(XN_FILEID));
-		xmlMessage.addData(XN_FILEPATH, fileData.data(XN_FILEPATH));
-		xmlMessage.addData(XN_FILENAME, fileData.data(XN_FILENAME));
+		xmlMessage.addData(XN_FILEID, fileData.file().id);
+		xmlMessage.addData(XN_FILEPATH, fileData.file().path);
+		xmlMessage.addData(XN_FILENAME, fileData.file().name);
 		xmlMessage.addData(XN_FILESIZE, fileData.data(XN_FILESIZE));
 	}
 	else if(action.compare("filedecline", Qt::CaseInsensitive) == 0) {
@@ -697,14 +694,14 @@ void lmcMessageLog::fileOperation(QString fileId, QString action) {
 		xmlMessage.addData(XN_MODE, FileModeNames[FM_Receive]);
 		xmlMessage.addData(XN_FILETYPE, FileTypeNames[FT_Normal]);
 		xmlMessage.addData(XN_FILEOP, FileOpNames[FO_Decline]);
-		xmlMessage.addData(XN_FILEID, fileData.data(XN_FILEID));
+		xmlMessage.addData(XN_FILEID, fileData.file().id);
 	}
 	else if(action.compare("filecancel", Qt::CaseInsensitive) == 0) {
 		XmlMessage fileData = receiveFileMap.value(fileId);
 		xmlMessage.addData(XN_MODE, FileModeNames[FM_Send]);
 		xmlMessage.addData(XN_FILETYPE, FileTypeNames[FT_Normal]);
 		xmlMessage.addData(XN_FILEOP, FileOpNames[FO_Cancel]);
-		xmlMessage.addData(XN_FILEID, fileData.data(XN_FILEID));
+		xmlMessage.addData(XN_FILEID, fileData.file().id);
 	}
 
 	emit messageSent(MT_LocalFile, &peerId, &xmlMessage);
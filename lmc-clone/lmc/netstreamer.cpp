@@ -24,6 +24,7 @@
 
 
 #include <QDataStream>
+#include <QtEndian>
 #include "netstreamer.h"
 
 const qint64 bufferSize = 65535;
@@ -61,6 +62,9 @@ FileSender::FileSender(
 		socket = NULL;
 		timer = NULL;
 		type = nType;
+		streamed = false;
+		streamId = 0;
+		credit = 0;
 }
 
 FileSender::~FileSender(void)
@@ -78,10 +82,68 @@ void FileSender::init(void)
 	connect(socket, SIGNAL(bytesWritten(qint64)), this, SLOT(bytesWritten(qint64)));
 
 	QHostAddress hostAddress(address);
+	SocketProfile::prepareConnect(SC_File, socket, hostAddress);
 	socket->connectToHost(hostAddress, port);
 
 }
 
+//	Sends the file on the message stream of the peer instead of a socket of its own.
+//	Nothing is sent before the receiver grants credit for the stream.
+void FileSender::initStream(quint32 nStreamId)
+{
+	streamed = true;
+	streamId = nStreamId;
+	credit = 0;
+
+	file = new QFile(filePath);
+	if(!file->open(QIODevice::ReadOnly)) {
+		QString data;
+		emit progressUpdated(FM_Send, FO_Error, type, &id, &peerId, &data);
+		return;
+	}
+
+	active = true;
+	timer = new QTimer(this);
+	connect(timer, SIGNAL(timeout()), this, SLOT(timer_timeout()));
+	timer->start(timeout);
+
+	QByteArray fileId = id.toLatin1();
+	emit streamDataReady(&peerId, streamId, SO_Open, fileId);
+}
+
+void FileSender::addCredit(qint64 nBytes)
+{
+	credit += nBytes;
+	sendChunks();
+}
+
+//	The message stream to the receiver is gone, the transfer cannot go on
+void FileSender::streamLost(void)
+{
+	if(!active)
+		return;
+
+	stop();
+	QString data;
+	emit progressUpdated(FM_Send, FO_Error, type, &id, &peerId, &data);
+}
+
+//	True while the file is being sent on the message stream of the peer
+bool FileSender::isStreamed(const QString& szPeerId)
+{
+	return (streamed && active && peerId.compare(szPeerId) == 0);
+}
+
+bool FileSender::isStream(const QString& szPeerId, quint32 nStreamId)
+{
+	return (isStreamed(szPeerId) && streamId == nStreamId);
+}
+
+qint64 FileSender::size(void)
+{
+	return fileSize;
+}
+
 void FileSender::stop(void)
 {
 	active = false;
@@ -96,6 +158,9 @@ void FileSender::stop(void)
 
 void FileSender::connected(void)
 {
+	SocketProfile::apply(SC_File, socket);
+	lmctrace("File socket to user " + peerId + ": " + SocketProfile::describe(socket));
+
 	QByteArray data = id.toLocal8Bit();
 	data.insert(0, "FILE");	// insert indicator that this socket handles file transfer
 	//	send an id message and then wait for a START message 
@@ -173,6 +238,45 @@ void FileSender::sendFile(void) {
 	}
 }
 
+//	Sends chunks of the file while credit is left. The last chunk completes the
+//	transfer at once, the receiver does not grant credit for the end of the file.
+void FileSender::sendChunks(void) {
+	while(active && credit > 0) {
+		qint64 unsentBytes = fileSize - file->pos();
+		qint64 bytesToSend = qMin(qMin((qint64)FS_CHUNKSIZE, credit), unsentBytes);
+		QByteArray chunk;
+		if(bytesToSend > 0) {
+			chunk = file->read(bytesToSend);
+			if(chunk.isEmpty()) {
+				stop();
+				QString data;
+				emit progressUpdated(FM_Send, FO_Error, type, &id, &peerId, &data);
+				return;
+			}
+			credit -= chunk.length();
+			emit streamDataReady(&peerId, streamId, SO_Data, chunk);
+			//	the stream may have been lost while sending
+			if(!active)
+				return;
+		}
+
+		if(file->pos() >= fileSize) {
+			active = false;
+			timer->stop();
+			file->close();
+			QString data;
+			emit progressUpdated(FM_Send, FO_Complete, type, &id, &peerId, &data);
+			return;
+		}
+
+		if(file->pos() > milestone) {
+			QString transferred = QString::number(file->pos());
+			emit progressUpdated(FM_Send, FO_Progress, type, &id, &peerId, &transferred);
+			milestone += mile;
+		}
+	}
+}
+
 
 /****************************************************************************
 ** Class: FileReceiver
@@ -206,6 +310,9 @@ FileReceiver::FileReceiver(
 		socket = NULL;
 		timer = NULL;
 		type = nType;
+		streamed = false;
+		streamId = 0;
+		consumed = 0;
 }
 
 FileReceiver::~FileReceiver(void) {
@@ -213,6 +320,8 @@ FileReceiver::~FileReceiver(void) {
 
 void FileReceiver::init(QTcpSocket* socket) {
 	this->socket = socket;
+	SocketProfile::apply(SC_File, socket);
+	lmctrace("File socket from user " + peerId + ": " + SocketProfile::describe(socket));
 	connect(socket, SIGNAL(disconnected()), this, SLOT(disconnected()));
 	connect(this->socket, SIGNAL(readyRead()), this, SLOT(readyRead()));
 
@@ -221,6 +330,62 @@ void FileReceiver::init(QTcpSocket* socket) {
 	socket->write("START");
 }
 
+//	Takes the transfer from the message stream of the peer. Only the peer the
+//	file was accepted from can open it, and only once.
+bool FileReceiver::initStream(QString* lpszUserId, quint32 nStreamId) {
+	if(active || streamed || peerId.compare(*lpszUserId) != 0)
+		return false;
+
+	streamed = true;
+	streamId = nStreamId;
+	consumed = 0;
+
+	receiveFile();
+	if(active)
+		grantCredit(FS_WINDOW);
+	return active;
+}
+
+void FileReceiver::receiveChunk(const QByteArray& data) {
+	if(!active)
+		return;
+
+	//	a sender that goes past the end of the file is not following the protocol
+	if(file->pos() + data.length() > fileSize) {
+		lmctrace("Warning: Streamed file " + id + " is larger than announced");
+		streamLost();
+		return;
+	}
+
+	writeData(data.constData(), data.length());
+	if(!active)
+		return;
+
+	consumed += data.length();
+	if(consumed >= FS_WINDOW / 2) {
+		grantCredit(consumed);
+		consumed = 0;
+	}
+}
+
+//	The message stream to the sender is gone, the partly received file is removed
+void FileReceiver::streamLost(void) {
+	if(!active)
+		return;
+
+	stop();
+	emit progressUpdated(FM_Receive, FO_Error, type, &id, &peerId, &filePath);
+}
+
+//	True while the file is being received on the message stream of the peer
+bool FileReceiver::isStreamed(const QString& szPeerId) {
+	return (streamed && active && peerId.compare(szPeerId) == 0);
+}
+
+bool FileReceiver::isStream(const QString& szPeerId, quint32 nStreamId) {
+	return (isStreamed(szPeerId) && streamId == nStreamId);
+}
+
 void FileReceiver::stop(void) {
 	bool deleteFile = false;
 
@@ -251,13 +416,18 @@ void FileReceiver::readyRead(void) {
 		return;
 
 	qint64 bytesReceived = socket->read(buffer, bufferSize);
-	file->write(buffer, bytesReceived);
+	writeData(buffer, bytesReceived);
+}
+
+void FileReceiver::writeData(const char* pData, qint64 nLength) {
+	file->write(pData, nLength);
 
 	qint64 unreceivedBytes = fileSize - file->pos();
 	if(unreceivedBytes == 0) {
 		active = false;
 		file->close();
-		socket->close();
+		if(socket)
+			socket->close();
 		emit progressUpdated(FM_Receive, FO_Complete, type, &id, &peerId, &filePath);
 		return;
 	}
@@ -292,19 +462,52 @@ void FileReceiver::receiveFile(void) {
 		connect(timer, SIGNAL(timeout()), this, SLOT(timer_timeout()));
 		timer->start(timeout);
 	} else {
-		socket->close();
+		if(socket)
+			socket->close();
 		emit progressUpdated(FM_Receive, FO_Error, type, &id, &peerId, &filePath);
 	}
 }
 
+void FileReceiver::grantCredit(qint64 nBytes) {
+	QByteArray data(4, 0);
+	qToBigEndian<quint32>(nBytes, (uchar*)data.data());
+	emit streamDataReady(&peerId, streamId, SO_Credit, data);
+}
+
 
 /****************************************************************************
 ** Class: MsgStream
 ** Description: Handles transmission and reception of TCP streaming messages.
 ****************************************************************************/
+qint64 MsgStream::receiveBudget = IDS_RECEIVEBUDGET_VAL;
+qint64 MsgStream::bufferedTotal = 0;
+quint64 MsgStream::rejectedTotal = 0;
+QList<MsgStream*> MsgStream::waitingStreams;
+
 MsgStream::MsgStream(void) {
 	socket = NULL;
-	reading = false;
+	peerReady = true;
+	eager = false;
+	framedId = false;
+	outOffset = 0;
+	outQueueBytes = 0;
+	for(int lane = 0; lane < MP_Max; lane++)
+		passedOver[lane] = 0;
+	queueLimit = IDS_SENDQUEUELIMIT_VAL;
+	queueFull = false;
+	inBuffer.reserve(MS_READBUFFER);
+	inPos = 0;
+	inBufferBytes = 0;
+	maxFrameSize = IDS_MAXFRAMESIZE_VAL;
+	bufferLimit = IDS_RECEIVEBUFFER_VAL;
+	rejected = false;
+	sentFrames = 0;
+	socketWrites = 0;
+	flushTimer = new QTimer(this);
+	flushTimer->setSingleShot(true);
+	flushTimer->setInterval(IDS_COALESCEDELAY_VAL);
+	connect(flushTimer, SIGNAL(timeout()), this, SLOT(flush()));
+	lastActivity.start();
 }
 
 MsgStream::MsgStream(QString szLocalId, QString szPeerId, QString szPeerAddress, int nPort) {
@@ -313,109 +516,497 @@ MsgStream::MsgStream(QString szLocalId, QString szPeerId, QString szPeerAddress,
 	peerAddress = szPeerAddress;
 	port = nPort;
 	socket = NULL;
-	reading = false;
-	outDataLen = 0;
-	inDataLen = 0;
+	peerReady = true;
+	eager = false;
+	framedId = false;
+	outOffset = 0;
+	outQueueBytes = 0;
+	for(int lane = 0; lane < MP_Max; lane++)
+		passedOver[lane] = 0;
+	queueLimit = IDS_SENDQUEUELIMIT_VAL;
+	queueFull = false;
+	inBuffer.reserve(MS_READBUFFER);
+	inPos = 0;
+	inBufferBytes = 0;
+	maxFrameSize = IDS_MAXFRAMESIZE_VAL;
+	bufferLimit = IDS_RECEIVEBUFFER_VAL;
+	rejected = false;
+	sentFrames = 0;
+	socketWrites = 0;
+	flushTimer = new QTimer(this);
+	flushTimer->setSingleShot(true);
+	flushTimer->setInterval(IDS_COALESCEDELAY_VAL);
+	connect(flushTimer, SIGNAL(timeout()), this, SLOT(flush()));
+	lastActivity.start();
 }
 
 MsgStream::~MsgStream(void) {
+	waitingStreams.removeAll(this);
+	bufferedTotal -= inBufferBytes;
+	resumeWaiting();
 }
 
-void MsgStream::init(void) {
+//	A peer that reads the id up to its end can take frames right behind it, so an
+//	eager stream sends what is queued without waiting for the first answer
+void MsgStream::init(bool bEager, bool bFramedId) {
+	peerReady = false;
+	eager = bEager;
+	framedId = bFramedId;
 	socket = new QTcpSocket(this);
+	//	the socket stops reading from the network when its own buffer is full
+	socket->setReadBufferSize(bufferLimit);
 	connect(socket, SIGNAL(connected()), this, SLOT(connected()));
 	connect(socket, SIGNAL(disconnected()), this, SLOT(disconnected()));
+	connect(socket, SIGNAL(error(QAbstractSocket::SocketError)), this, SLOT(connectError(QAbstractSocket::SocketError)));
 	connect(socket, SIGNAL(readyRead()), this, SLOT(readyRead()));
 	connect(socket, SIGNAL(bytesWritten(qint64)), this, SLOT(bytesWritten(qint64)));
 
 	QHostAddress hostAddress(peerAddress);
+	SocketProfile::prepareConnect(SC_Message, socket, hostAddress);
 	socket->connectToHost(hostAddress, port);
 }
 
 void MsgStream::init(QTcpSocket* socket) {
 	this->socket = socket;
+	peerReady = true;
+	socket->setReadBufferSize(bufferLimit);
+	applySocketProfile();
 	connect(socket, SIGNAL(disconnected()), this, SLOT(disconnected()));
 	connect(this->socket, SIGNAL(readyRead()), this, SLOT(readyRead()));
 	connect(socket, SIGNAL(bytesWritten(qint64)), this, SLOT(bytesWritten(qint64)));
+
+	//	frames that came in right behind the id are already waiting
+	if(socket->bytesAvailable() > 0)
+		QMetaObject::invokeMethod(this, "readyRead", Qt::QueuedConnection);
 }
 
 void MsgStream::stop(void) {
+	traceWriteStats();
 	if(socket && socket->isOpen())
 		socket->close();
 }
 
-void MsgStream::sendMessage(QByteArray& data) {
-	qint32 dataLen = sizeof(quint32) + data.length();
-	outDataLen += dataLen;
-	outData.resize(dataLen);
+//	Closes the connection once every queued frame has been handed to the socket.
+//	The stream is deleted when the socket has disconnected.
+void MsgStream::close(void) {
+	traceWriteStats();
+	flushTimer->stop();
 
-	QDataStream stream(&outData, QIODevice::WriteOnly);
-	stream << (quint32)data.length();
-	stream.writeRawData(data.data(), data.length());
+	if(!socket || socket->state() != QAbstractSocket::ConnectedState) {
+		deleteLater();
+		return;
+	}
 
-	qint64 numBytesWritten = socket->write(outData);
-	if(numBytesWritten < 0)
-        lmctrace("Error: Socket write failed");
+	socket->write(outBatch.constData() + outOffset, outBatch.length() - outOffset);
+	while(nextBatch())
+		socket->write(outBatch);
+	outBatch.clear();
+	batchFrames.clear();
+	outOffset = 0;
+	outQueueBytes = 0;
+	checkQueueDrained();
+
+	connect(socket, SIGNAL(disconnected()), socket, SLOT(deleteLater()));
+	connect(socket, SIGNAL(disconnected()), this, SLOT(deleteLater()));
+	socket->disconnectFromHost();
+}
+
+//	Copies the message into a new frame, for callers that did not build one
+bool MsgStream::sendMessage(QByteArray& data, MsgPriority priority) {
+	QByteArray frame;
+	frame.reserve(MS_FRAMEHEADER + data.length());
+	frame.resize(MS_FRAMEHEADER);
+	frame.append(data);
+	return sendFrame(frame, priority);
+}
+
+//	The frame must start with MS_FRAMEHEADER bytes reserved for the length,
+//	which is filled in here. The frame is queued as is, without copying.
+//	Returns false without queueing the frame when the queue is over its limit,
+//	the caller decides whether to retry later or give up. The message the frame
+//	was made from, if given, is kept until the frame has gone out.
+bool MsgStream::sendFrame(QByteArray& frame, MsgPriority priority, const QByteArray& message) {
+	//	control frames are small and few, and a refused one could stall the peer
+	if(outQueueBytes > queueLimit && priority != MP_Control) {
+		lmctrace("Warning: Send queue to user " + peerId + " is full, " + QString::number(queueDepth()) +
+			" messages, " + QString::number(outQueueBytes) + " bytes waiting");
+		if(!queueFull) {
+			queueFull = true;
+			emit sendQueueFull(&peerId, true);
+		}
+		return false;
+	}
+
+	qToBigEndian<quint32>(frame.length() - MS_FRAMEHEADER, (uchar*)frame.data());
+
+	lanes[priority].enqueue(QueuedFrame(frame, message, priority));
+	outQueueBytes += frame.length();
+	sentFrames++;
+	lastActivity.restart();
+	if(!flushTimer->isActive())
+		flushTimer->start();
+	return true;
+}
+
+void MsgStream::setQueueLimit(qint64 nLimit) {
+	queueLimit = nLimit;
+}
+
+void MsgStream::setCoalesceDelay(int nDelay) {
+	flushTimer->setInterval(nDelay);
+}
+
+//	The buffer must be able to hold the largest frame
+void MsgStream::setReceiveLimits(qint64 nMaxFrameSize, qint64 nBufferLimit) {
+	maxFrameSize = nMaxFrameSize;
+	bufferLimit = qMax(nBufferLimit, nMaxFrameSize + MS_FRAMEHEADER);
+	if(socket)
+		socket->setReadBufferSize(bufferLimit);
+}
+
+bool MsgStream::isRejected(void) {
+	return rejected;
+}
+
+//	Tunes the socket for messages once it is connected, again when the profile changes
+void MsgStream::applySocketProfile(void) {
+	if(socket && socket->state() == QAbstractSocket::ConnectedState)
+		SocketProfile::apply(SC_Message, socket);
+}
+
+QString MsgStream::socketOptions(void) {
+	return socket ? SocketProfile::describe(socket) : "no socket";
+}
+
+void MsgStream::setReceiveBudget(qint64 nBudget) {
+	receiveBudget = nBudget;
+	resumeWaiting();
+}
+
+//	Bytes held in the receive buffers of all streams
+qint64 MsgStream::receiveBuffered(void) {
+	return bufferedTotal;
+}
+
+quint64 MsgStream::framesRejected(void) {
+	return rejectedTotal;
+}
+
+//	Frames waiting in the lanes, and the batch being written if there is one
+int MsgStream::queueDepth(void) {
+	int depth = (outOffset < outBatch.length()) ? 1 : 0;
+	for(int lane = 0; lane < MP_Max; lane++)
+		depth += lanes[lane].count();
+	return depth;
+}
+
+//	Takes the messages whose frames have not been handed to the socket in full,
+//	those of the batch being written first and then those of the lanes, for a
+//	caller that sends them again on another connection. Frames without a message
+//	belong to this connection and are dropped.
+QList<QueuedFrame> MsgStream::takeUnsent(void) {
+	QList<QueuedFrame> unsent;
+	int frameEnd = 0;
+	for(int index = 0; index < batchFrames.count(); index++) {
+		frameEnd += batchFrames[index].frame.length();
+		if(frameEnd > outOffset && !batchFrames[index].message.isEmpty())
+			unsent.append(batchFrames[index]);
+	}
+	for(int lane = 0; lane < MP_Max; lane++) {
+		while(!lanes[lane].isEmpty()) {
+			QueuedFrame queued = lanes[lane].dequeue();
+			if(!queued.message.isEmpty())
+				unsent.append(queued);
+		}
+	}
+
+	outBatch.clear();
+	batchFrames.clear();
+	outOffset = 0;
+	outQueueBytes = 0;
+	checkQueueDrained();
+	return unsent;
+}
+
+qint64 MsgStream::queueBytes(void) {
+	return outQueueBytes;
+}
+
+quint64 MsgStream::framesSent(void) {
+	return sentFrames;
+}
+
+quint64 MsgStream::writesIssued(void) {
+	return socketWrites;
+}
+
+//	Milliseconds since a frame was last sent or received
+qint64 MsgStream::idleTime(void) {
+	return lastActivity.elapsed();
+}
+
+//	Hands queued frames to the socket while it has less than MS_WRITEBUFFER bytes
+//	pending. A batch the socket only partly accepts is resumed from outOffset
+//	when bytesWritten is signalled, before any frame queued since then.
+void MsgStream::flush(void) {
+	if(!socket || socket->state() != QAbstractSocket::ConnectedState || !peerReady)
+		return;
+
+	while(socket->bytesToWrite() < MS_WRITEBUFFER) {
+		if(outOffset >= outBatch.length() && !nextBatch())
+			return;
+
+		qint64 numBytesWritten = socket->write(outBatch.constData() + outOffset, outBatch.length() - outOffset);
+		if(numBytesWritten < 0) {
+			lmctrace("Error: Socket write failed");
+			return;
+		}
+		socketWrites++;
+
+		outOffset += numBytesWritten;
+		outQueueBytes -= numBytesWritten;
+		checkQueueDrained();
+		if(outOffset < outBatch.length())
+			return;
+	}
+}
+
+//	Strict priority, except that a lane passed over for MS_QUANTUM bytes of
+//	higher lanes gets the next turn, so bulk data keeps moving under a steady
+//	flow of chat. Returns -1 when all lanes are empty.
+int MsgStream::nextLane(void) {
+	int first = -1;
+	for(int lane = 0; lane < MP_Max; lane++) {
+		if(lanes[lane].isEmpty())
+			continue;
+		if(first < 0)
+			first = lane;
+		else if(passedOver[lane] >= MS_QUANTUM)
+			return lane;
+	}
+	return first;
+}
+
+//	Merges the next frames, in lane order, into one buffer of at most
+//	MS_WRITEBUFFER bytes. A single frame is taken as is, without copying.
+bool MsgStream::nextBatch(void) {
+	outBatch.clear();
+	batchFrames.clear();
+	outOffset = 0;
+
+	int lane;
+	while((lane = nextLane()) >= 0) {
+		const QByteArray& frame = lanes[lane].head().frame;
+		if(!outBatch.isEmpty() && outBatch.length() + frame.length() > MS_WRITEBUFFER)
+			break;
+
+		if(outBatch.isEmpty())
+			outBatch = frame;
+		else {
+			if(outBatch.capacity() < MS_WRITEBUFFER)
+				outBatch.reserve(MS_WRITEBUFFER);
+			outBatch.append(frame);
+		}
+
+		passedOver[lane] = 0;
+		for(int lower = lane + 1; lower < MP_Max; lower++)
+			if(!lanes[lower].isEmpty())
+				passedOver[lower] += frame.length();
+		batchFrames.append(lanes[lane].dequeue());
+	}
+
+	return !outBatch.isEmpty();
+}
+
+void MsgStream::traceWriteStats(void) {
+	if(socketWrites == 0)
+		return;
+
+	lmctrace("Message stream to user " + peerId + ": " + QString::number(sentFrames) + " frames in " +
+		QString::number(socketWrites) + " writes, " +
+		QString::number((double)sentFrames / socketWrites, 'f', 2) + " frames per write");
+}
+
+//	Half the limit is left free, so that a sender that is told to go on does not
+//	fill the queue again with its first few messages
+void MsgStream::checkQueueDrained(void) {
+	if(!queueFull || outQueueBytes > queueLimit / 2)
+		return;
+
+	queueFull = false;
+	emit sendQueueFull(&peerId, false);
 }
 
 void MsgStream::connected(void) {
-	outData = localId.toLocal8Bit();
-	outData.insert(0, "MSG");	// insert indicator that this socket handles messages
-	outDataLen = outData.length();
+	//	errors from here on end in disconnected
+	disconnect(socket, SIGNAL(error(QAbstractSocket::SocketError)), this, SLOT(connectError(QAbstractSocket::SocketError)));
+
+	applySocketProfile();
+
+	QByteArray id = localId.toLocal8Bit();
+	if(eager) {
+		id.insert(0, "MSE");	// insert indicator that this socket handles messages, frames follow the id
+		id.append(MS_IDEND);
+	} else {
+		id.insert(0, "MSG");	// insert indicator that this socket handles messages
+		if(framedId)
+			id.append(MS_IDEND);
+	}
 
 	//	send an id message and then wait for public key message 
 	//	from receiver, which will trigger readyRead signal
-	qint64 numBytesWritten = socket->write(outData);
+	qint64 numBytesWritten = socket->write(id);
 	if(numBytesWritten < 0)
         lmctrace("Error: Socket write failed");
+
+	//	messages queued while connecting follow once the receiver answers,
+	//	or straight away on an eager stream
+	if(eager) {
+		peerReady = true;
+		flush();
+	}
 }
 
 void MsgStream::disconnected(void) {
+	traceWriteStats();
 	emit connectionLost(&peerId);
 }
 
+//	A socket that never connected does not signal disconnected, so a failed
+//	connection attempt is reported as a lost connection here
+void MsgStream::connectError(QAbstractSocket::SocketError socketError) {
+	Q_UNUSED(socketError);
+	lmctrace("Warning: Connection to user " + peerId + " failed: " + socket->errorString());
+	emit connectionLost(&peerId);
+}
+
+//	As much as the receive limits allow is read into the end of the receive buffer
+//	in one call. Each complete frame is then handed on as a view into the buffer,
+//	valid only while the signal is being delivered. Only the bytes of an incomplete
+//	frame are then kept, at the front of the buffer. A frame header is checked
+//	against the size limit as soon as it arrives, before its data is waited for.
 void MsgStream::readyRead(void) {
-	qint64 available = socket->bytesAvailable();
-	while(available > 0) {
-		if(!reading) {
-			reading = true;
-			QByteArray len = socket->read(4);
-			QDataStream stream(len);
-			stream >> inDataLen;
-			inData.clear();
-			QByteArray data = socket->read(inDataLen);
-			inData.append(data);
-			inDataLen -= data.length();
-			available -= (sizeof(quint32) +  data.length());
-			if(inDataLen == 0) {
-				reading = false;
-				emit messageReceived(&peerId, &peerAddress, inData);
-			}
-		} else {
-			QByteArray data = socket->read(inDataLen);
-			inData.append(data);
-			inDataLen -= data.length();
-			available -= data.length();
-			if(inDataLen == 0) {
-				reading = false;
-				emit messageReceived(&peerId, &peerAddress, inData);
+	//	the peer has read the id, frames queued while connecting can follow it
+	if(!peerReady) {
+		peerReady = true;
+		flush();
+	}
+
+	if(!socket || rejected)
+		return;
+
+	while(socket->bytesAvailable() > 0) {
+		//	the buffer never holds more than one incomplete frame, which the connection
+		//	limit always leaves room for, so only the shared budget can run out.
+		//	A frame that has been started is read to its end whatever the budget,
+		//	or streams that each hold part of a frame could use it up between them
+		//	and wait for each other for good. The budget is then overrun by at most
+		//	one frame per stream, and only new frames wait for it.
+		qint64 room = qMin(bufferLimit - inBuffer.length(), receiveBudget - bufferedTotal);
+		room = qMax(room, frameRemainder());
+		if(room <= 0) {
+			waitForBudget();
+			return;
+		}
+		lastActivity.restart();
+
+		qint64 available = qMin(socket->bytesAvailable(), room);
+		int used = inBuffer.length();
+		inBuffer.resize(used + available);
+		qint64 numBytesRead = socket->read(inBuffer.data() + used, available);
+		inBuffer.resize(used + qMax(numBytesRead, (qint64)0));
+		updateBuffered();
+		if(numBytesRead <= 0)
+			break;
+
+		//	a frame handler may close the connection, the frames after it are not read
+		while(socket->isOpen() && inBuffer.length() - inPos >= MS_FRAMEHEADER) {
+			quint32 frameLen = qFromBigEndian<quint32>((const uchar*)inBuffer.constData() + inPos);
+			if(frameLen > maxFrameSize) {
+				rejectFrame(frameLen);
+				return;
 			}
+			if((quint32)(inBuffer.length() - inPos - MS_FRAMEHEADER) < frameLen)
+				break;
+
+			QByteArray frame = QByteArray::fromRawData(inBuffer.constData() + inPos + MS_FRAMEHEADER, frameLen);
+			inPos += MS_FRAMEHEADER + frameLen;
+			emit messageReceived(&peerId, &peerAddress, frame);
 		}
+
+		inBuffer.remove(0, inPos);
+		inPos = 0;
+		//	memory taken by a large frame is given back once it has been delivered
+		if(inBuffer.capacity() > 4 * MS_READBUFFER && inBuffer.length() <= MS_READBUFFER) {
+			QByteArray buffer;
+			buffer.reserve(MS_READBUFFER);
+			buffer.append(inBuffer);
+			inBuffer = buffer;
+		}
+		updateBuffered();
 	}
+
+	resumeWaiting();
 }
 
-void MsgStream::bytesWritten(qint64 bytes) {
-	outDataLen -= bytes;
-	if(outDataLen == 0)
+//	The peer sent a length no valid frame can have, it is either broken or hostile
+void MsgStream::rejectFrame(quint32 frameLen) {
+	rejected = true;
+	rejectedTotal++;
+	lmctrace("Error: Frame of " + QString::number(frameLen) + " bytes from user " + peerId + " is over the limit of " +
+		QString::number(maxFrameSize) + " bytes, closing connection. " + QString::number(rejectedTotal) + " frames rejected so far");
+
+	inBuffer.clear();
+	inPos = 0;
+	updateBuffered();
+	resumeWaiting();
+	socket->abort();
+}
+
+//	Bytes still missing from the incomplete frame at the front of the buffer,
+//	up to the end of its header when the length has not arrived yet
+qint64 MsgStream::frameRemainder(void) {
+	qint64 held = inBuffer.length() - inPos;
+	if(held <= 0)
+		return 0;
+	if(held < MS_FRAMEHEADER)
+		return MS_FRAMEHEADER - held;
+
+	quint32 frameLen = qFromBigEndian<quint32>((const uchar*)inBuffer.constData() + inPos);
+	//	an oversized length is rejected as soon as it is parsed, never waited for
+	if(frameLen > maxFrameSize)
+		return 0;
+	return qMax(MS_FRAMEHEADER + (qint64)frameLen - held, (qint64)0);
+}
+
+//	Counts the receive buffer in the shared budget
+void MsgStream::updateBuffered(void) {
+	bufferedTotal += inBuffer.length() - inBufferBytes;
+	inBufferBytes = inBuffer.length();
+}
+
+//	Reading goes on once other streams have released enough of the budget.
+//	Meanwhile the socket buffer fills up and the peer is held back by tcp.
+void MsgStream::waitForBudget(void) {
+	if(waitingStreams.contains(this))
 		return;
 
-	if(outDataLen > 0)
-        lmctrace("Warning: Socket write operation not completed");
-	if(outDataLen < 0)
-        lmctrace("Warning: Socket write overrun");
+	waitingStreams.append(this);
+	lmctrace("Warning: Receive budget of " + QString::number(receiveBudget) + " bytes in use, reading from user " +
+		peerId + " paused");
+}
 
-	//	TODO: handle situation when entire message is not written to stream in one write operation
-	//	The following code is not functional currently, hence commented out.
-	/*outData = outData.mid(outDataLen);
-	socket->write(outData);*/
+void MsgStream::resumeWaiting(void) {
+	if(waitingStreams.isEmpty() || bufferedTotal >= receiveBudget)
+		return;
+
+	QList<MsgStream*> waiting = waitingStreams;
+	waitingStreams.clear();
+	for(int index = 0; index < waiting.count(); index++)
+		QMetaObject::invokeMethod(waiting[index], "readyRead", Qt::QueuedConnection);
+}
+
+void MsgStream::bytesWritten(qint64 bytes) {
+	Q_UNUSED(bytes);
+	flush();
 }
@@ -281,7 +281,7 @@ void lmcSettingsDialog::cboTheme_currentIndexChanged(int index) {
 	pMessageLog->initMessageLog(themePath);
 
 	XmlMessage msg;
-	msg.addData(XN_TIME, QString::number(QDateTime::currentMSecsSinceEpoch()));
+	msg.setTime(QDateTime::currentMSecsSinceEpoch());
 	msg.addData(XN_FONT, QFont().toString());
 	msg.addData(XN_COLOR, QColor::fromRgb(96, 96, 96).name());
 
@@ -89,18 +89,18 @@ void lmcTransferWindow::stop(void) {
 }
 
 void lmcTransferWindow::createTransfer(FileMode mode, QString* lpszUserId, QString* lpszUserName, XmlMessage* pMessage) {
-	FileView fileView(pMessage->data(XN_FILEID));
-	fileView.fileSize = pMessage->data(XN_FILESIZE).toLongLong();
+	FileView fileView(pMessage->file().id);
+	fileView.fileSize = pMessage->file().size;
 	fileView.sizeDisplay = Helper::formatSize(fileView.fileSize);
 	fileView.userId = *lpszUserId;
 	fileView.userName = *lpszUserName;
 	if(mode == FM_Send) {
-		fileView.fileName = pMessage->data(XN_FILENAME);
-		fileView.filePath = pMessage->data(XN_FILEPATH);
+		fileView.fileName = pMessage->file().name;
+		fileView.filePath = pMessage->file().path;
 		fileView.mode = FileView::TM_Send;
 		fileView.state = FileView::TS_Wait;
 	} else {
-		fileView.fileName = getFreeFileName(pMessage->data(XN_FILENAME));
+		fileView.fileName = getFreeFileName(pMessage->file().name);
         // fileView.filePath =	QDir(StdLocation::fileStorageDir()).absoluteFilePath(fileView.fileName);
         fileView.filePath =	QDir(fileStorageDir()).absoluteFilePath(fileView.fileName);
 		fileView.mode = FileView::TM_Receive;
@@ -122,9 +122,9 @@ void lmcTransferWindow::receiveMessage(MessageType type, QString* lpszUserId, Xm
     Q_UNUSED(type);
     Q_UNUSED(lpszUserId);
 	
-    int fileMode =  Helper::indexOf( FileModeNames, FM_Max, pMessage->data(XN_MODE) );
-    int fileOp =  Helper::indexOf( FileOpNames, FO_Max, pMessage->data(XN_FILEOP) );
-	QString id = pMessage->data(XN_FILEID);
+    int fileMode =  pMessage->file().mode;
+    int fileOp =  pMessage->file().op;
+	QString id = pMessage->file().id;
 
 	FileView* view = NULL;
     int itemIndex = -1;
@@ -176,13 +176,13 @@ void lmcTransferWindow::receiveMessage(MessageType type, QString* lpszUserId, Xm
 				if(!view)
 					return;
 				itemIndex = ui.lvTransferList->itemIndex(id, FileView::TM_Send);
-				updateProgress(view, pMessage->data(XN_FILESIZE).toLongLong());
+				updateProgress(view, pMessage->file().size);
 			} else {
 				view = ui.lvTransferList->item(id, FileView::TM_Receive);
 				if(!view)
 					return;
 				itemIndex = ui.lvTransferList->itemIndex(id, FileView::TM_Receive);
-				updateProgress(view, pMessage->data(XN_FILESIZE).toLongLong());
+				updateProgress(view, pMessage->file().size);
 			}
 			break;
 		case FO_Error:
@@ -237,7 +237,7 @@ void lmcTransferWindow::receiveMessage(MessageType type, QString* lpszUserId, Xm
 				if(!view)
 					return;
 				itemIndex = ui.lvTransferList->itemIndex(id, FileView::TM_Receive);
-				view->filePath = QDir::fromNativeSeparators(pMessage->data(XN_FILEPATH));
+				view->filePath = QDir::fromNativeSeparators(pMessage->file().path);
 				view->icon = getIcon(view->filePath);
 				pactShowFolder->setEnabled(QFile::exists(view->filePath));
 				view->state = FileView::TS_Complete;
@@ -87,7 +87,7 @@ void lmcUserInfoWindow::setUIText(void) {
 		filePath = AVT_DEFAULT;
 	ui.lblAvatar->setPixmap(QPixmap(filePath));
 	ui.lblUserName->setText(userInfo.data(XN_NAME));
-	ui.lblStatus->setText(lmcStrings::statusDesc()[Helper::statusIndexFromCode(userInfo.data(XN_STATUS))]);
+	ui.lblStatus->setText(lmcStrings::statusDesc()[statusIndexFromCode(userInfo.data(XN_STATUS))]);
 
 	QString data = userInfo.data(XN_FIRSTNAME);
 	if(!data.isNull() && data.compare("N/A") != 0)
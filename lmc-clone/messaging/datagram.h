@@ -66,6 +66,10 @@ enum DatagramType
     DT_PublicKey,
     DT_Handshake,
     DT_Message,
+    DT_Compressed,
+    DT_Stream,
+    DT_Idle,
+    DT_KeyShare,
     DT_Max
 };
 
@@ -83,6 +87,8 @@ struct DatagramHeader
     QString userId;
     QString address;
 
+    DatagramHeader(void) : type(DT_None) {}
+
     DatagramHeader(DatagramType dtType, QString szUserId, QString szAddress)
     {
         type = dtType;
@@ -91,13 +97,19 @@ struct DatagramHeader
     }
 };
 
+#define DT_TYPELENGTH	6	// every datagram starts with one of the names below
+
 const QString DatagramTypeNames[] =
 {
     "",
     "BRDCST",
     "PUBKEY",
     "HNDSHK",
-    "MESSAG"
+    "MESSAG",
+    "CMPMSG",
+    "STREAM",
+    "IDLCLS",
+    "KEYSHR"
 };
 
 #endif // DATAGRAM_H
@@ -12,12 +12,12 @@
     Everyone is permitted to copy and distribute verbatim copies of this license document, but changing it is not allowed.
     This version of the GNU Lesser General Public License incorporates the terms and conditions of version 3 of the GNU General Public License, supplemented by the additional permissions listed below.
      0. Additional Definitions.
-    As used herein, this License refers to version 3 of the GNU Lesser General Public License, and the GNU GPL refers to version 3 of the GNU General Public License.
-    The Library refers to a covered work governed by this License, other than an Application or a Combined Work as defined below.
-    An Application is any work that makes use of an interface provided by the Library, but which is not otherwise based on the Library. Defining a subclass of a class defined by the Library is deemed a mode of using an interface provided by the Library.
-    A Combined Work is a work produced by combining or linking an Application with the Library. The particular version of the Library with which the Combined Work was made is also called the Linked Version.
-    The Minimal Corresponding Source for a Combined Work means the Corresponding Source for the Combined Work, excluding any source code for portions of the Combined Work that, considered in isolation, are based on the Application, and not on the Linked Version.
-    The Corresponding Application Code for a Combined Work means the object code and/or source code for the Application, including any data and utility programs needed for reproducing the Combined Work from the Application, but excluding the System Libraries of the Combined Work.
+    As used herein, “this License” refers to version 3 of the GNU Lesser General Public License, and the “GNU GPL” refers to version 3 of the GNU General Public License.
+    “The Library” refers to a covered work governed by this License, other than an Application or a Combined Work as defined below.
+    An “Application” is any work that makes use of an interface provided by the Library, but which is not otherwise based on the Library. Defining a subclass of a class defined by the Library is deemed a mode of using an interface provided by the Library.
+    A “Combined Work” is a work produced by combining or linking an Application with the Library. The particular version of the Library with which the Combined Work was made is also called the “Linked Version”.
+    The “Minimal Corresponding Source” for a Combined Work means the Corresponding Source for the Combined Work, excluding any source code for portions of the Combined Work that, considered in isolation, are based on the Application, and not on the Linked Version.
+    The “Corresponding Application Code” for a Combined Work means the object code and/or source code for the Application, including any data and utility programs needed for reproducing the Combined Work from the Application, but excluding the System Libraries of the Combined Work.
      1. Exception to Section 3 of the GNU GPL.
     You may convey a covered work under sections 3 and 4 of this License without being bound by section 3 of the GNU GPL.
      2. Conveying Modified Versions.
@@ -43,7 +43,7 @@
     b) Give prominent notice with the combined library that part of it is a work based on the Library, and explaining where to find the accompanying uncombined form of the same work.
      6. Revised Versions of the GNU Lesser General Public License.
     The Free Software Foundation may publish revised and/or new versions of the GNU Lesser General Public License from time to time. Such new versions will be similar in spirit to the present version, but may differ in detail to address new problems or concerns.
-    Each version is given a distinguishing version number. If the Library as you received it specifies that a certain numbered version of the GNU Lesser General Public License or any later version applies to it, you have the option of following the terms and conditions either of that published version or of any later version published by the Free Software Foundation. If the Library as you received it does not specify a version number of the GNU Lesser General Public License, you may choose any version of the GNU Lesser General Public License ever published by the Free Software Foundation.
+    Each version is given a distinguishing version number. If the Library as you received it specifies that a certain numbered version of the GNU Lesser General Public License “or any later version” applies to it, you have the option of following the terms and conditions either of that published version or of any later version published by the Free Software Foundation. If the Library as you received it does not specify a version number of the GNU Lesser General Public License, you may choose any version of the GNU Lesser General Public License ever published by the Free Software Foundation.
     If the Library as you received it specifies that a proxy can decide whether future versions of the GNU Lesser General Public License shall apply, that proxy's public statement of acceptance of any version is permanent authorization for you to choose that version for the Library.
 */
 
@@ -57,8 +57,8 @@ lmcMessaging::lmcMessaging(void)
 	connect(pNetwork, SIGNAL(broadcastReceived(DatagramHeader*, QString*)), 
 		this, SLOT(receiveBroadcast(DatagramHeader*, QString*)));
 
-	connect(pNetwork, SIGNAL(messageReceived(DatagramHeader*, QString*)), 
-		this, SLOT(receiveMessage(DatagramHeader*, QString*)));
+	connect(pNetwork, SIGNAL(messageReceived(MsgEnvelope)),
+		this, SLOT(receiveMessage(MsgEnvelope)));
 
 	connect(pNetwork, SIGNAL(webMessageReceived(QString*)),
 		this, SLOT(receiveWebMessage(QString*)));
@@ -68,6 +68,10 @@ lmcMessaging::lmcMessaging(void)
 
 	connect(pNetwork, SIGNAL(connectionLost(QString*)),
 		this, SLOT(connectionLost(QString*)));
+	connect(pNetwork, SIGNAL(connectionSuspended(QString*, bool)),
+		this, SLOT(connectionSuspended(QString*, bool)));
+	connect(pNetwork, SIGNAL(sendQueueFull(QString*, bool)),
+		this, SLOT(sendQueueFull(QString*, bool)));
 
 	connect(pNetwork, SIGNAL(progressReceived(QString*, QString*)),
 		this, SLOT(receiveProgress(QString*, QString*)));
@@ -81,6 +85,7 @@ lmcMessaging::lmcMessaging(void)
 	receivedList.clear();
 	pendingList.clear();
 	loopback = false;
+	connectOnDemand = false;
 }
 
 lmcMessaging::~lmcMessaging(void)
@@ -116,12 +121,14 @@ void lmcMessaging::init(XmlMessage *pInitParams)
 
 	nTimeout = pSettings->value(IDS_TIMEOUT, IDS_TIMEOUT_VAL).toInt() * 1000;
 	nMaxRetry = pSettings->value(IDS_MAXRETRIES, IDS_MAXRETRIES_VAL).toInt();
+	connectOnDemand = pSettings->value(IDS_CONNECTONDEMAND, IDS_CONNECTONDEMAND_VAL).toBool();
 
 	pTimer = new QTimer(this);
 	connect(pTimer, SIGNAL(timeout()), this, SLOT(timer_timeout()));
 	pTimer->start(1000);
 
 	msgId = 1;
+	nTimerTicks = 0;
 }
 
 void lmcMessaging::start(void)
@@ -142,8 +149,14 @@ void lmcMessaging::update(void)
 
 	for(int index = 0; index < userList.count(); index++)
     {
+		//	with connections made on demand, an announcement since the last refresh
+		//	shows that the user is still there without opening a connection to ping
+		if(connectOnDemand && announcedUsers.contains(userList[index].id)
+			&& compareVersions(userList[index].version, IDLECLOSEVERSION) >= 0)
+			continue;
 		sendMessage(MT_Ping, &userList[index].id, NULL);
     }
+	announcedUsers.clear();
 }
 
 void lmcMessaging::stop(void) {
@@ -155,6 +168,7 @@ void lmcMessaging::stop(void) {
 
 	saveGroups();
 
+	tracePoolUsage();
     lmctrace("Messaging stopped");
 }
 
@@ -185,6 +199,7 @@ void lmcMessaging::settingsChanged(void)
 {
 	nTimeout = pSettings->value(IDS_TIMEOUT, IDS_TIMEOUT_VAL).toInt() * 1000;
 	nMaxRetry = pSettings->value(IDS_MAXRETRIES, IDS_MAXRETRIES_VAL).toInt();
+	connectOnDemand = pSettings->value(IDS_CONNECTONDEMAND, IDS_CONNECTONDEMAND_VAL).toBool();
 	pNetwork->settingsChanged();
 
 	QString userName = getUserName();
@@ -292,6 +307,18 @@ void lmcMessaging::network_connectionStateChanged(void) {
 void lmcMessaging::timer_timeout(void) {
 	//	check if any pending message has timed out
 	checkPendingMsg();
+
+	if(++nTimerTicks % POOL_TRACE_TICKS == 0)
+		tracePoolUsage();
+}
+
+//	Live counts should return to zero between messages, a growing count
+//	means a header is not being released after dispatch
+void lmcMessaging::tracePoolUsage(void) {
+	lmctrace("Message pool: " + QString::number(MsgPool<DatagramHeader>::liveCount()) +
+		" datagram headers live, " + QString::number(MsgPool<DatagramHeader>::freeCount()) + " free; " +
+		QString::number(MsgPool<MessageHeader>::liveCount()) + " message headers live, " +
+		QString::number(MsgPool<MessageHeader>::freeCount()) + " free");
 }
 
 QString lmcMessaging::createUserId(QString* lpszAddress, QString* lpszUserName) {
@@ -468,7 +495,7 @@ bool lmcMessaging::addReceivedMsg(qint64 msgId, QString userId) {
 void lmcMessaging::addPendingMsg(qint64 msgId, MessageType type, QString* lpszUserId, XmlMessage* pMessage) {
 	XmlMessage xmlMessage;
 	if(pMessage)
-		xmlMessage = pMessage->clone();
+		xmlMessage = *pMessage;
 	pendingList.append(PendingMsg(msgId, true, QDateTime::currentDateTime(), type, *lpszUserId, xmlMessage, 0));
 }
 
@@ -494,6 +521,8 @@ void lmcMessaging::removeAllPendingMsg(QString* lpszUserId) {
 void lmcMessaging::checkPendingMsg(void) {
 	for(int index = 0; index < pendingList.count(); index++) {
 		//	check if message has timed out
+		if(suspendedUsers.contains(pendingList[index].userId) || congestedUsers.contains(pendingList[index].userId))
+			continue;
 		if(pendingList[index].active && pendingList[index].timeStamp.msecsTo(QDateTime::currentDateTime()) > nTimeout) {
 			if(pendingList[index].retry < nMaxRetry) {
 				//	send the message once more
@@ -535,60 +564,94 @@ void lmcMessaging::resendMessage(MessageType type, qint64 msgId, QString* lpszUs
 
 QString lmcMessaging::addHeader(MessageType type, qint64 id, QString* lpszLocalId, QString* lpszPeerId, XmlMessage* pMessage)
 {
+    XmlMessage emptyMessage;
     if(!pMessage)
-        pMessage = new XmlMessage();
+        pMessage = &emptyMessage;
+
+    setHeader(type, id, lpszLocalId, lpszPeerId, pMessage);
+    return pMessage->toString();
+}
+
+//	Returns the message as it should be put on the wire, either as xml text
+//	or in the binary format understood by newer peers
+QByteArray lmcMessaging::addHeader(MessageType type, qint64 id, QString* lpszLocalId, QString* lpszPeerId, XmlMessage* pMessage, WireFormat format)
+{
+    if(format != WF_Binary)
+        return addHeader(type, id, lpszLocalId, lpszPeerId, pMessage).toUtf8();
+
+    XmlMessage emptyMessage;
+    if(!pMessage)
+        pMessage = &emptyMessage;
+
+    setHeader(type, id, lpszLocalId, lpszPeerId, pMessage);
+    return MsgCodec::encode(pMessage);
+}
+
+bool lmcMessaging::getHeader(QString* lpszMessage, MessageHeader** ppHeader, XmlMessage* pMessage) {
+    *pMessage = XmlMessage(*lpszMessage);
+    if(!pMessage->isValid())
+        return false;
 
-    // remove time stamp from message
-    pMessage->removeHeader(XN_TIME);
+    // stamp the receive time, it is kept outside the message fields
+    pMessage->setTime(QDateTime::currentDateTimeUtc().toMSecsSinceEpoch());
+    return parseHeader(pMessage, ppHeader);
+}
 
+void lmcMessaging::setHeader(MessageType type, qint64 id, QString* lpszLocalId, QString* lpszPeerId, XmlMessage* pMessage)
+{
     pMessage->addHeader(XN_FROM, *lpszLocalId);
     if(lpszPeerId)
         pMessage->addHeader(XN_TO, *lpszPeerId);
     pMessage->addHeader(XN_MESSAGEID, QString::number(id));
     pMessage->addHeader(XN_TYPE, MessageTypeNames[type]);
-
-    return pMessage->toString();
 }
 
-bool lmcMessaging::getHeader(QString* lpszMessage, MessageHeader** ppHeader, XmlMessage** ppMessage) {
-    *ppMessage = new XmlMessage(*lpszMessage);
-    if(!((*ppMessage)->isValid()))
-        return false;
-
-    // add time stamp to message
-    (*ppMessage)->addHeader(XN_TIME, QString::number(QDateTime::currentDateTimeUtc().toMSecsSinceEpoch()));
-
-    int type =  indexOf(MessageTypeNames, MT_Max, (*ppMessage)->header(XN_TYPE));
+bool lmcMessaging::parseHeader(XmlMessage* pMessage, MessageHeader** ppHeader)
+{
+    int type =  nameIndex<MessageType>(pMessage->header(XN_TYPE));
     if(type < 0)
         return false;
 
-    *ppHeader = new MessageHeader(
-                    (MessageType)type,
-                    (*ppMessage)->header(XN_MESSAGEID).toLongLong(),
-                    (*ppMessage)->header(XN_FROM));
+    //	the header is taken from the pool, the caller releases it after dispatch
+    *ppHeader = MsgPool<MessageHeader>::acquire();
+    (*ppHeader)->type = (MessageType)type;
+    (*ppHeader)->id = pMessage->header(XN_MESSAGEID).toLongLong();
+    (*ppHeader)->userId = pMessage->header(XN_FROM);
     return true;
 }
 
-
-int  lmcMessaging::indexOf(const QString array[], int size, const QString& value)
+//	Binary messages are only sent to peers whose version is known to support them
+WireFormat lmcMessaging::wireFormat(User* pUser)
 {
-    for(int index = 0; index < size; index++)
-    {
-        if(value == array[index])
-            return index;
-    }
+    if(!pUser || pUser->version.isEmpty())
+        return WF_Xml;
 
-    return (-1);
+    return (compareVersions(pUser->version, BINARYMSGVERSION) >= 0) ? WF_Binary : WF_Xml;
 }
 
-int lmcMessaging::statusIndexFromCode(QString status)
+//	Acknowledgements and pings are answered ahead of everything else, chat goes
+//	ahead of user details, avatars and file offers
+MsgPriority lmcMessaging::messagePriority(MessageType type)
 {
-    for(int index = 0; index < ST_COUNT; index++)
-        if(statusCode[index].compare(status) == 0)
-            return index;
-    return -1;
+    switch(type) {
+    case MT_Acknowledge:
+    case MT_Ping:
+        return MP_Control;
+    case MT_Message:
+    case MT_GroupMessage:
+    case MT_PublicMessage:
+    case MT_Broadcast:
+    case MT_ChatState:
+    case MT_Status:
+    case MT_UserName:
+    case MT_Note:
+        return MP_Interactive;
+    default:
+        return MP_Bulk;
+    }
 }
 
+
 QString  lmcMessaging::formatSize(qint64 size)
 {
     qint64 gb = 1073741824;
@@ -780,28 +843,25 @@ void lmcMessaging::sendMessage(MessageType type, QString* lpszUserId, XmlMessage
     case MT_UserName:
     case MT_Note:
     case MT_PublicMessage:
-        for(int index = 0; index < userList.count(); index++)
-            prepareMessage(type, msgId, false, &userList[index].id, pMessage);
+        prepareFanout(type, msgId, pMessage);
         msgId++;
         break;
     case MT_GroupMessage:
         if(lpszUserId)
             prepareMessage(type, msgId, false, lpszUserId, pMessage);
-        else {
-            for(int index = 0; index < userList.count(); index++)
-                prepareMessage(type, msgId, false, &userList[index].id, pMessage);
-        }
+        else
+            prepareFanout(type, msgId, pMessage);
         msgId++;
         break;
     case MT_Avatar:
         //	if user id is specified send to that user alone, else send to all
         if(lpszUserId) {
-            if(pMessage->data(XN_FILEOP) == FileOpNames[FO_Request])
+            if(pMessage->file().op == FO_Request)
                 pMessage->addData(XN_FILEID, getUuid() );
             prepareMessage(type, msgId, false, lpszUserId, pMessage);
         } else {
             for(int index = 0; index < userList.count(); index++) {
-                message = pMessage->clone();
+                message = *pMessage;
                 message.addData( XN_FILEID, getUuid() );
                 prepareMessage(type, msgId, false, &userList[index].id, &message);
             }
@@ -843,45 +903,51 @@ void lmcMessaging::sendWebMessage(MessageType type, XmlMessage *pMessage)
 void lmcMessaging::receiveBroadcast(DatagramHeader* pHeader, QString* lpszData)
 {
     MessageHeader* pMsgHeader = NULL;
-    XmlMessage* pMessage = NULL;
-    if( ! getHeader(lpszData, &pMsgHeader, &pMessage) )
+    XmlMessage message;
+    if( ! getHeader(lpszData, &pMsgHeader, &message) )
     {
         lmctrace("Warning: Broadcast header parse failed");
         return;
     }
     pMsgHeader->address = pHeader->address;
-    processBroadcast(pMsgHeader, pMessage);
+    processBroadcast(pMsgHeader, &message);
+    MsgPool<MessageHeader>::release(pMsgHeader);
 }
 
 //	A message has been received
-void lmcMessaging::receiveMessage(DatagramHeader* pHeader, QString* lpszData)
+void lmcMessaging::receiveMessage(const MsgEnvelope& envelope)
 {
     MessageHeader* pMsgHeader = NULL;
-    XmlMessage* pMessage = NULL;
-    if ( ! getHeader(lpszData, &pMsgHeader, &pMessage) )
+    //	shares the fields decoded by the network layer, they are only
+    //	copied if a handler further down modifies the message
+    XmlMessage message = envelope.message();
+    if ( ! envelope.isValid() || ! parseHeader(&message, &pMsgHeader) )
     {
         lmctrace("Warning: Message header parse failed");
         return;
     }
-    pMsgHeader->address = pHeader->address;
-    processMessage(pMsgHeader, pMessage);
+    pMsgHeader->address = envelope.address();
+    processMessage(pMsgHeader, &message);
+    MsgPool<MessageHeader>::release(pMsgHeader);
 }
 
 //	A web message has been received
 void lmcMessaging::receiveWebMessage(QString *lpszData)
 {
     MessageHeader* pMsgHeader = NULL;
-    XmlMessage* pMessage = NULL;
-    if ( ! getHeader(lpszData, &pMsgHeader, &pMessage) )
+    XmlMessage message;
+    if ( ! getHeader(lpszData, &pMsgHeader, &message) )
     {
         lmctrace("Warning: Web message header parse failed");
         return;
     }
 
-    processWebMessage(pMsgHeader, pMessage);
+    processWebMessage(pMsgHeader, &message);
+    MsgPool<MessageHeader>::release(pMsgHeader);
 }
 
-//	Handshake procedure has been completed
+//	Handshake procedure has been completed, or the session key has gone out with a
+//	new connection and the user details can follow it
 void lmcMessaging::newConnection(QString* lpszUserId, QString* lpszAddress) {
     lmctrace("Connection completed with user " + *lpszUserId + " at " + *lpszAddress);
     sendUserData(MT_UserData, QO_Get, lpszUserId, lpszAddress);
@@ -889,16 +955,56 @@ void lmcMessaging::newConnection(QString* lpszUserId, QString* lpszAddress) {
 
 void lmcMessaging::connectionLost(QString* lpszUserId) {
     lmctrace("Connection to user " + *lpszUserId + " lost");
+    suspendedUsers.remove(*lpszUserId);
+    congestedUsers.remove(*lpszUserId);
     removeUser(*lpszUserId);
 }
 
+//	While the network restores a lost connection the user stays in the list and
+//	messages to the user are held. Pending messages do not time out meanwhile,
+//	their wait starts over once the connection is back.
+void lmcMessaging::connectionSuspended(QString* lpszUserId, bool suspended) {
+    if(suspended) {
+        lmctrace("Connection to user " + *lpszUserId + " suspended");
+        suspendedUsers.insert(*lpszUserId);
+        return;
+    }
+
+    lmctrace("Connection to user " + *lpszUserId + " resumed");
+    suspendedUsers.remove(*lpszUserId);
+    for(int index = 0; index < pendingList.count(); index++)
+        if(pendingList[index].userId.compare(*lpszUserId) == 0)
+            pendingList[index].timeStamp = QDateTime::currentDateTime();
+}
+
+//	While the send queue to a user is full only control messages are sent.
+//	Pending messages wait without timing out, and are all sent again once the
+//	queue has drained, since some may have been refused before this was known.
+//	The peer shows a chat message it has already received only once.
+void lmcMessaging::sendQueueFull(QString* lpszUserId, bool full) {
+    if(full) {
+        lmctrace("Send queue to user " + *lpszUserId + " full, messages are held back");
+        congestedUsers.insert(*lpszUserId);
+        return;
+    }
+
+    lmctrace("Send queue to user " + *lpszUserId + " drained, sending pending messages");
+    congestedUsers.remove(*lpszUserId);
+    for(int index = 0; index < pendingList.count(); index++) {
+        if(pendingList[index].userId.compare(*lpszUserId) != 0)
+            continue;
+        pendingList[index].timeStamp = QDateTime::currentDateTime();
+        resendMessage(pendingList[index].type, pendingList[index].msgId, &pendingList[index].userId, &pendingList[index].xmlMessage);
+    }
+}
+
 void lmcMessaging::receiveProgress(QString* lpszUserId, QString* lpszData)
 {
     XmlMessage xmlMessage(*lpszData);
-    int fileMode = indexOf( FileModeNames, FM_Max, xmlMessage.data(XN_MODE) );
-    int fileOp   = indexOf( FileOpNames, FO_Max, xmlMessage.data(XN_FILEOP) );
-    int fileType = indexOf( FileTypeNames, FT_Max, xmlMessage.data(XN_FILETYPE) );
-    QString fileId = xmlMessage.data(XN_FILEID);
+    int fileMode = xmlMessage.file().mode;
+    int fileOp   = xmlMessage.file().op;
+    int fileType = xmlMessage.file().type;
+    QString fileId = xmlMessage.file().id;
 
     //	determine type of message to be sent to app layer based on file type
     MessageType type;
@@ -944,14 +1050,32 @@ void lmcMessaging::sendUserData(MessageType type, QueryOp op, QString* lpszUserI
     xmlMessage.addData(XN_STATUS, localUser->status);
     xmlMessage.addData(XN_NOTE, localUser->note);
     xmlMessage.addData(XN_QUERYOP, QueryOpNames[op]);
-    QString szMessage = addHeader(type, msgId, &localUser->id, lpszUserId, &xmlMessage);
-    pNetwork->sendMessage(lpszUserId, lpszAddress, &szMessage);
+    //	user data is always sent as xml, since the version of the peer is not known yet
+    QByteArray clearData = addHeader(type, msgId, &localUser->id, lpszUserId, &xmlMessage, WF_Xml);
+    pNetwork->sendMessage(lpszUserId, lpszAddress, clearData, messagePriority(type));
 }
 
-void lmcMessaging::prepareBroadcast(MessageType type, XmlMessage* pMessage) {
+//	With an address, the message goes to that user only
+void lmcMessaging::prepareBroadcast(MessageType type, XmlMessage* pMessage, QString* lpszAddress) {
     lmctrace("Sending broadcast type " + QString::number(type));
+    XmlMessage announcement;
+    if(type == MT_Announce) {
+        if(!pMessage)
+            pMessage = &announcement;
+        if(!pNetwork->publicKey.isEmpty())
+            pMessage->addData(XN_KEY, pNetwork->publicKey);
+        //	a user that connects on demand can add the local user without connecting,
+        //	older versions only look at the key
+        pMessage->addData(XN_NAME, localUser->name);
+        pMessage->addData(XN_VERSION, localUser->version);
+        pMessage->addData(XN_STATUS, localUser->status);
+        pMessage->addData(XN_NOTE, localUser->note);
+    }
     QString szMessage = addHeader(type, msgId, &localUser->id, NULL, pMessage);
-    pNetwork->sendBroadcast(&szMessage);
+    if(lpszAddress)
+        pNetwork->sendUnicast(lpszAddress, &szMessage);
+    else
+        pNetwork->sendBroadcast(&szMessage);
     lmctrace("Broadcast sending done");
 }
 
@@ -1018,10 +1142,76 @@ void lmcMessaging::prepareMessage(MessageType type, qint64 msgId, bool retry, QS
         return;
     }
 
+    //	messages on the pending list are sent once the queue has drained, others are dropped
+    if(congestedUsers.contains(receiver->id) && messagePriority(type) != MP_Control) {
+        lmctrace("Warning: Send queue to user " + receiver->id + " full. Message not sent");
+        return;
+    }
+
     lmctrace("Sending message type " + QString::number(type) + " to user " + receiver->id
         + " at " + receiver->address);
-    QString szMessage = addHeader(type, msgId, &localUser->id, lpszUserId, pMessage);
-    pNetwork->sendMessage(&receiver->id, &receiver->address, &szMessage);
+    QByteArray clearData = addHeader(type, msgId, &localUser->id, lpszUserId, pMessage, wireFormat(receiver));
+    pNetwork->sendMessage(&receiver->id, &receiver->address, clearData, messagePriority(type));
+    lmctrace("Message sending done");
+}
+
+//	Sends the same message to every user in the list. The body and common header
+//	fields are built and encoded once, only the recipient is added per user.
+void lmcMessaging::prepareFanout(MessageType type, qint64 msgId, XmlMessage* pMessage) {
+    if(!isConnected()) {
+        lmctrace("Warning: Not connected. Message not sent");
+        return;
+    }
+
+    XmlMessage message;
+    if(pMessage)
+        message = *pMessage;
+
+    switch(type) {
+    case MT_Status:
+        if(!message.dataExists(XN_STATUS))
+            message.addData(XN_STATUS, localUser->status);
+        break;
+    case MT_UserName:
+        if(!message.dataExists(XN_NAME))
+            message.addData(XN_NAME, localUser->name);
+        break;
+    case MT_Note:
+        if(!message.dataExists(XN_NOTE))
+            message.addData(XN_NOTE, localUser->note);
+        break;
+    default:
+        break;
+    }
+
+    setHeader(type, msgId, &localUser->id, NULL, &message);
+
+    //	encoded lazily, only if at least one user understands the format
+    QByteArray binaryData;
+
+    lmctrace("Sending message type " + QString::number(type) + " to " + QString::number(userList.count()) + " users");
+    for(int index = 0; index < userList.count(); index++) {
+        User* receiver = &userList[index];
+        if(congestedUsers.contains(receiver->id) && messagePriority(type) != MP_Control) {
+            lmctrace("Warning: Send queue to user " + receiver->id + " full. Message not sent");
+            continue;
+        }
+
+        QByteArray clearData;
+
+        if(wireFormat(receiver) == WF_Binary) {
+            if(binaryData.isEmpty())
+                binaryData = MsgCodec::encode(&message);
+            clearData = binaryData;
+            MsgCodec::appendHeader(clearData, XN_TO, receiver->id);
+        } else {
+            XmlMessage xmlMessage = message;
+            xmlMessage.addHeader(XN_TO, receiver->id);
+            clearData = xmlMessage.toString().toUtf8();
+        }
+
+        pNetwork->sendMessage(&receiver->id, &receiver->address, clearData, messagePriority(type));
+    }
     lmctrace("Message sending done");
 }
 
@@ -1030,8 +1220,8 @@ void lmcMessaging::prepareFile(MessageType type, qint64 msgId, bool retry, QStri
     Q_UNUSED(msgId);
     Q_UNUSED(retry);
 
-    int fileOp   = indexOf( FileOpNames, FO_Max, pMessage->data(XN_FILEOP) );
-    int fileMode = indexOf( FileModeNames, FM_Max, pMessage->data(XN_MODE) );
+    int fileOp   = pMessage->file().op;
+    int fileMode = pMessage->file().mode;
 
     User* user = getUser(lpszUserId);
     QString szMessage = pMessage->toString();
@@ -1054,7 +1244,7 @@ void lmcMessaging::prepareFile(MessageType type, qint64 msgId, bool retry, QStri
 
 //	This method converts a Datagram from network layer to a Message that can be passed to ui layer
 void lmcMessaging::processBroadcast(MessageHeader* pHeader, XmlMessage* pMessage) {
-    Q_UNUSED(pMessage);
+    QString publicKey;
 
     //	do not process broadcasts from local user unless loopback is specified in command line
     if(!loopback && pHeader->userId.compare(localUser->id) == 0)
@@ -1065,8 +1255,21 @@ void lmcMessaging::processBroadcast(MessageHeader* pHeader, XmlMessage* pMessage
 
     switch(pHeader->type) {
     case MT_Announce:
-        if(!getUser(&pHeader->userId))
-            pNetwork->addConnection(&pHeader->userId, &pHeader->address);
+        //	a new user is connected to once to learn the user details. Newer users
+        //	announce their public key, the details are exchanged in one round trip then.
+        //	With connections made on demand, a user that announces its details is added
+        //	from the announcement, and the connection waits for the first message.
+        //	The version a user announces decides how a connection made by both sides
+        //	at once is settled.
+        publicKey = pMessage->data(XN_KEY);
+        if(getUser(&pHeader->userId))
+            announcedUsers.insert(pHeader->userId);
+        else if(connectOnDemand && !pMessage->data(XN_VERSION).isEmpty() && pHeader->userId.compare(localUser->id) != 0)
+            addAnnouncedUser(pHeader, pMessage, &publicKey);
+        else {
+            setPeerVersion(&pHeader->userId, pMessage->data(XN_VERSION));
+            pNetwork->addConnection(&pHeader->userId, &pHeader->address, &publicKey);
+        }
         break;
     case MT_Depart:
         removeUser(pHeader->userId);
@@ -1078,6 +1281,33 @@ void lmcMessaging::processBroadcast(MessageHeader* pHeader, XmlMessage* pMessage
     lmctrace("Broadcast processing done");
 }
 
+//	Only the address and public key of the user are handed to the network, no
+//	connection is made. A user that has just started has not heard of the local
+//	user, so the local user is announced to that user alone. The answer is marked
+//	as a result, and is not answered in turn.
+void lmcMessaging::addAnnouncedUser(MessageHeader* pHeader, XmlMessage* pMessage, QString* lpszPublicKey) {
+    pNetwork->addPeer(&pHeader->userId, &pHeader->address, lpszPublicKey);
+    setPeerVersion(&pHeader->userId, pMessage->data(XN_VERSION));
+    announcedUsers.insert(pHeader->userId);
+    addUser(pHeader->userId, pMessage->data(XN_VERSION), pHeader->address,
+        pMessage->data(XN_NAME), pMessage->data(XN_STATUS), QString::null, pMessage->data(XN_NOTE));
+
+    if(pMessage->data(XN_QUERYOP) != QueryOpNames[QO_Result]) {
+        XmlMessage answer;
+        answer.addData(XN_QUERYOP, QueryOpNames[QO_Result]);
+        prepareBroadcast(MT_Announce, &answer, &pHeader->address);
+    }
+}
+
+//	Enables what the network does differently for peers of a newer version
+void lmcMessaging::setPeerVersion(QString* lpszUserId, const QString& szVersion) {
+    pNetwork->setCompression(lpszUserId, !szVersion.isEmpty() && compareVersions(szVersion, COMPRESSMSGVERSION) >= 0);
+    pNetwork->setFileStreaming(lpszUserId, !szVersion.isEmpty() && compareVersions(szVersion, STREAMFILEVERSION) >= 0);
+    pNetwork->setIdleClose(lpszUserId, !szVersion.isEmpty() && compareVersions(szVersion, IDLECLOSEVERSION) >= 0);
+    pNetwork->setFramedIds(lpszUserId, !szVersion.isEmpty() && compareVersions(szVersion, FRAMEDIDVERSION) >= 0);
+    pNetwork->setTieBreak(lpszUserId, !szVersion.isEmpty() && compareVersions(szVersion, TIEBREAKVERSION) >= 0);
+}
+
 void lmcMessaging::processMessage(MessageHeader* pHeader, XmlMessage* pMessage) {
     QString msgId;
     QString data = QString::null;
@@ -1088,6 +1318,8 @@ void lmcMessaging::processMessage(MessageHeader* pHeader, XmlMessage* pMessage)
 
     switch(pHeader->type) {
     case MT_UserData:
+        //	the peer version is known from here on, enable compression before replying
+        setPeerVersion(&pHeader->userId, pMessage->data(XN_VERSION));
         if(pMessage->data(XN_QUERYOP) == QueryOpNames[QO_Get])
             sendUserData(pHeader->type, QO_Result, &pHeader->userId, &pHeader->address);
         //	add the user only after sending back user data, this way both parties will have added each other
@@ -1165,8 +1397,8 @@ void lmcMessaging::processMessage(MessageHeader* pHeader, XmlMessage* pMessage)
 
 void lmcMessaging::processFile(MessageHeader* pHeader, XmlMessage* pMessage)
 {
-    int fileMode = indexOf( FileModeNames, FM_Max, pMessage->data(XN_MODE) );
-    int fileOp   = indexOf( FileOpNames, FO_Max, pMessage->data(XN_FILEOP) );
+    int fileMode = pMessage->file().mode;
+    int fileOp   = pMessage->file().op;
     QString szMessage = pMessage->toString();
 
     lmctrace("Processing file message type " + QString::number(fileOp) + " from user " +
@@ -59,6 +59,7 @@
 #include <QFile>
 #include <QMap>
 #include <QList>
+#include <QSet>
 #include <QUuid>
 #include <QHostInfo>
 
@@ -81,6 +82,8 @@
 #include "settings.h"
 
 #include "xmlmessage.h"
+#include "msgcodec.h"
+#include "nametable.h"
 #include "User.h"
 #include "Group.h"
 #include "StatusType.h"
@@ -91,8 +94,11 @@
 #include "MessageType.h"
 #include "MessageHeader.h"
 #include "PendingMsg.h"
+#include "msgpool.h"
 #include "network.h"
 
+#define POOL_TRACE_TICKS	600		// timer ticks between traces of message pool usage
+
 class lmcMessaging : public QObject
 {
 	Q_OBJECT
@@ -136,10 +142,12 @@ signals:
 
 protected slots:
 	void receiveBroadcast(DatagramHeader* pHeader, QString* lpszData);
-	void receiveMessage(DatagramHeader* pHeader, QString* lpszData);
+	void receiveMessage(const MsgEnvelope& envelope);
 	void receiveWebMessage(QString* lpszData);
 	void newConnection(QString* lpszUserId, QString* lpszAddress);
 	void connectionLost(QString* lpszUserId);
+	void connectionSuspended(QString* lpszUserId, bool suspended);
+	void sendQueueFull(QString* lpszUserId, bool full);
 	void receiveProgress(QString* lpszUserId, QString* lpszData);
 	void network_connectionStateChanged(void);
 	void timer_timeout(void);
@@ -151,11 +159,14 @@ protected:
 	void loadGroups(void);
 	void getUserInfo(XmlMessage* pMessage);
 	void sendUserData(MessageType type, QueryOp op, QString* lpszUserId, QString* lpszAddress);
-	void prepareBroadcast(MessageType type, XmlMessage* pMessage);
+	void prepareBroadcast(MessageType type, XmlMessage* pMessage, QString* lpszAddress = NULL);
 	void prepareMessage(MessageType type, qint64 msgId, bool retry, QString* lpszUserId, XmlMessage* pMessage);
+	void prepareFanout(MessageType type, qint64 msgId, XmlMessage* pMessage);
 	void prepareFile(MessageType type, qint64 msgId, bool retry, QString* lpszUserId, XmlMessage* pMessage);
 	void processBroadcast(MessageHeader* pHeader, XmlMessage* pMessage);
 	void processMessage(MessageHeader* pHeader, XmlMessage* pMessage);
+	void addAnnouncedUser(MessageHeader* pHeader, XmlMessage* pMessage, QString* lpszPublicKey);
+	void setPeerVersion(QString* lpszUserId, const QString& szVersion);
 	void processFile(MessageHeader* pHeader, XmlMessage* pMessage);
 	void processWebMessage(MessageHeader* pHeader, XmlMessage* pMessage);
 	bool addUser(QString szUserId, QString szVersion, QString szAddress, QString szName, QString szStatus, QString szAvatar, QString szNote);
@@ -166,13 +177,17 @@ protected:
 	void removePendingMsg(qint64);
 	void removeAllPendingMsg(QString* lpszUserId);
 	void checkPendingMsg(void);
+	void tracePoolUsage(void);
 	void resendMessage(MessageType type, qint64 msgId, QString* lpszUserId, XmlMessage* pMessage);
 
     QString addHeader( MessageType type, qint64 id, QString* lpszLocalId, QString* lpszPeerId, XmlMessage* pMessage);
-    bool getHeader( QString* lpszMessage, MessageHeader** ppHeader, XmlMessage** ppMessage );
+    QByteArray addHeader( MessageType type, qint64 id, QString* lpszLocalId, QString* lpszPeerId, XmlMessage* pMessage, WireFormat format );
+    bool getHeader( QString* lpszMessage, MessageHeader** ppHeader, XmlMessage* pMessage );
+    void setHeader( MessageType type, qint64 id, QString* lpszLocalId, QString* lpszPeerId, XmlMessage* pMessage );
+    bool parseHeader( XmlMessage* pMessage, MessageHeader** ppHeader );
+    WireFormat wireFormat( User* pUser );
+    MsgPriority messagePriority( MessageType type );
 
-    int indexOf(const QString array[], int size, const QString& value);
-    int statusIndexFromCode(QString status);
     QString formatSize(qint64 size);
     QString getUuid(void);
     QString getLogonName(void);
@@ -189,11 +204,16 @@ protected:
 	lmcSettings*		pSettings;
 	QTimer*				pTimer;
 	qint64				msgId;
+	int					nTimerTicks;
 	QList<ReceivedMsg>	receivedList;
 	QList<PendingMsg>	pendingList;
 	int					nTimeout;
 	int					nMaxRetry;
 	bool				loopback;
+	bool				connectOnDemand;
+	QSet<QString>		announcedUsers;	// users heard from since the last refresh
+	QSet<QString>		suspendedUsers;	// connection lost and being restored, pending messages wait
+	QSet<QString>		congestedUsers;	// send queue full, only control messages are sent
 	QMap<QString, QString> userGroupMap;
 
 };
@@ -12,26 +12,40 @@ HEADERS += \
     messaging/FileType.h \
     messaging/Group.h \
     messaging/GroupMsgOp.h \
+    messaging/loopmonitor.h \
     messaging/MessageHeader.h \
     messaging/MessageType.h \
     messaging/MessagHeaderMember.h \
     messaging/messaging.h \
+    messaging/msgcodec.h \
+    messaging/msgenvelope.h \
+    messaging/msgpool.h \
+    messaging/nametable.h \
     messaging/netstreamer.h \
     messaging/network.h \
+    messaging/networkio.h \
+    messaging/socketprofile.h \
     messaging/PendingMsg.h \
     messaging/QueryOp.h \
     messaging/ReceivedMsg.h \
     messaging/StatusType.h \
     messaging/tcpnetwork.h \
+    messaging/typedmessage.h \
     messaging/udpnetwork.h \
     messaging/User.h \
     messaging/webnetwork.h \
     messaging/xmlmessage.h
 
 SOURCES += \
+    messaging/loopmonitor.cpp \
     messaging/messaging.cpp \
     messaging/messagingproc.cpp \
+    messaging/msgcodec.cpp \
+    messaging/msgenvelope.cpp \
+    messaging/nametable.cpp \
     messaging/network.cpp \
+    messaging/networkio.cpp \
+    messaging/socketprofile.cpp \
     messaging/tcpnetwork.cpp \
     messaging/udpnetwork.cpp \
     messaging/webnetwork.cpp \
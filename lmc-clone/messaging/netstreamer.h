@@ -58,16 +58,66 @@
 #include <QFile>
 #include <QDir>
 #include <QFileInfo>
+#include <QQueue>
+#include <QElapsedTimer>
 
 #include "trace.h"
+#include "settings.h"
+#include "socketprofile.h"
 
 #include "FileType.h"
 #include "FileMode.h"
 #include "FileOp.h"
 
+#define MS_WRITEBUFFER		65536	// bytes handed to the socket ahead of what it has sent
+#define MS_READBUFFER		65536	// initial size of the receive buffer
+#define MS_FRAMEHEADER		4		// length prefix of every frame on a message stream
+#define MS_QUANTUM			32768	// bytes of higher lanes after which a waiting lower lane sends a frame
+#define MS_IDEND			'\n'	// ends the id of an eager message socket, frames follow it at once
+#define FS_STREAMHEADER		5		// operation and stream id in front of streamed file data
+#define FS_CHUNKSIZE		16384	// file data carried by one frame of a streamed transfer
+#define FS_WINDOW			262144	// bytes a streamed transfer may send ahead of the receiver
+
+//	Operations of a file transfer carried on a message stream.
+//	Each frame holds [operation:1][stream id:4] followed by the operation data.
+enum StreamOp
+{
+    SO_Open = 0,	// data is the id of the accepted file, the stream id stands for it from now on
+    SO_Data,		// data is the next chunk of the file
+    SO_Credit,		// data is the number of further bytes the sender may send
+    SO_Max
+};
+
+//	Priority lanes of a message stream, highest first. A lane is only served
+//	while the lanes above it are empty, or when it has waited for MS_QUANTUM
+//	bytes of theirs to go out.
+enum MsgPriority
+{
+    MP_Control = 0,		// handshakes, acknowledgements, pings and transfer credit
+    MP_Interactive,		// chat text, typing notices and presence
+    MP_Bulk,			// user details, avatars, file offers and file data
+    MP_Max
+};
+
+//	A frame waiting to be handed to the socket. A frame made from a message
+//	keeps the clear data of the message, to be sent again on another connection
+//	if this one is lost before the frame has gone out.
+struct QueuedFrame
+{
+	QByteArray frame;
+	QByteArray message;
+	MsgPriority priority;
+
+	QueuedFrame(void) : priority(MP_Control) {}
+	QueuedFrame(const QByteArray& baFrame, const QByteArray& baMessage, MsgPriority msgPriority) :
+		frame(baFrame), message(baMessage), priority(msgPriority) {}
+};
+
 /****************************************************************************
 ** Class: FileSender
-** Description: Handles sending files.
+** Description: Handles sending files. A file is either sent on a socket of
+**	its own, or in chunks on the message stream of the peer. A streamed
+**	transfer only sends as many bytes as the receiver has granted.
 ****************************************************************************/
 class FileSender : public QObject
 {
@@ -87,7 +137,13 @@ public:
 
 public:
 	void init(void);
+	void initStream(quint32 nStreamId);
+	void addCredit(qint64 nBytes);
+	void streamLost(void);
 	void stop(void);
+	bool isStreamed(const QString& szPeerId);
+	bool isStream(const QString& szPeerId, quint32 nStreamId);
+	qint64 size(void);
 
 	QString id;
 	FileType type;
@@ -99,6 +155,7 @@ signals:
                           QString* lpszId,
                           QString* lpszUserId,
                           QString* lpszData );
+	void streamDataReady(QString* lpszUserId, quint32 nStreamId, StreamOp op, const QByteArray& data);
 
 protected slots:
 	void connected(void);
@@ -109,6 +166,7 @@ protected slots:
 
 protected:
 	void sendFile(void);
+	void sendChunks(void);
 
 	QString peerId;
 	QString filePath;
@@ -124,12 +182,17 @@ protected:
 	qint64 milestone;
 	qint64 mile;
 	QTimer* timer;
+	bool streamed;
+	quint32 streamId;
+	qint64 credit;		// bytes the receiver will still take on the stream
 
 };
 
 /****************************************************************************
 ** Class: FileReceiver
-** Description: Handles receiving files.
+** Description: Handles receiving files, from a socket of their own or from
+**	the message stream of the peer. On a stream, further data is granted
+**	each time half of the window has been written to the file.
 ****************************************************************************/
 class FileReceiver : public QObject
 {
@@ -148,7 +211,12 @@ public:
 	~FileReceiver(void);
 
 	void init(QTcpSocket* socket);
+	bool initStream(QString* lpszUserId, quint32 nStreamId);
+	void receiveChunk(const QByteArray& data);
+	void streamLost(void);
 	void stop(void);
+	bool isStreamed(const QString& szPeerId);
+	bool isStream(const QString& szPeerId, quint32 nStreamId);
 	
 	QString id;
 	FileType type;
@@ -160,6 +228,7 @@ signals:
                          QString* lpszId,
                          QString* lpszUserId,
                          QString* lpszData );
+	void streamDataReady(QString* lpszUserId, quint32 nStreamId, StreamOp op, const QByteArray& data);
 
 protected slots:
 	void disconnected(void);
@@ -168,6 +237,8 @@ protected slots:
 
 protected:
 	void receiveFile(void);
+	void writeData(const char* pData, qint64 nLength);
+	void grantCredit(qint64 nBytes);
 
 	QString peerId;
 	QString filePath;
@@ -183,12 +254,32 @@ protected:
 	qint64 milestone;
 	qint64 mile;
 	QTimer* timer;
+	bool streamed;
+	quint32 streamId;
+	qint64 consumed;	// bytes written since credit was last granted
 
 };
 
 /****************************************************************************
 ** Class: MsgStream
 ** Description: Handles transmission and reception of TCP streaming messages.
+**	Outgoing frames wait in a queue and are handed to the socket as it
+**	drains, so a frame is never overwritten or cut short. Once the queue
+**	holds more than the queue limit, further messages are refused.
+**	Frames sent within one event loop turn, or within the coalesce delay,
+**	are merged and handed to the socket in a single write. Each frame waits
+**	in the lane of its priority, and the lanes decide the order in which
+**	frames are merged. Control frames are never refused. Once a frame has
+**	been refused, the stream signals when the queue has drained to half
+**	its limit, so that the caller can send again. The messages of
+**	frames that have not been handed to the socket in full can be taken
+**	back when the connection is lost.
+**	The connecting side holds its frames back until the peer has answered
+**	the id, so the receiving server can tell where the id ends.
+**	Incoming data is held up to the receive buffer limit of the connection
+**	and the receive budget shared by all connections. A frame that has
+**	started to arrive is always read to its end. A frame longer than
+**	the maximum frame size is rejected and the connection is closed.
 ****************************************************************************/
 class MsgStream : public QObject
 {
@@ -200,20 +291,41 @@ public:
 	~MsgStream(void);
 
 public:
-	void init(void);
+	void init(bool bEager = false, bool bFramedId = false);
 	void init(QTcpSocket* socket);
 	void stop(void);
-	void sendMessage(QByteArray& data);
+	void close(void);
+	bool sendMessage(QByteArray& data, MsgPriority priority = MP_Control);
+	bool sendFrame(QByteArray& frame, MsgPriority priority, const QByteArray& message = QByteArray());
+	void setQueueLimit(qint64 nLimit);
+	void setCoalesceDelay(int nDelay);
+	void setReceiveLimits(qint64 nMaxFrameSize, qint64 nBufferLimit);
+	bool isRejected(void);
+	void applySocketProfile(void);
+	QString socketOptions(void);
+	int queueDepth(void);
+	QList<QueuedFrame> takeUnsent(void);
+	qint64 queueBytes(void);
+	quint64 framesSent(void);
+	quint64 writesIssued(void);
+	qint64 idleTime(void);
+
+	static void setReceiveBudget(qint64 nBudget);
+	static qint64 receiveBuffered(void);
+	static quint64 framesRejected(void);
 
 signals:
 	void connectionLost(QString* lpszUserId);
 	void messageReceived(QString* lpszUserId, QString* lpszAddress, QByteArray& data);
+	void sendQueueFull(QString* lpszUserId, bool full);
 
 protected slots:
 	void connected(void);
 	void disconnected(void);
+	void connectError(QAbstractSocket::SocketError socketError);
 	void readyRead(void);
 	void bytesWritten(qint64 bytes);
+	void flush(void);
 
 protected:
 	QTcpSocket* socket;
@@ -221,11 +333,43 @@ protected:
 	QString localId;
 	QString peerId;
 	QString peerAddress;
-	QByteArray outData;
-	QByteArray inData;
-	quint32 outDataLen;
-	quint32 inDataLen;
-	bool reading;
+	QQueue<QueuedFrame> lanes[MP_Max];	// frames not yet merged, one queue per priority
+	qint64 passedOver[MP_Max];		// bytes of higher lanes sent while the lane waited
+	QByteArray outBatch;			// merged frames being handed to the socket
+	QList<QueuedFrame> batchFrames;	// frames of the batch, in the order they were merged
+	int outOffset;					// bytes of the batch already handed over
+	qint64 outQueueBytes;
+	qint64 queueLimit;
+	bool queueFull;					// a frame was refused, cleared when the queue has drained
+	QByteArray inBuffer;			// received bytes, complete frames are read in place
+	int inPos;						// start of the first frame not yet delivered
+	qint64 inBufferBytes;			// size of the receive buffer as counted in the shared budget
+	qint64 maxFrameSize;
+	qint64 bufferLimit;
+	bool rejected;					// a frame was over the size limit, the connection is closed
+	QTimer* flushTimer;				// frames sent before it fires leave in one write
+	bool peerReady;					// frames may go out, the peer has read the id
+	bool eager;						// frames follow the id without waiting for an answer
+	bool framedId;					// the id is ended with MS_IDEND, the peer need not wait for it to go quiet
+	QElapsedTimer lastActivity;		// restarted whenever a frame is sent or received
+	quint64 sentFrames;
+	quint64 socketWrites;
+
+	int nextLane(void);
+	bool nextBatch(void);
+	void traceWriteStats(void);
+	void checkQueueDrained(void);
+	void rejectFrame(quint32 frameLen);
+	qint64 frameRemainder(void);
+	void updateBuffered(void);
+	void waitForBudget(void);
+
+	//	shared by all streams, which all live on the network thread
+	static qint64 receiveBudget;
+	static qint64 bufferedTotal;
+	static quint64 rejectedTotal;
+	static QList<MsgStream*> waitingStreams;	// streams with data left to read once the budget allows
+	static void resumeWaiting(void);
 
 };
 
@@ -50,26 +50,38 @@
 
 #include "network.h"
 
+//	The udp and tcp networks and the crypto work run on their own thread, so
+//	that socket reads, decryption and decoding never wait behind the user
+//	interface. All calls to them are queued, the few that must complete
+//	before the caller goes on block until the network thread has run them.
 lmcNetwork::lmcNetwork(void)
 {
-	pUdpNetwork = new lmcUdpNetwork();
-	pTcpNetwork = new lmcTcpNetwork();
-	pWebNetwork = new lmcWebNetwork();
+	qRegisterMetaType<MsgEnvelope>("MsgEnvelope");
 
-	connect(pUdpNetwork, SIGNAL(broadcastReceived(DatagramHeader*, QString*)), 
-		this, SLOT(udp_receiveBroadcast(DatagramHeader*, QString*)));
-	connect(pTcpNetwork, SIGNAL(newConnection(QString*, QString*)),
-		this, SLOT(tcp_newConnection(QString*, QString*)));
-	connect(pTcpNetwork, SIGNAL(connectionLost(QString*)),
-		this, SLOT(tcp_connectionLost(QString*)));
-	connect(pTcpNetwork, SIGNAL(messageReceived(DatagramHeader*, QString*)), 
-		this, SLOT(tcp_receiveMessage(DatagramHeader*, QString*)));
-	connect(pTcpNetwork, SIGNAL(progressReceived(QString*, QString*)),
-		this, SLOT(tcp_receiveProgress(QString*, QString*)));
+	pIoThread = new QThread(this);
+	pNetworkIo = new lmcNetworkIo();
+	pNetworkIo->moveToThread(pIoThread);
+	connect(pIoThread, SIGNAL(finished()), pNetworkIo, SLOT(deleteLater()));
+	pWebNetwork = new lmcWebNetwork();
+	pLoopMonitor = new LoopMonitor("Main thread", this);
+
+	connect(pNetworkIo, SIGNAL(broadcastReceived(QString, QString)),
+		this, SLOT(io_receiveBroadcast(QString, QString)));
+	connect(pNetworkIo, SIGNAL(newConnection(QString, QString)),
+		this, SLOT(io_newConnection(QString, QString)));
+	connect(pNetworkIo, SIGNAL(connectionLost(QString)),
+		this, SLOT(io_connectionLost(QString)));
+	connect(pNetworkIo, SIGNAL(connectionSuspended(QString, bool)),
+		this, SLOT(io_connectionSuspended(QString, bool)));
+	connect(pNetworkIo, SIGNAL(sendQueueFull(QString, bool)),
+		this, SLOT(io_sendQueueFull(QString, bool)));
+	connect(pNetworkIo, SIGNAL(messageReceived(MsgEnvelope)),
+		this, SLOT(io_receiveMessage(MsgEnvelope)));
+	connect(pNetworkIo, SIGNAL(progressReceived(QString, QString)),
+		this, SLOT(io_receiveProgress(QString, QString)));
 	connect(pWebNetwork, SIGNAL(messageReceived(QString*)),
 		this, SLOT(web_receiveMessage(QString*)));
 	pTimer = NULL;
-	pCrypto = new lmcCrypto();
 	ipAddress = QString::null;
 	subnetMask = QString::null;
 	networkInterface = QNetworkInterface();
@@ -79,6 +91,10 @@ lmcNetwork::lmcNetwork(void)
 }
 
 lmcNetwork::~lmcNetwork(void) {
+	if(pIoThread->isRunning()) {
+		pIoThread->quit();
+		pIoThread->wait();
+	}
 }
 
 void lmcNetwork::init(XmlMessage *pInitParams) {
@@ -92,40 +108,39 @@ void lmcNetwork::init(XmlMessage *pInitParams) {
 					"\nConnection status: " + (isConnected ? "OK" : "Fail"));
 
 	int port = pInitParams->data(XN_PORT).toInt();
-	pUdpNetwork->init(port);
-	pTcpNetwork->init(port);
+	pIoThread->start();
+	QMetaObject::invokeMethod(pNetworkIo, "init", Qt::BlockingQueuedConnection, Q_ARG(int, port));
 }
 
 void lmcNetwork::start(void)
 {
     lmctrace("Network started");
 
-    QByteArray publicKey = pCrypto->generateRSA();
-    Q_UNUSED( publicKey );
+	QMetaObject::invokeMethod(pNetworkIo, "start", Qt::BlockingQueuedConnection,
+		Q_RETURN_ARG(QString, publicKey));
 
 	pTimer = new QTimer(this);
     connect( pTimer, SIGNAL(timeout()), this, SLOT(timer_timeout()) );
     pTimer->start( 2000 );
 
-	pUdpNetwork->setCrypto(pCrypto);
-	pTcpNetwork->setCrypto(pCrypto);
-
     if ( isConnected )
     {
-        pUdpNetwork->setMulticastInterface( networkInterface );
-        pUdpNetwork->setIPAddress( ipAddress, subnetMask );
-		pUdpNetwork->start();
-        pTcpNetwork->setIPAddress( ipAddress );
-        pTcpNetwork->start();
-		canReceive = pUdpNetwork->canReceive;
+		QMetaObject::invokeMethod(pNetworkIo, "connectNetwork", Qt::BlockingQueuedConnection,
+			Q_RETURN_ARG(bool, canReceive), Q_ARG(QString, networkInterface.name()),
+			Q_ARG(QString, ipAddress), Q_ARG(QString, subnetMask));
 	}
+
+	pLoopMonitor->start();
 }
 
 void lmcNetwork::stop(void) {
 	pTimer->stop();
+	pLoopMonitor->stop();
 
-	pUdpNetwork->stop();
-	pTcpNetwork->stop();
+	//	the depart message queued before this call is written out by stop
+	QMetaObject::invokeMethod(pNetworkIo, "stop", Qt::BlockingQueuedConnection);
+	pIoThread->quit();
+	pIoThread->wait();
 
     lmctrace("Network stopped");
 }
@@ -140,34 +155,79 @@ QString lmcNetwork::physicalAddress(void) {
 	return QString::null;
 }
 
+//	Blocks, the local id must be in place before anything is sent
 void lmcNetwork::setLocalId(QString* lpszLocalId) {
-	pUdpNetwork->setLocalId(lpszLocalId);
-	pTcpNetwork->setLocalId(lpszLocalId);
+	QMetaObject::invokeMethod(pNetworkIo, "setLocalId", Qt::BlockingQueuedConnection,
+		Q_ARG(QString, *lpszLocalId));
 }
 
 void lmcNetwork::sendBroadcast(QString* lpszData) {
-	pUdpNetwork->sendBroadcast(lpszData);
+	QMetaObject::invokeMethod(pNetworkIo, "sendBroadcast", Qt::QueuedConnection,
+		Q_ARG(QString, *lpszData));
+}
+
+void lmcNetwork::sendUnicast(QString* lpszAddress, QString* lpszData) {
+	QMetaObject::invokeMethod(pNetworkIo, "sendUnicast", Qt::QueuedConnection,
+		Q_ARG(QString, *lpszAddress), Q_ARG(QString, *lpszData));
+}
+
+void lmcNetwork::addConnection(QString* lpszUserId, QString* lpszAddress, QString* lpszPublicKey) {
+	QMetaObject::invokeMethod(pNetworkIo, "addConnection", Qt::QueuedConnection,
+		Q_ARG(QString, *lpszUserId), Q_ARG(QString, *lpszAddress), Q_ARG(QString, *lpszPublicKey));
 }
 
-void lmcNetwork::addConnection(QString* lpszUserId, QString* lpszAddress) {
-	pTcpNetwork->addConnection(lpszUserId, lpszAddress);
+void lmcNetwork::addPeer(QString* lpszUserId, QString* lpszAddress, QString* lpszPublicKey) {
+	QMetaObject::invokeMethod(pNetworkIo, "addPeer", Qt::QueuedConnection,
+		Q_ARG(QString, *lpszUserId), Q_ARG(QString, *lpszAddress), Q_ARG(QString, *lpszPublicKey));
 }
 
-void lmcNetwork::sendMessage(QString* lpszReceiverId, QString* lpszAddress, QString* lpszData) {
+//	The message is handed over to the network thread without waiting, so there
+//	is no result to return. A connection whose send queue fills up is reported
+//	through sendQueueFull, until then further messages to the user are refused.
+void lmcNetwork::sendMessage(QString* lpszReceiverId, QString* lpszAddress, QByteArray& clearData, MsgPriority priority) {
     Q_UNUSED(lpszAddress);
-	pTcpNetwork->sendMessage(lpszReceiverId, lpszData);
+	QMetaObject::invokeMethod(pNetworkIo, "sendMessage", Qt::QueuedConnection,
+		Q_ARG(QString, *lpszReceiverId), Q_ARG(QByteArray, clearData), Q_ARG(int, (int)priority));
+}
+
+void lmcNetwork::setCompression(QString* lpszUserId, bool enable) {
+	QMetaObject::invokeMethod(pNetworkIo, "setCompression", Qt::QueuedConnection,
+		Q_ARG(QString, *lpszUserId), Q_ARG(bool, enable));
+}
+
+void lmcNetwork::setFileStreaming(QString* lpszUserId, bool enable) {
+	QMetaObject::invokeMethod(pNetworkIo, "setFileStreaming", Qt::QueuedConnection,
+		Q_ARG(QString, *lpszUserId), Q_ARG(bool, enable));
+}
+
+void lmcNetwork::setIdleClose(QString* lpszUserId, bool enable) {
+	QMetaObject::invokeMethod(pNetworkIo, "setIdleClose", Qt::QueuedConnection,
+		Q_ARG(QString, *lpszUserId), Q_ARG(bool, enable));
+}
+
+void lmcNetwork::setFramedIds(QString* lpszUserId, bool enable) {
+	QMetaObject::invokeMethod(pNetworkIo, "setFramedIds", Qt::QueuedConnection,
+		Q_ARG(QString, *lpszUserId), Q_ARG(bool, enable));
+}
+
+void lmcNetwork::setTieBreak(QString* lpszUserId, bool enable) {
+	QMetaObject::invokeMethod(pNetworkIo, "setTieBreak", Qt::QueuedConnection,
+		Q_ARG(QString, *lpszUserId), Q_ARG(bool, enable));
 }
 
 void lmcNetwork::initSendFile(QString* lpszReceiverId, QString* lpszAddress, QString* lpszData) {
-	pTcpNetwork->initSendFile(lpszReceiverId, lpszAddress, lpszData);
+	QMetaObject::invokeMethod(pNetworkIo, "initSendFile", Qt::QueuedConnection,
+		Q_ARG(QString, *lpszReceiverId), Q_ARG(QString, *lpszAddress), Q_ARG(QString, *lpszData));
 }
 
 void lmcNetwork::initReceiveFile(QString* lpszSenderId, QString* lpszAddress, QString* lpszData) {
-	pTcpNetwork->initReceiveFile(lpszSenderId, lpszAddress, lpszData);
+	QMetaObject::invokeMethod(pNetworkIo, "initReceiveFile", Qt::QueuedConnection,
+		Q_ARG(QString, *lpszSenderId), Q_ARG(QString, *lpszAddress), Q_ARG(QString, *lpszData));
 }
 
 void lmcNetwork::fileOperation(FileMode mode, QString* lpszUserId, QString* lpszData) {
-	pTcpNetwork->fileOperation(mode, lpszUserId, lpszData);
+	QMetaObject::invokeMethod(pNetworkIo, "fileOperation", Qt::QueuedConnection,
+		Q_ARG(int, (int)mode), Q_ARG(QString, *lpszUserId), Q_ARG(QString, *lpszData));
 }
 
 void lmcNetwork::sendWebMessage(QString *lpszUrl, QString *lpszData) {
@@ -175,8 +235,7 @@ void lmcNetwork::sendWebMessage(QString *lpszUrl, QString *lpszData) {
 }
 
 void lmcNetwork::settingsChanged(void) {
-	pUdpNetwork->settingsChanged();
-	pTcpNetwork->settingsChanged();
+	QMetaObject::invokeMethod(pNetworkIo, "settingsChanged", Qt::QueuedConnection);
 }
 
 void lmcNetwork::timer_timeout(void) {
@@ -189,38 +248,55 @@ void lmcNetwork::timer_timeout(void) {
 			"\nConnection status: " + (isConnected ? "OK" : "Fail"));
 
 		if(isConnected) {
-			pUdpNetwork->setMulticastInterface(networkInterface);
-			pUdpNetwork->setIPAddress(ipAddress, subnetMask);
-			pUdpNetwork->start();
-			pTcpNetwork->setIPAddress(ipAddress);
-			pTcpNetwork->start();
-			canReceive = pUdpNetwork->canReceive;
+			QMetaObject::invokeMethod(pNetworkIo, "connectNetwork", Qt::BlockingQueuedConnection,
+				Q_RETURN_ARG(bool, canReceive), Q_ARG(QString, networkInterface.name()),
+				Q_ARG(QString, ipAddress), Q_ARG(QString, subnetMask));
 		} else {
-			pUdpNetwork->stop();
-			pTcpNetwork->stop();
+			QMetaObject::invokeMethod(pNetworkIo, "disconnectNetwork", Qt::BlockingQueuedConnection);
 		}
 		emit connectionStateChanged();
 	}
 }
 
-void lmcNetwork::udp_receiveBroadcast(DatagramHeader* pHeader, QString* lpszData) {
-	emit broadcastReceived(pHeader, lpszData);
+//	The header is made on this thread and only lives for the dispatch
+void lmcNetwork::io_receiveBroadcast(const QString& szAddress, const QString& szData) {
+	DatagramHeader* pHeader = MsgPool<DatagramHeader>::acquire();
+	pHeader->type = DT_Broadcast;
+	pHeader->address = szAddress;
+	QString data = szData;
+	emit broadcastReceived(pHeader, &data);
+	MsgPool<DatagramHeader>::release(pHeader);
+}
+
+void lmcNetwork::io_newConnection(const QString& szUserId, const QString& szAddress) {
+	QString userId = szUserId;
+	QString address = szAddress;
+	emit newConnection(&userId, &address);
+}
+
+void lmcNetwork::io_connectionLost(const QString& szUserId) {
+	QString userId = szUserId;
+	emit connectionLost(&userId);
 }
 
-void lmcNetwork::tcp_newConnection(QString* lpszUserId, QString* lpszAddress) {
-	emit newConnection(lpszUserId, lpszAddress);
+void lmcNetwork::io_connectionSuspended(const QString& szUserId, bool suspended) {
+	QString userId = szUserId;
+	emit connectionSuspended(&userId, suspended);
 }
 
-void lmcNetwork::tcp_connectionLost(QString* lpszUserId) {
-	emit connectionLost(lpszUserId);
+void lmcNetwork::io_sendQueueFull(const QString& szUserId, bool full) {
+	QString userId = szUserId;
+	emit sendQueueFull(&userId, full);
 }
 
-void lmcNetwork::tcp_receiveMessage(DatagramHeader* pHeader, QString* lpszData) {
-	emit messageReceived(pHeader, lpszData);
+void lmcNetwork::io_receiveMessage(const MsgEnvelope& envelope) {
+	emit messageReceived(envelope);
 }
 
-void lmcNetwork::tcp_receiveProgress(QString* lpszUserId, QString* lpszData) {
-	emit progressReceived(lpszUserId, lpszData);
+void lmcNetwork::io_receiveProgress(const QString& szUserId, const QString& szData) {
+	QString userId = szUserId;
+	QString data = szData;
+	emit progressReceived(&userId, &data);
 }
 
 void lmcNetwork::web_receiveMessage(QString *lpszData) {
@@ -54,15 +54,16 @@
 #include <QNetworkAddressEntry>
 #include <QHostAddress>
 #include <QTimer>
+#include <QThread>
 
 #include "trace.h"
 #include "crypto.h"
 #include "settings.h"
 
 #include "xmlmessage.h"
-#include "udpnetwork.h"
-#include "tcpnetwork.h"
+#include "networkio.h"
 #include "webnetwork.h"
+#include "loopmonitor.h"
 
 class lmcNetwork : public QObject
 {
@@ -80,8 +81,15 @@ public:
 	void setLocalId(QString* lpszLocalId);
 
 	void sendBroadcast(QString* lpszData);
-	void addConnection(QString* lpszUserId, QString* lpszAddress);
-	void sendMessage(QString* lpszReceiverId, QString* lpszAddress, QString* lpszData);
+	void sendUnicast(QString* lpszAddress, QString* lpszData);
+	void addConnection(QString* lpszUserId, QString* lpszAddress, QString* lpszPublicKey);
+	void addPeer(QString* lpszUserId, QString* lpszAddress, QString* lpszPublicKey);
+	void sendMessage(QString* lpszReceiverId, QString* lpszAddress, QByteArray& clearData, MsgPriority priority = MP_Interactive);
+	void setCompression(QString* lpszUserId, bool enable);
+	void setFileStreaming(QString* lpszUserId, bool enable);
+	void setIdleClose(QString* lpszUserId, bool enable);
+	void setFramedIds(QString* lpszUserId, bool enable);
+	void setTieBreak(QString* lpszUserId, bool enable);
 	void initSendFile(QString* lpszReceiverId, QString* lpszAddress, QString* lpszData);
 	void initReceiveFile(QString* lpszSenderId, QString* lpszAddress, QString* lpszData);
 	void fileOperation(FileMode mode, QString* lpszUserId, QString* lpszData);
@@ -92,23 +100,28 @@ public:
 	QString	subnetMask;
 	bool	isConnected;
 	bool	canReceive;
+	QString	publicKey;	// announced, so that peers can share a session key as they connect
 
 signals:
 	void connectionStateChanged(void);
 	void broadcastReceived(DatagramHeader* pHeader, QString* lpszData);
 	void newConnection(QString* lpszUserId, QString *lpszAddress);
 	void connectionLost(QString* lpszUserId);
-	void messageReceived(DatagramHeader* pHeader, QString* lpszData);
+	void connectionSuspended(QString* lpszUserId, bool suspended);
+	void sendQueueFull(QString* lpszUserId, bool full);
+	void messageReceived(const MsgEnvelope& envelope);
 	void progressReceived(QString* lpszUserId, QString* lpszData);
 	void webMessageReceived(QString* lpszData);
 
 protected slots:
 	void timer_timeout(void);
-	void udp_receiveBroadcast(DatagramHeader* pHeader, QString* lpszData);
-	void tcp_newConnection(QString* lpszUserId, QString* lpszAddress);
-	void tcp_connectionLost(QString* lpszUserId);
-	void tcp_receiveMessage(DatagramHeader* pHeader, QString* lpszData);
-	void tcp_receiveProgress(QString* lpszUserId, QString* lpszData);
+	void io_receiveBroadcast(const QString& szAddress, const QString& szData);
+	void io_newConnection(const QString& szUserId, const QString& szAddress);
+	void io_connectionLost(const QString& szUserId);
+	void io_connectionSuspended(const QString& szUserId, bool suspended);
+	void io_sendQueueFull(const QString& szUserId, bool full);
+	void io_receiveMessage(const MsgEnvelope& envelope);
+	void io_receiveProgress(const QString& szUserId, const QString& szData);
 	void web_receiveMessage(QString* lpszData);
 
 protected:
@@ -126,10 +139,10 @@ protected:
 	};
 
 	lmcSettings*			pSettings;
-	lmcUdpNetwork*			pUdpNetwork;
-	lmcTcpNetwork*			pTcpNetwork;
+	QThread*				pIoThread;
+	lmcNetworkIo*			pNetworkIo;
 	lmcWebNetwork*			pWebNetwork;
-	lmcCrypto*				pCrypto;
+	LoopMonitor*			pLoopMonitor;
 	QTimer*					pTimer;
 	QString					szInterfaceName;
 	QNetworkInterface		networkInterface;
@@ -0,0 +1,263 @@
+/*
+    lmc-clone
+    http://code.google.com/p/lmc-clone
+
+    lmc is a lan messenger, instant messaging client.
+    http://lanmsngr.sourceforge.net/
+    http://sourceforge.net/projects/lanmsngr/
+
+    GNU LESSER GENERAL PUBLIC LICENSE
+    Version 3, 29 June 2007
+    Copyright (c) 2007 Free Software Foundation, Inc. <http://fsf.org/>
+    Everyone is permitted to copy and distribute verbatim copies of this license document, but changing it is not allowed.
+    This version of the GNU Lesser General Public License incorporates the terms and conditions of version 3 of the GNU General Public License, supplemented by the additional permissions listed below.
+     0. Additional Definitions.
+    As used herein, “this License” refers to version 3 of the GNU Lesser General Public License, and the “GNU GPL” refers to version 3 of the GNU General Public License.
+    “The Library” refers to a covered work governed by this License, other than an Application or a Combined Work as defined below.
+    An “Application” is any work that makes use of an interface provided by the Library, but which is not otherwise based on the Library. Defining a subclass of a class defined by the Library is deemed a mode of using an interface provided by the Library.
+    A “Combined Work” is a work produced by combining or linking an Application with the Library. The particular version of the Library with which the Combined Work was made is also called the “Linked Version”.
+    The “Minimal Corresponding Source” for a Combined Work means the Corresponding Source for the Combined Work, excluding any source code for portions of the Combined Work that, considered in isolation, are based on the Application, and not on the Linked Version.
+    The “Corresponding Application Code” for a Combined Work means the object code and/or source code for the Application, including any data and utility programs needed for reproducing the Combined Work from the Application, but excluding the System Libraries of the Combined Work.
+     1. Exception to Section 3 of the GNU GPL.
+    You may convey a covered work under sections 3 and 4 of this License without being bound by section 3 of the GNU GPL.
+     2. Conveying Modified Versions.
+    If you modify a copy of the Library, and, in your modifications, a facility refers to a function or data to be supplied by an Application that uses the facility (other than as an argument passed when the facility is invoked), then you may convey a copy of the modified version:
+    a) under this License, provided that you make a good faith effort to ensure that, in the event an Application does not supply the function or data, the facility still operates, and performs whatever part of its purpose remains meaningful, or
+    b) under the GNU GPL, with none of the additional permissions of this License applicable to that copy.
+     3. Object Code Incorporating Material from Library Header Files.
+    The object code form of an Application may incorporate material from a header file that is part of the Library. You may convey such object code under terms of your choice, provided that, if the incorporated material is not limited to numerical parameters, data structure layouts and accessors, or small macros, inline functions and templates (ten or fewer lines in length), you do both of the following:
+    a) Give prominent notice with each copy of the object code that the Library is used in it and that the Library and its use are covered by this License.
+    b) Accompany the object code with a copy of the GNU GPL and this license document.
+     4. Combined Works.
+    You may convey a Combined Work under terms of your choice that, taken together, effectively do not restrict modification of the portions of the Library contained in the Combined Work and reverse engineering for debugging such modifications, if you also do each of the following:
+    a) Give prominent notice with each copy of the Combined Work that the Library is used in it and that the Library and its use are covered by this License.
+    b) Accompany the Combined Work with a copy of the GNU GPL and this license document.
+    c) For a Combined Work that displays copyright notices during execution, include the copyright notice for the Library among these notices, as well as a reference directing the user to the copies of the GNU GPL and this license document.
+    d) Do one of the following:
+        0) Convey the Minimal Corresponding Source under the terms of this License, and the Corresponding Application Code in a form suitable for, and under terms that permit, the user to recombine or relink the Application with a modified version of the Linked Version to produce a modified Combined Work, in the manner specified by section 6 of the GNU GPL for conveying Corresponding Source.
+        1) Use a suitable shared library mechanism for linking with the Library. A suitable mechanism is one that (a) uses at run time a copy of the Library already present on the user's computer system, and (b) will operate properly with a modified version of the Library that is interface-compatible with the Linked Version.
+    e) Provide Installation Information, but only if you would otherwise be required to provide such information under section 6 of the GNU GPL, and only to the extent that such information is necessary to install and execute a modified version of the Combined Work produced by recombining or relinking the Application with a modified version of the Linked Version. (If you use option 4d0, the Installation Information must accompany the Minimal Corresponding Source and Corresponding Application Code. If you use option 4d1, you must provide the Installation Information in the manner specified by section 6 of the GNU GPL for conveying Corresponding Source.)
+     5. Combined Libraries.
+    You may place library facilities that are a work based on the Library side by side in a single library together with other library facilities that are not Applications and are not covered by this License, and convey such a combined library under terms of your choice, if you do both of the following:
+    a) Accompany the combined library with a copy of the same work based on the Library, uncombined with any other library facilities, conveyed under the terms of this License.
+    b) Give prominent notice with the combined library that part of it is a work based on the Library, and explaining where to find the accompanying uncombined form of the same work.
+     6. Revised Versions of the GNU Lesser General Public License.
+    The Free Software Foundation may publish revised and/or new versions of the GNU Lesser General Public License from time to time. Such new versions will be similar in spirit to the present version, but may differ in detail to address new problems or concerns.
+    Each version is given a distinguishing version number. If the Library as you received it specifies that a certain numbered version of the GNU Lesser General Public License “or any later version” applies to it, you have the option of following the terms and conditions either of that published version or of any later version published by the Free Software Foundation. If the Library as you received it does not specify a version number of the GNU Lesser General Public License, you may choose any version of the GNU Lesser General Public License ever published by the Free Software Foundation.
+    If the Library as you received it specifies that a proxy can decide whether future versions of the GNU Lesser General Public License shall apply, that proxy's public statement of acceptance of any version is permanent authorization for you to choose that version for the Library.
+*/
+
+#include "socketprofile.h"
+
+#if defined Q_OS_WIN
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+#endif
+
+//	Message sockets carry frames that are already gathered, so they are not held
+//	back again, and a dead peer is found within seconds. File sockets get large
+//	buffers. The udp receiver only needs room for bursts of announcements.
+static const SocketOptions defaultProfiles[SC_Max] =
+{
+	//	nodelay	keepalive	idle	interval	count	timeout	sndbuf		rcvbuf		fastopen	tos
+	{	true,	true,		30,		10,			3,		30000,	0,			0,			true,		0x10	},
+	{	false,	true,		60,		10,			6,		120000,	1048576,	1048576,	false,		0x08	},
+	{	false,	false,		0,		0,			0,		0,		0,			262144,		false,		0		}
+};
+
+SocketOptions SocketProfile::profiles[SC_Max] =
+{
+	defaultProfiles[SC_Message],
+	defaultProfiles[SC_File],
+	defaultProfiles[SC_Broadcast]
+};
+
+//----------------------------------------------------------------------------
+
+void SocketProfile::load(lmcSettings* pSettings)
+{
+	for(int channel = 0; channel < SC_Max; channel++) {
+		QString group = QString(IDS_SOCKETPROFILE) + "/" + SocketChannelNames[channel] + "/";
+		const SocketOptions& defaults = defaultProfiles[channel];
+		SocketOptions& profile = profiles[channel];
+
+		profile.noDelay = pSettings->value(group + IDS_SP_NODELAY, defaults.noDelay).toBool();
+		profile.keepAlive = pSettings->value(group + IDS_SP_KEEPALIVE, defaults.keepAlive).toBool();
+		profile.keepAliveIdle = pSettings->value(group + IDS_SP_KEEPALIVEIDLE, defaults.keepAliveIdle).toInt();
+		profile.keepAliveInterval = pSettings->value(group + IDS_SP_KEEPALIVEINTERVAL, defaults.keepAliveInterval).toInt();
+		profile.keepAliveCount = pSettings->value(group + IDS_SP_KEEPALIVECOUNT, defaults.keepAliveCount).toInt();
+		profile.userTimeout = pSettings->value(group + IDS_SP_USERTIMEOUT, defaults.userTimeout).toInt();
+		profile.sendBuffer = pSettings->value(group + IDS_SP_SENDBUFFER, defaults.sendBuffer).toInt();
+		profile.receiveBuffer = pSettings->value(group + IDS_SP_RECEIVEBUFFER, defaults.receiveBuffer).toInt();
+		profile.fastOpen = pSettings->value(group + IDS_SP_FASTOPEN, defaults.fastOpen).toBool();
+		profile.typeOfService = pSettings->value(group + IDS_SP_TYPEOFSERVICE, defaults.typeOfService).toInt();
+	}
+}
+
+//----------------------------------------------------------------------------
+
+//	Fast open has to be asked for before connecting, so the socket is bound
+//	first to get a descriptor. The kernel only sends data with the syn once it
+//	holds a cookie from an earlier connection to the peer, which makes this pay
+//	off when connections are restored. Elsewhere the socket connects as usual.
+void SocketProfile::prepareConnect(SocketChannel channel, QAbstractSocket* pSocket, const QHostAddress& peerAddress)
+{
+#if defined TCP_FASTOPEN_CONNECT
+	if(!profiles[channel].fastOpen)
+		return;
+
+	bool bound = pSocket->bind(peerAddress.protocol() == QAbstractSocket::IPv6Protocol ? QHostAddress::AnyIPv6 : QHostAddress::AnyIPv4);
+	if(bound)
+		setOption(pSocket->socketDescriptor(), IPPROTO_TCP, TCP_FASTOPEN_CONNECT, 1);
+#else
+	Q_UNUSED(channel);
+	Q_UNUSED(pSocket);
+	Q_UNUSED(peerAddress);
+#endif
+}
+
+//----------------------------------------------------------------------------
+
+void SocketProfile::apply(SocketChannel channel, QAbstractSocket* pSocket)
+{
+	qintptr descriptor = pSocket->socketDescriptor();
+	if(descriptor == -1)
+		return;
+
+	const SocketOptions& profile = profiles[channel];
+
+	if(pSocket->socketType() == QAbstractSocket::TcpSocket) {
+		setOption(descriptor, IPPROTO_TCP, TCP_NODELAY, profile.noDelay ? 1 : 0);
+		setOption(descriptor, SOL_SOCKET, SO_KEEPALIVE, profile.keepAlive ? 1 : 0);
+		if(profile.keepAlive) {
+#if defined TCP_KEEPIDLE
+			if(profile.keepAliveIdle > 0)
+				setOption(descriptor, IPPROTO_TCP, TCP_KEEPIDLE, profile.keepAliveIdle);
+#elif defined TCP_KEEPALIVE
+			if(profile.keepAliveIdle > 0)
+				setOption(descriptor, IPPROTO_TCP, TCP_KEEPALIVE, profile.keepAliveIdle);
+#endif
+#if defined TCP_KEEPINTVL
+			if(profile.keepAliveInterval > 0)
+				setOption(descriptor, IPPROTO_TCP, TCP_KEEPINTVL, profile.keepAliveInterval);
+#endif
+#if defined TCP_KEEPCNT
+			if(profile.keepAliveCount > 0)
+				setOption(descriptor, IPPROTO_TCP, TCP_KEEPCNT, profile.keepAliveCount);
+#endif
+		}
+#if defined TCP_USER_TIMEOUT
+		if(profile.userTimeout > 0)
+			setOption(descriptor, IPPROTO_TCP, TCP_USER_TIMEOUT, profile.userTimeout);
+#elif defined TCP_MAXRT
+		if(profile.userTimeout > 0)
+			setOption(descriptor, IPPROTO_TCP, TCP_MAXRT, qMax(profile.userTimeout / 1000, 1));
+#endif
+	}
+
+	if(profile.sendBuffer > 0)
+		setOption(descriptor, SOL_SOCKET, SO_SNDBUF, profile.sendBuffer);
+	if(profile.receiveBuffer > 0)
+		setOption(descriptor, SOL_SOCKET, SO_RCVBUF, profile.receiveBuffer);
+
+	if(profile.typeOfService > 0) {
+		if(pSocket->localAddress().protocol() != QAbstractSocket::IPv6Protocol)
+			setOption(descriptor, IPPROTO_IP, IP_TOS, profile.typeOfService);
+#if defined IPV6_TCLASS
+		else
+			setOption(descriptor, IPPROTO_IPV6, IPV6_TCLASS, profile.typeOfService);
+#endif
+	}
+}
+
+//----------------------------------------------------------------------------
+
+//	Lets the server take data with the syn from peers that hold a cookie
+void SocketProfile::applyListen(SocketChannel channel, QTcpServer* pServer)
+{
+#if defined TCP_FASTOPEN
+	if(profiles[channel].fastOpen && pServer->socketDescriptor() != -1)
+		setOption(pServer->socketDescriptor(), IPPROTO_TCP, TCP_FASTOPEN, SP_FASTOPENQUEUE);
+#else
+	Q_UNUSED(channel);
+	Q_UNUSED(pServer);
+#endif
+}
+
+//----------------------------------------------------------------------------
+
+//	Options as the system reports them, -1 where it does not
+QString SocketProfile::describe(QAbstractSocket* pSocket)
+{
+	qintptr descriptor = pSocket->socketDescriptor();
+	if(descriptor == -1)
+		return "no socket";
+
+	QStringList options;
+	if(pSocket->socketType() == QAbstractSocket::TcpSocket) {
+		options.append("nodelay=" + QString::number(option(descriptor, IPPROTO_TCP, TCP_NODELAY)));
+		options.append("keepalive=" + QString::number(option(descriptor, SOL_SOCKET, SO_KEEPALIVE)));
+#if defined TCP_KEEPIDLE
+		options.append("keepidle=" + QString::number(option(descriptor, IPPROTO_TCP, TCP_KEEPIDLE)));
+#elif defined TCP_KEEPALIVE
+		options.append("keepidle=" + QString::number(option(descriptor, IPPROTO_TCP, TCP_KEEPALIVE)));
+#endif
+#if defined TCP_KEEPINTVL
+		options.append("keepintvl=" + QString::number(option(descriptor, IPPROTO_TCP, TCP_KEEPINTVL)));
+#endif
+#if defined TCP_KEEPCNT
+		options.append("keepcnt=" + QString::number(option(descriptor, IPPROTO_TCP, TCP_KEEPCNT)));
+#endif
+#if defined TCP_USER_TIMEOUT
+		options.append("usertimeout=" + QString::number(option(descriptor, IPPROTO_TCP, TCP_USER_TIMEOUT)));
+#elif defined TCP_MAXRT
+		options.append("maxrt=" + QString::number(option(descriptor, IPPROTO_TCP, TCP_MAXRT)));
+#endif
+#if defined TCP_FASTOPEN_CONNECT
+		options.append("fastopen=" + QString::number(option(descriptor, IPPROTO_TCP, TCP_FASTOPEN_CONNECT)));
+#endif
+	}
+	options.append("sndbuf=" + QString::number(option(descriptor, SOL_SOCKET, SO_SNDBUF)));
+	options.append("rcvbuf=" + QString::number(option(descriptor, SOL_SOCKET, SO_RCVBUF)));
+	if(pSocket->localAddress().protocol() != QAbstractSocket::IPv6Protocol)
+		options.append("tos=" + QString::number(option(descriptor, IPPROTO_IP, IP_TOS)));
+#if defined IPV6_TCLASS
+	else
+		options.append("tclass=" + QString::number(option(descriptor, IPPROTO_IPV6, IPV6_TCLASS)));
+#endif
+
+	QString endpoints = pSocket->localAddress().toString() + ":" + QString::number(pSocket->localPort());
+	if(pSocket->state() == QAbstractSocket::ConnectedState)
+		endpoints += " -> " + pSocket->peerAddress().toString() + ":" + QString::number(pSocket->peerPort());
+	return endpoints + " " + options.join(" ");
+}
+
+//----------------------------------------------------------------------------
+
+bool SocketProfile::setOption(qintptr descriptor, int level, int name, int value)
+{
+	return (setsockopt(descriptor, level, name, (const char*)&value, sizeof(value)) == 0);
+}
+
+//----------------------------------------------------------------------------
+
+int SocketProfile::option(qintptr descriptor, int level, int name)
+{
+	int value = 0;
+#if defined Q_OS_WIN
+	int length = sizeof(value);
+#else
+	socklen_t length = sizeof(value);
+#endif
+	if(getsockopt(descriptor, level, name, (char*)&value, &length) != 0)
+		return -1;
+	return value;
+}
+
+//----------------------------------------------------------------------------
@@ -12,12 +12,12 @@
     Everyone is permitted to copy and distribute verbatim copies of this license document, but changing it is not allowed.
     This version of the GNU Lesser General Public License incorporates the terms and conditions of version 3 of the GNU General Public License, supplemented by the additional permissions listed below.
      0. Additional Definitions.
-    As used herein, this License refers to version 3 of the GNU Lesser General Public License, and the GNU GPL refers to version 3 of the GNU General Public License.
-    The Library refers to a covered work governed by this License, other than an Application or a Combined Work as defined below.
-    An Application is any work that makes use of an interface provided by the Library, but which is not otherwise based on the Library. Defining a subclass of a class defined by the Library is deemed a mode of using an interface provided by the Library.
-    A Combined Work is a work produced by combining or linking an Application with the Library. The particular version of the Library with which the Combined Work was made is also called the Linked Version.
-    The Minimal Corresponding Source for a Combined Work means the Corresponding Source for the Combined Work, excluding any source code for portions of the Combined Work that, considered in isolation, are based on the Application, and not on the Linked Version.
-    The Corresponding Application Code for a Combined Work means the object code and/or source code for the Application, including any data and utility programs needed for reproducing the Combined Work from the Application, but excluding the System Libraries of the Combined Work.
+    As used herein, “this License” refers to version 3 of the GNU Lesser General Public License, and the “GNU GPL” refers to version 3 of the GNU General Public License.
+    “The Library” refers to a covered work governed by this License, other than an Application or a Combined Work as defined below.
+    An “Application” is any work that makes use of an interface provided by the Library, but which is not otherwise based on the Library. Defining a subclass of a class defined by the Library is deemed a mode of using an interface provided by the Library.
+    A “Combined Work” is a work produced by combining or linking an Application with the Library. The particular version of the Library with which the Combined Work was made is also called the “Linked Version”.
+    The “Minimal Corresponding Source” for a Combined Work means the Corresponding Source for the Combined Work, excluding any source code for portions of the Combined Work that, considered in isolation, are based on the Application, and not on the Linked Version.
+    The “Corresponding Application Code” for a Combined Work means the object code and/or source code for the Application, including any data and utility programs needed for reproducing the Combined Work from the Application, but excluding the System Libraries of the Combined Work.
      1. Exception to Section 3 of the GNU GPL.
     You may convey a covered work under sections 3 and 4 of this License without being bound by section 3 of the GNU GPL.
      2. Conveying Modified Versions.
@@ -43,12 +43,14 @@
     b) Give prominent notice with the combined library that part of it is a work based on the Library, and explaining where to find the accompanying uncombined form of the same work.
      6. Revised Versions of the GNU Lesser General Public License.
     The Free Software Foundation may publish revised and/or new versions of the GNU Lesser General Public License from time to time. Such new versions will be similar in spirit to the present version, but may differ in detail to address new problems or concerns.
-    Each version is given a distinguishing version number. If the Library as you received it specifies that a certain numbered version of the GNU Lesser General Public License or any later version applies to it, you have the option of following the terms and conditions either of that published version or of any later version published by the Free Software Foundation. If the Library as you received it does not specify a version number of the GNU Lesser General Public License, you may choose any version of the GNU Lesser General Public License ever published by the Free Software Foundation.
+    Each version is given a distinguishing version number. If the Library as you received it specifies that a certain numbered version of the GNU Lesser General Public License “or any later version” applies to it, you have the option of following the terms and conditions either of that published version or of any later version published by the Free Software Foundation. If the Library as you received it does not specify a version number of the GNU Lesser General Public License, you may choose any version of the GNU Lesser General Public License ever published by the Free Software Foundation.
     If the Library as you received it specifies that a proxy can decide whether future versions of the GNU Lesser General Public License shall apply, that proxy's public statement of acceptance of any version is permanent authorization for you to choose that version for the Library.
 */
 
 #include "tcpnetwork.h"
 
+#include <algorithm>
+
 lmcTcpNetwork::lmcTcpNetwork(void)
 {
 	sendList.clear();
@@ -57,8 +59,35 @@ lmcTcpNetwork::lmcTcpNetwork(void)
 	locMsgStream = NULL;
 	crypto = NULL;
 	ipAddress = QHostAddress::Null;
+	compression = false;
+	compressThreshold = IDS_COMPRESSTHRESHOLD_VAL;
+	sendQueueLimit = IDS_SENDQUEUELIMIT_VAL;
+	coalesceDelay = IDS_COALESCEDELAY_VAL;
+	maxFrameSize = IDS_MAXFRAMESIZE_VAL;
+	receiveBuffer = IDS_RECEIVEBUFFER_VAL;
+	fileStreamLimit = IDS_FILESTREAMLIMIT_VAL;
+	nextStreamId = 1;
+	onDemand = IDS_CONNECTONDEMAND_VAL;
+	idleTimeout = IDS_IDLETIMEOUT_VAL * 1000;
+	maxConnections = IDS_MAXCONNECTIONS_VAL;
+	maxHandshakes = IDS_MAXHANDSHAKES_VAL;
+	queuedHandshakes = 0;
+	totalHandshakeWait = 0;
+	maxHandshakeWait = 0;
+	reconnectGrace = IDS_RECONNECTGRACE_VAL * 1000;
+	duplicateConnections = 0;
+	cryptoPool = NULL;
+	cryptoThreads = IDS_CRYPTOTHREADS_VAL;
+	nextKeyJob = 1;
+	completedHandshakes = 0;
 	server = new QTcpServer(this);
 	connect(server, SIGNAL(newConnection()), this, SLOT(server_newConnection()));
+	idleTimer = new QTimer(this);
+	connect(idleTimer, SIGNAL(timeout()), this, SLOT(idleTimer_timeout()));
+	reconnectTimer = new QTimer(this);
+	connect(reconnectTimer, SIGNAL(timeout()), this, SLOT(reconnectTimer_timeout()));
+	yieldTimer = new QTimer(this);
+	connect(yieldTimer, SIGNAL(timeout()), this, SLOT(yieldTimer_timeout()));
 }
 
 lmcTcpNetwork::~lmcTcpNetwork(void)
@@ -70,6 +99,21 @@ void lmcTcpNetwork::init(int nPort)
 {
     pSettings = new lmcSettings();
 	tcpPort = nPort > 0 ? nPort : pSettings->value(IDS_TCPPORT, IDS_TCPPORT_VAL).toInt();
+	compression = pSettings->value(IDS_COMPRESSION, IDS_COMPRESSION_VAL).toBool();
+	compressThreshold = pSettings->value(IDS_COMPRESSTHRESHOLD, IDS_COMPRESSTHRESHOLD_VAL).toInt();
+	sendQueueLimit = pSettings->value(IDS_SENDQUEUELIMIT, IDS_SENDQUEUELIMIT_VAL).toLongLong();
+	coalesceDelay = pSettings->value(IDS_COALESCEDELAY, IDS_COALESCEDELAY_VAL).toInt();
+	maxFrameSize = pSettings->value(IDS_MAXFRAMESIZE, IDS_MAXFRAMESIZE_VAL).toLongLong();
+	receiveBuffer = pSettings->value(IDS_RECEIVEBUFFER, IDS_RECEIVEBUFFER_VAL).toLongLong();
+	MsgStream::setReceiveBudget(pSettings->value(IDS_RECEIVEBUDGET, IDS_RECEIVEBUDGET_VAL).toLongLong());
+	fileStreamLimit = pSettings->value(IDS_FILESTREAMLIMIT, IDS_FILESTREAMLIMIT_VAL).toLongLong();
+	onDemand = pSettings->value(IDS_CONNECTONDEMAND, IDS_CONNECTONDEMAND_VAL).toBool();
+	idleTimeout = pSettings->value(IDS_IDLETIMEOUT, IDS_IDLETIMEOUT_VAL).toInt() * 1000;
+	maxConnections = pSettings->value(IDS_MAXCONNECTIONS, IDS_MAXCONNECTIONS_VAL).toInt();
+	maxHandshakes = pSettings->value(IDS_MAXHANDSHAKES, IDS_MAXHANDSHAKES_VAL).toInt();
+	cryptoThreads = pSettings->value(IDS_CRYPTOTHREADS, IDS_CRYPTOTHREADS_VAL).toInt();
+	reconnectGrace = pSettings->value(IDS_RECONNECTGRACE, IDS_RECONNECTGRACE_VAL).toInt() * 1000;
+	SocketProfile::load(pSettings);
 }
 
 void lmcTcpNetwork::start(void)
@@ -77,37 +121,88 @@ void lmcTcpNetwork::start(void)
     lmctrace("Starting TCP server");
 	isRunning = server->listen(QHostAddress::Any, tcpPort);
     lmctrace((isRunning ? "Success" : "Failed"));
+	if(isRunning)
+		SocketProfile::applyListen(SC_Message, server);
+	idleTimer->start(TN_IDLECHECK);
+	statsTimer.start();
 }
 
 void lmcTcpNetwork::stop(void) {
+	//	connections closed from here on are reported lost without a grace period
+	isRunning = false;
+	idleTimer->stop();
+	reconnectTimer->stop();
+	yieldTimer->stop();
 	server->close();
 	// Close all open sockets
 	if(locMsgStream)
 		locMsgStream->stop();
-	QMap<QString, MsgStream*>::const_iterator index = messageMap.constBegin();
-	while(index != messageMap.constEnd()) {
-		MsgStream* pMsgStream = index.value();
-		if(pMsgStream)
-			pMsgStream->stop();
-		index++;
+	//	a closed stream reports the lost connection at once, which removes it from the map
+	QList<MsgStream*> streams = messageMap.values();
+	for(int index = 0; index < streams.count(); index++) {
+		if(streams[index])
+			streams[index]->stop();
+	}
+	//	key operations still running are of no use any more
+	if(cryptoPool)
+		cryptoPool->waitForDone();
+
+	QStringList lostUsers = lostPeers.keys() + yieldingPeers.keys();
+	for(int index = 0; index < lostUsers.count(); index++) {
+		dropPeer(lostUsers[index]);
+		emit connectionLost(&lostUsers[index]);
 	}
-	isRunning = false;
 }
 
 void lmcTcpNetwork::setLocalId(QString* lpszLocalId) {
 	localId = *lpszLocalId;
 }
 
+//	The public key operations of handshakes run on a pool of their own
 void lmcTcpNetwork::setCrypto(lmcCrypto* pCrypto) {
 	crypto = pCrypto;
+	cryptoPool = new CryptoPool(crypto, this);
+	cryptoPool->setMaxThreads(cryptoThreads);
+	connect(cryptoPool, SIGNAL(keySealed(const QString&, quint32, const QByteArray&, const QByteArray&)),
+		this, SLOT(crypto_keySealed(const QString&, quint32, const QByteArray&, const QByteArray&)));
+	connect(cryptoPool, SIGNAL(keyOpened(const QString&, quint32, const QByteArray&)),
+		this, SLOT(crypto_keyOpened(const QString&, quint32, const QByteArray&)));
 }
 
-void lmcTcpNetwork::addConnection(QString* lpszUserId, QString* lpszAddress) {
+//	Keeps the address and public key of a user without connecting, in on demand
+//	mode the connection is opened by the first message to the user
+void lmcTcpNetwork::addPeer(QString* lpszUserId, QString* lpszAddress, QString* lpszPublicKey) {
+	if(lpszPublicKey && lpszPublicKey->startsWith(TN_PUBLICKEYPEM))
+		peerKeys.insert(*lpszUserId, lpszPublicKey->toLatin1());
+	peerAddresses.insert(*lpszUserId, *lpszAddress);
+}
+
+//	A user that announced its public key gets the session key with the connection
+void lmcTcpNetwork::addConnection(QString* lpszUserId, QString* lpszAddress, QString* lpszPublicKey) {
+	if(lpszPublicKey && lpszPublicKey->startsWith(TN_PUBLICKEYPEM))
+		peerKeys.insert(*lpszUserId, lpszPublicKey->toLatin1());
+
+	//	a user announced again while the handshake is still waiting is not connected twice
+	if(connectingPeers.contains(*lpszUserId) && getMsgStream(lpszUserId))
+		return;
+	//	nor while its own connection is awaited after both connected at once
+	if(yieldingPeers.contains(*lpszUserId))
+		return;
+
     lmctrace("Connecting to user " + *lpszUserId + " at " + *lpszAddress);
 
+	peerAddresses.insert(*lpszUserId, *lpszAddress);
+	connectingPeers.insert(*lpszUserId);
+	dialedPeers.insert(*lpszUserId);
+	if(onDemand)
+		limitStreams(maxConnections - 1);
+
 	MsgStream* msgStream = new MsgStream(localId, *lpszUserId, *lpszAddress, tcpPort);
+	configureStream(msgStream);
 	connect(msgStream, SIGNAL(connectionLost(QString*)), 
 		this, SLOT(msgStream_connectionLost(QString*)));
+	connect(msgStream, SIGNAL(sendQueueFull(QString*, bool)),
+		this, SIGNAL(sendQueueFull(QString*, bool)));
 	connect(msgStream, SIGNAL(messageReceived(QString*, QString*, QByteArray&)),
 		this, SLOT(receiveMessage(QString*, QString*, QByteArray&)));
 	
@@ -116,65 +211,123 @@ void lmcTcpNetwork::addConnection(QString* lpszUserId, QString* lpszAddress) {
 		locMsgStream = msgStream;
 	else
 		messageMap.insert(*lpszUserId, msgStream);
-	msgStream->init();
+	requestHandshake(lpszUserId, true);
 }
 
-void lmcTcpNetwork::sendMessage(QString* lpszReceiverId, QString* lpszData) {
-	MsgStream* msgStream;
+//	Returns false if the message could not be queued on the connection
+bool lmcTcpNetwork::sendMessage(QString* lpszReceiverId, QByteArray& clearData, MsgPriority priority) {
+	MsgStream* msgStream = getMsgStream(lpszReceiverId);
 
-	if(lpszReceiverId->compare(localId) == 0)
-		msgStream = locMsgStream;
-	else
-		msgStream = messageMap.value(*lpszReceiverId, NULL);
+	//	messages to a user whose connection is being restored wait for it, in order
+	if(!msgStream && (lostPeers.contains(*lpszReceiverId) || yieldingPeers.contains(*lpszReceiverId)))
+		return holdMessage(lpszReceiverId, clearData, priority);
+
+	//	in on demand mode the connection is opened by the first message to the user,
+	//	messages wait until the session key has been exchanged
+	if(!msgStream && onDemand && peerAddresses.contains(*lpszReceiverId)) {
+		QString address = peerAddresses.value(*lpszReceiverId);
+		addConnection(lpszReceiverId, &address);
+		msgStream = getMsgStream(lpszReceiverId);
+	}
+	if(msgStream && connectingPeers.contains(*lpszReceiverId) && !keySharedPeers.contains(*lpszReceiverId))
+		return holdMessage(lpszReceiverId, clearData, priority);
 
 	if(msgStream) {
         lmctrace("Sending TCP data stream to user " + *lpszReceiverId);
-		QByteArray clearData = lpszData->toUtf8();
-		QByteArray cipherData = crypto->encrypt(lpszReceiverId, clearData);
-		if(cipherData.isEmpty()) {
-            lmctrace("Warning: Message could not be sent");
-			return;
+		DatagramType type = DT_Message;
+		QByteArray payload = clearData;
+		//	compress only for peers that can read it, and only when it actually saves bytes
+		if(compression && compressPeers.contains(*lpszReceiverId) && clearData.size() >= compressThreshold) {
+			QByteArray compressed = qCompress(clearData);
+			if(compressed.size() < clearData.size()) {
+				type = DT_Compressed;
+				payload = compressed;
+			}
 		}
-		//	cipherData should now contain encrypted content
-          addHeader(DT_Message, cipherData);
-		msgStream->sendMessage(cipherData);
-		return;
+		return sendFrame(msgStream, lpszReceiverId, type, payload, priority, clearData);
 	}
 
     lmctrace("Warning: Socket not found. Message sending failed");
+	return false;
+}
+
+//	Compression is negotiated by the messaging layer once the version of the peer is known
+void lmcTcpNetwork::setCompression(QString* lpszUserId, bool enable) {
+	if(enable)
+		compressPeers.insert(*lpszUserId);
+	else
+		compressPeers.remove(*lpszUserId);
+}
+
+//	Peers that understand an idle close keep the user when the connection is closed
+//	for being idle, only connections to these peers are closed in on demand mode
+void lmcTcpNetwork::setIdleClose(QString* lpszUserId, bool enable) {
+	if(enable)
+		idlePeers.insert(*lpszUserId);
+	else
+		idlePeers.remove(*lpszUserId);
+}
+
+//	A peer that reads the id of a message socket up to MS_IDEND is sent the end of
+//	the id, so that it need not wait for the socket to go quiet
+void lmcTcpNetwork::setFramedIds(QString* lpszUserId, bool enable) {
+	if(enable)
+		framedIdPeers.insert(*lpszUserId);
+	else
+		framedIdPeers.remove(*lpszUserId);
+}
+
+//	A peer that settles a connection made by both sides at once the same way as
+//	this instance has one of the two closed. Older peers take any closed
+//	connection for the user leaving, both connections are left open with them.
+void lmcTcpNetwork::setTieBreak(QString* lpszUserId, bool enable) {
+	if(enable)
+		tieBreakPeers.insert(*lpszUserId);
+	else
+		tieBreakPeers.remove(*lpszUserId);
+}
+
+//	Like compression, file streaming is enabled once the version of the peer is known
+void lmcTcpNetwork::setFileStreaming(QString* lpszUserId, bool enable) {
+	if(enable)
+		streamPeers.insert(*lpszUserId);
+	else
+		streamPeers.remove(*lpszUserId);
 }
 
 void lmcTcpNetwork::initSendFile(QString* lpszReceiverId, QString* lpszAddress, QString* lpszData)
 {
 	XmlMessage xmlMessage(*lpszData);
-    int type = indexOf(FileTypeNames, FT_Max, xmlMessage.data(XN_FILETYPE));
+    int type = nameIndex<FileType>(xmlMessage.data(XN_FILETYPE));
 
 	FileSender* sender = new FileSender(xmlMessage.data(XN_FILEID), *lpszReceiverId, xmlMessage.data(XN_FILEPATH), 
 		xmlMessage.data(XN_FILENAME), xmlMessage.data(XN_FILESIZE).toLongLong(), *lpszAddress, tcpPort, (FileType)type);
 	connect(sender, SIGNAL(progressUpdated(FileMode, FileOp, FileType, QString*, QString*, QString*)),
 		this, SLOT(update(FileMode, FileOp, FileType, QString*, QString*, QString*)));
+	connect(sender, SIGNAL(streamDataReady(QString*, quint32, StreamOp, const QByteArray&)),
+		this, SLOT(stream_dataReady(QString*, quint32, StreamOp, const QByteArray&)));
 	sendList.prepend(sender);
 }
 
 void lmcTcpNetwork::initReceiveFile(QString* lpszSenderId, QString* lpszAddress, QString* lpszData)
 {
 	XmlMessage xmlMessage(*lpszData);
-    int type =  indexOf(FileTypeNames, FT_Max, xmlMessage.data(XN_FILETYPE));
+    int type =  nameIndex<FileType>(xmlMessage.data(XN_FILETYPE));
 
 	FileReceiver* receiver = new FileReceiver(xmlMessage.data(XN_FILEID), *lpszSenderId, xmlMessage.data(XN_FILEPATH), 
 		xmlMessage.data(XN_FILENAME), xmlMessage.data(XN_FILESIZE).toLongLong(), *lpszAddress, tcpPort, (FileType)type);
 	connect(receiver, SIGNAL(progressUpdated(FileMode, FileOp, FileType, QString*, QString*, QString*)),
 		this, SLOT(update(FileMode, FileOp, FileType, QString*, QString*, QString*)));
+	connect(receiver, SIGNAL(streamDataReady(QString*, quint32, StreamOp, const QByteArray&)),
+		this, SLOT(stream_dataReady(QString*, quint32, StreamOp, const QByteArray&)));
 	receiveList.prepend(receiver);
 }
 
 void lmcTcpNetwork::fileOperation(FileMode mode, QString* lpszUserId, QString* lpszData)
 {
-    Q_UNUSED(lpszUserId);
-
 	XmlMessage xmlMessage(*lpszData);
 
-    int fileOp =  indexOf(FileOpNames, FO_Max, xmlMessage.data(XN_FILEOP));
+    int fileOp =  nameIndex<FileOp>(xmlMessage.data(XN_FILEOP));
 	QString id = xmlMessage.data(XN_FILEID);
 
 	if(mode == FM_Send) {
@@ -188,7 +341,12 @@ void lmcTcpNetwork::fileOperation(FileMode mode, QString* lpszUserId, QString* l
 			sender->stop();
 			break;
 		case FO_Accept:
-			sender->init();
+			//	small files and avatars go on the message stream of peers that can take them,
+			//	larger files get a socket of their own so they do not hold up messages
+			if(streamPeers.contains(*lpszUserId) && sender->size() <= fileStreamLimit && getMsgStream(lpszUserId))
+				sender->initStream(nextStreamId++);
+			else
+				sender->init();
 			break;
 		}
 	} else {
@@ -206,6 +364,44 @@ void lmcTcpNetwork::fileOperation(FileMode mode, QString* lpszUserId, QString* l
 }
 
 void lmcTcpNetwork::settingsChanged(void) {
+	compression = pSettings->value(IDS_COMPRESSION, IDS_COMPRESSION_VAL).toBool();
+	compressThreshold = pSettings->value(IDS_COMPRESSTHRESHOLD, IDS_COMPRESSTHRESHOLD_VAL).toInt();
+	sendQueueLimit = pSettings->value(IDS_SENDQUEUELIMIT, IDS_SENDQUEUELIMIT_VAL).toLongLong();
+	coalesceDelay = pSettings->value(IDS_COALESCEDELAY, IDS_COALESCEDELAY_VAL).toInt();
+	maxFrameSize = pSettings->value(IDS_MAXFRAMESIZE, IDS_MAXFRAMESIZE_VAL).toLongLong();
+	receiveBuffer = pSettings->value(IDS_RECEIVEBUFFER, IDS_RECEIVEBUFFER_VAL).toLongLong();
+	MsgStream::setReceiveBudget(pSettings->value(IDS_RECEIVEBUDGET, IDS_RECEIVEBUDGET_VAL).toLongLong());
+	fileStreamLimit = pSettings->value(IDS_FILESTREAMLIMIT, IDS_FILESTREAMLIMIT_VAL).toLongLong();
+	onDemand = pSettings->value(IDS_CONNECTONDEMAND, IDS_CONNECTONDEMAND_VAL).toBool();
+	idleTimeout = pSettings->value(IDS_IDLETIMEOUT, IDS_IDLETIMEOUT_VAL).toInt() * 1000;
+	maxConnections = pSettings->value(IDS_MAXCONNECTIONS, IDS_MAXCONNECTIONS_VAL).toInt();
+	maxHandshakes = pSettings->value(IDS_MAXHANDSHAKES, IDS_MAXHANDSHAKES_VAL).toInt();
+	cryptoThreads = pSettings->value(IDS_CRYPTOTHREADS, IDS_CRYPTOTHREADS_VAL).toInt();
+	if(cryptoPool)
+		cryptoPool->setMaxThreads(cryptoThreads);
+	reconnectGrace = pSettings->value(IDS_RECONNECTGRACE, IDS_RECONNECTGRACE_VAL).toInt() * 1000;
+	SocketProfile::load(pSettings);
+	admitHandshakes();
+
+	if(locMsgStream)
+		configureStream(locMsgStream);
+	QMap<QString, MsgStream*>::const_iterator index = messageMap.constBegin();
+	while(index != messageMap.constEnd()) {
+		if(index.value())
+			configureStream(index.value());
+		index++;
+	}
+	dumpSocketOptions();
+}
+
+//	Traces the options in effect on every message connection
+void lmcTcpNetwork::dumpSocketOptions(void) {
+	QMap<QString, MsgStream*>::const_iterator index = messageMap.constBegin();
+	while(index != messageMap.constEnd()) {
+		if(index.value())
+			lmctrace("Message socket of user " + index.key() + ": " + index.value()->socketOptions());
+		index++;
+	}
 }
 
 void lmcTcpNetwork::setIPAddress(const QString& szAddress) {
@@ -215,27 +411,161 @@ void lmcTcpNetwork::setIPAddress(const QString& szAddress) {
 void lmcTcpNetwork::server_newConnection(void) {
     lmctrace("New connection received");
 	QTcpSocket* socket = server->nextPendingConnection();
+	//	nothing beyond the id is taken in until the socket is known
+	socket->setReadBufferSize(TN_PREAMBLEMAX);
+	pendingSockets.insert(socket, QByteArray());
+
+	QTimer* timer = new QTimer(socket);
+	timer->setSingleShot(true);
+	timer->setInterval(TN_PREAMBLEWAIT);
+	connect(timer, SIGNAL(timeout()), this, SLOT(preamble_timeout()));
+
 	connect(socket, SIGNAL(readyRead()), this, SLOT(socket_readyRead()));
+	connect(socket, SIGNAL(disconnected()), this, SLOT(socket_disconnected()));
 }
 
+//	The id sent by a new socket may arrive in pieces, it is gathered until it is
+//	complete and split off exactly where it ends, whatever follows is left in the
+//	socket. A file id has a fixed length. A message socket ends its id with
+//	MS_IDEND. Only older message sockets send their id without an end, they send
+//	nothing after it until they get an answer, so it is complete once it goes quiet.
 void lmcTcpNetwork::socket_readyRead(void) {
 	QTcpSocket* socket = (QTcpSocket*)sender();
-	disconnect(socket, SIGNAL(readyRead()), this, SLOT(socket_readyRead()));
+	QByteArray& preamble = pendingSockets[socket];
+	QByteArray peeked = socket->peek(TN_PREAMBLEMAX - preamble.length());
+	int length = peeked.length();
+	int idEnd = peeked.indexOf(MS_IDEND);
+	if(idEnd >= 0)
+		length = idEnd + 1;
+	bool file = (preamble + peeked.left(4)).startsWith("FILE");
+	if(file)
+		length = qMin(length, TN_FILEPREAMBLE - preamble.length());
+	preamble.append(socket->read(length));
+
+	if((idEnd >= 0 && !file) || preamble.length() >= TN_PREAMBLEMAX || (file && preamble.length() >= TN_FILEPREAMBLE)) {
+		acceptSocket(socket);
+		return;
+	}
+
+	QTimer* timer = socket->findChild<QTimer*>();
+	if(timer && !file)
+		timer->start();
+}
+
+void lmcTcpNetwork::socket_disconnected(void) {
+	QTcpSocket* socket = (QTcpSocket*)sender();
+	pendingSockets.remove(socket);
+	socket->deleteLater();
+}
 
-	QByteArray buffer = socket->read(64);
-	if(buffer.startsWith("MSG")) {
+void lmcTcpNetwork::preamble_timeout(void) {
+	QTcpSocket* socket = (QTcpSocket*)sender()->parent();
+	if(pendingSockets.contains(socket))
+		acceptSocket(socket);
+}
+
+//	Hands a socket whose id is complete to the message stream or file receiver it belongs to
+void lmcTcpNetwork::acceptSocket(QTcpSocket* pSocket) {
+	disconnect(pSocket, SIGNAL(readyRead()), this, SLOT(socket_readyRead()));
+	disconnect(pSocket, SIGNAL(disconnected()), this, SLOT(socket_disconnected()));
+	QTimer* timer = pSocket->findChild<QTimer*>();
+	if(timer) {
+		timer->stop();
+		timer->deleteLater();
+	}
+
+	QByteArray buffer = pendingSockets.take(pSocket);
+	//	file data is written out as it arrives, a message stream sets its own limit
+	pSocket->setReadBufferSize(0);
+	if(buffer.startsWith("MSE") && buffer.endsWith(MS_IDEND)) {
+		//	the session key and the first messages follow the id
+		QString userId(buffer.mid(3, buffer.length() - 4));
+		addMsgSocket(&userId, pSocket, true);
+	} else if(buffer.startsWith("MSG")) {
 		//	read user id from socket and assign socket to correct message stream
+		if(buffer.endsWith(MS_IDEND))
+			buffer.chop(1);
 		QString userId(buffer.mid(3)); // 3 is length of "MSG"
-		addMsgSocket(&userId, socket);
+		addMsgSocket(&userId, pSocket);
 	} else if(buffer.startsWith("FILE")) {
 		//	read transfer id from socket and assign socket to correct file receiver
 		QString id(buffer.mid(4)); // 4 is length of "FILE"
-		addFileSocket(&id, socket);
+		addFileSocket(&id, pSocket);
 	}
 }
 
 void lmcTcpNetwork::msgStream_connectionLost(QString* lpszUserId) {
-	emit connectionLost(lpszUserId);
+	//	a stream replaced by a newer connection from the same user is only cleaned up
+	MsgStream* msgStream = (MsgStream*)sender();
+	if(msgStream == locMsgStream)
+		locMsgStream = NULL;
+	else if(messageMap.value(*lpszUserId, NULL) == msgStream)
+		messageMap.remove(*lpszUserId);
+	else {
+		msgStream->deleteLater();
+		return;
+	}
+	msgStream->deleteLater();
+
+	QString userId = *lpszUserId;
+	bool established = !connectingPeers.contains(userId);
+	connectingPeers.remove(userId);
+	keySharedPeers.remove(userId);
+	cancelKeyJobs(userId);
+	finishHandshake(userId);
+
+	//	when both sides connect at once, the user with the lower id closes the
+	//	connection made from here and keeps its own, which is waited for. An
+	//	older user closes neither, its connection is not waited for.
+	if(!established && isRunning && userId.compare(localId) != 0 && dialedPeers.contains(userId)
+			&& tieBreakPeers.contains(userId) && !lostPeers.contains(userId) && !winsTie(userId)) {
+        lmctrace("Connection to user " + userId + " closed while connecting, waiting for the user to connect");
+		QElapsedTimer waiting;
+		waiting.start();
+		yieldingPeers.insert(userId, waiting);
+		if(!yieldTimer->isActive())
+			yieldTimer->start(TN_RECONNECTCHECK);
+		return;
+	}
+
+	failStreamedTransfers(userId);
+
+	//	a connection that was up, or a failed attempt to restore one, gets the rest
+	//	of the grace period before the user is reported gone. A peer that sent an
+	//	invalid frame is not connected again.
+	if(!msgStream->isRejected() && (lostPeers.contains(userId) || (established && canReconnect(userId)))) {
+		holdUnsentMessages(userId, msgStream);
+		beginReconnect(userId);
+		return;
+	}
+
+	dropPeer(userId);
+	emit connectionLost(&userId);
+}
+
+//	Sends a frame of a streamed file transfer. If the frame cannot be queued
+//	the transfer is given up, a chunk missing in the middle cannot be made up for.
+void lmcTcpNetwork::stream_dataReady(QString* lpszUserId, quint32 nStreamId, StreamOp op, const QByteArray& data) {
+	QByteArray clearData;
+	clearData.reserve(FS_STREAMHEADER + data.length());
+	clearData.resize(FS_STREAMHEADER);
+	clearData[0] = (char)op;
+	qToBigEndian<quint32>(nStreamId, (uchar*)clearData.data() + 1);
+	clearData.append(data);
+
+	//	credit is what keeps the sender going, file data is bulk
+	MsgPriority priority = (op == SO_Credit) ? MP_Control : MP_Bulk;
+	MsgStream* msgStream = getMsgStream(lpszUserId);
+	if(msgStream && sendFrame(msgStream, lpszUserId, DT_Stream, clearData, priority))
+		return;
+
+    lmctrace("Warning: File stream " + QString::number(nStreamId) + " to user " + *lpszUserId + " could not be sent");
+	FileSender* sender = qobject_cast<FileSender*>(this->sender());
+	if(sender)
+		sender->streamLost();
+	FileReceiver* receiver = qobject_cast<FileReceiver*>(this->sender());
+	if(receiver)
+		receiver->streamLost();
 }
 
 void lmcTcpNetwork::update(FileMode mode, FileOp op, FileType type, QString* lpszId, QString* lpszUserId, QString* lpszData) {
@@ -267,6 +597,13 @@ void lmcTcpNetwork::receiveMessage( QString* lpszUserId,
                                     QString* lpszAddress,
                                     QByteArray& datagram )
 {
+	//	frames that follow a session key being read can only be decrypted with it,
+	//	a key waiting for admission is not read yet
+	if(openJobs.contains(*lpszUserId) || queuedKeyShares.contains(*lpszUserId)) {
+		holdFrame(lpszUserId, datagram);
+		return;
+	}
+
 	DatagramHeader* pHeader = NULL;
     if( !   getHeader(datagram, &pHeader) )
 		return;
@@ -275,7 +612,6 @@ void lmcTcpNetwork::receiveMessage( QString* lpszUserId,
 	pHeader->address = *lpszAddress;
     QByteArray cipherData =   getData( datagram );
     QByteArray clearData;
-	QString szMessage;
 
     lmctrace( "TCP stream type " + QString::number(pHeader->type) + " received from user " + *lpszUserId + " at " + *lpszAddress );
 
@@ -283,14 +619,34 @@ void lmcTcpNetwork::receiveMessage( QString* lpszUserId,
     {
 
 	case DT_PublicKey:
-		//	send a session key back
+		//	the session key sent with the connection could not be read, it is
+		//	replaced by one for the public key the peer has now
+		if(keySharedPeers.remove(*lpszUserId)) {
+            lmctrace("Session key shared with user " + *lpszUserId + " was refused, exchanging keys");
+			crypto->removeKeys(lpszUserId);
+		}
+		//	send a session key back, messages wait until it has gone out
 		sendSessionKey(lpszUserId, cipherData);
 		break;
 
 	case DT_Handshake:
 		// decrypt aes key and iv with private key
-		crypto->retreiveAES(&pHeader->userId, cipherData);
-		emit newConnection(&pHeader->userId, &pHeader->address);
+		openKey(pHeader->userId, cipherData, false);
+		break;
+
+	case DT_KeyShare:
+		//	the answer of the peer to the key shared with the connection
+		if(keySharedPeers.remove(*lpszUserId)) {
+			sendHeldMessages(lpszUserId);
+			break;
+		}
+		receiveKeyShare(lpszUserId, cipherData);
+		break;
+
+	case DT_Idle:
+		//	the peer closes the connection for being idle, the user has not left
+        lmctrace("Connection closed by user " + *lpszUserId + " for being idle");
+		releaseStream(*lpszUserId);
 		break;
 
 	case DT_Message:
@@ -301,13 +657,35 @@ void lmcTcpNetwork::receiveMessage( QString* lpszUserId,
             lmctrace("Warning: Message could not be retrieved");
 			break;
 		}
-		szMessage = QString::fromUtf8(clearData.data(), clearData.length());
-		emit messageReceived(pHeader, &szMessage);
+		emit messageReceived(MsgEnvelope(pHeader, clearData));
+		break;
+
+	case DT_Compressed:
+        clearData = uncompressMessage(lpszUserId, crypto->decrypt(&pHeader->userId, cipherData));
+        if(clearData.isEmpty())
+        {
+            lmctrace("Warning: Compressed message could not be retrieved");
+			break;
+		}
+		emit messageReceived(MsgEnvelope(pHeader, clearData));
+		break;
+
+	case DT_Stream:
+		//	file data is written out before the next frame comes in, so one
+		//	buffer serves all of it
+		if(!crypto->decrypt(&pHeader->userId, cipherData, streamBuffer) || streamBuffer.length() < FS_STREAMHEADER)
+		{
+            lmctrace("Warning: File stream data could not be retrieved");
+			break;
+		}
+		receiveStreamData(&pHeader->userId, streamBuffer);
 		break;
 
     default:
         break;
 	}
+
+	MsgPool<DatagramHeader>::release(pHeader);
 }
 
 void lmcTcpNetwork::addFileSocket(QString* lpszId, QTcpSocket* pSocket) {
@@ -316,18 +694,124 @@ void lmcTcpNetwork::addFileSocket(QString* lpszId, QTcpSocket* pSocket) {
 		receiver->init(pSocket);
 }
 
-void lmcTcpNetwork::addMsgSocket(QString* lpszUserId, QTcpSocket* pSocket) {
+//	Only one connection is kept per user. When both sides connect at once, the one
+//	made by the user with the lower id is kept, unless that side has not started
+//	connecting yet. With an older user both are left open and the new one is used,
+//	as that user would report the local user gone if either was closed. A
+//	connection from a user who is already connected replaces the old one, the user
+//	has connected again.
+void lmcTcpNetwork::addMsgSocket(QString* lpszUserId, QTcpSocket* pSocket, bool bEager) {
+	if(lpszUserId->compare(localId) != 0 && messageMap.contains(*lpszUserId)) {
+		bool retire = true;
+		if(connectingPeers.contains(*lpszUserId) && dialedPeers.contains(*lpszUserId)) {
+			duplicateConnections++;
+			if(!tieBreakPeers.contains(*lpszUserId)) {
+                lmctrace("Connection from user " + *lpszUserId + " kept next to the connection to the user, " +
+					QString::number(duplicateConnections) + " duplicate connections so far");
+				retire = false;
+			} else if(winsTie(*lpszUserId) && handshakes.contains(*lpszUserId)) {
+                lmctrace("Connection from user " + *lpszUserId + " closed, the connection to the user is kept, " +
+					QString::number(duplicateConnections) + " duplicate connections so far");
+				pSocket->abort();
+				pSocket->deleteLater();
+				return;
+			} else
+                lmctrace("Connection to user " + *lpszUserId + " closed, the connection from the user is kept, " +
+					QString::number(duplicateConnections) + " duplicate connections so far");
+		} else
+			failStreamedTransfers(*lpszUserId);
+		//	the stream left open is cleaned up when it closes, as one replaced
+		if(retire)
+			retireStream(*lpszUserId);
+		else
+			messageMap.remove(*lpszUserId);
+	}
+	yieldingPeers.remove(*lpszUserId);
+
     lmctrace("Accepted connection from user " + *lpszUserId);
 	QString address = pSocket->peerAddress().toString();
+	peerAddresses.insert(*lpszUserId, address);
+	connectingPeers.insert(*lpszUserId);
+	dialedPeers.remove(*lpszUserId);
+	if(onDemand)
+		limitStreams(maxConnections - 1);
 	MsgStream* msgStream = new MsgStream(localId, *lpszUserId, address, tcpPort);
+	configureStream(msgStream);
 	connect(msgStream, SIGNAL(connectionLost(QString*)), 
 		this, SLOT(msgStream_connectionLost(QString*)));
+	connect(msgStream, SIGNAL(sendQueueFull(QString*, bool)),
+		this, SIGNAL(sendQueueFull(QString*, bool)));
 	connect(msgStream, SIGNAL(messageReceived(QString*, QString*, QByteArray&)),
 		this, SLOT(receiveMessage(QString*, QString*, QByteArray&)));
 	messageMap.insert(*lpszUserId, msgStream);
 	msgStream->init(pSocket);
 
-	sendPublicKey(lpszUserId);
+	//	the client waits for the public key, so it is held back until the handshake is
+	//	admitted. An eager client has sent the session key already, its frames are held
+	//	until then.
+	requestHandshake(lpszUserId, false, bEager);
+}
+
+//	The size the data claims to unpack to is checked before anything is allocated
+//	for it, a small frame could otherwise make the receiver allocate gigabytes.
+//	The same limit applies as to a frame that was sent as it is.
+QByteArray lmcTcpNetwork::uncompressMessage(QString* lpszUserId, const QByteArray& compressed) {
+	if(compressed.length() < 4)
+		return QByteArray();
+
+	quint32 clearSize = qFromBigEndian<quint32>((const uchar*)compressed.constData());
+	if(clearSize > maxFrameSize) {
+        lmctrace("Warning: Compressed message from user " + *lpszUserId + " would unpack to " +
+			QString::number(clearSize) + " bytes, over the limit of " + QString::number(maxFrameSize) + " bytes");
+		return QByteArray();
+	}
+
+	QByteArray clearData = qUncompress(compressed);
+	//	the prefix is only a hint to zlib, what came out is what counts
+	if(clearData.length() != (int)clearSize) {
+        lmctrace("Warning: Compressed message from user " + *lpszUserId + " unpacked to " +
+			QString::number(clearData.length()) + " bytes instead of " + QString::number(clearSize));
+		return QByteArray();
+	}
+	return clearData;
+}
+
+//	Dispatches a frame of a streamed file transfer. Data for a stream goes to
+//	its receiver, credit goes back to the sender of the stream.
+void lmcTcpNetwork::receiveStreamData(QString* lpszUserId, const QByteArray& clearData) {
+	StreamOp op = (StreamOp)clearData.at(0);
+	quint32 streamId = qFromBigEndian<quint32>((const uchar*)clearData.constData() + 1);
+	QByteArray data = QByteArray::fromRawData(clearData.constData() + FS_STREAMHEADER, clearData.length() - FS_STREAMHEADER);
+	FileSender* sender = NULL;
+	FileReceiver* receiver = NULL;
+
+	switch(op) {
+	case SO_Open:
+		receiver = getReceiver(QString::fromLatin1(data.constData(), data.length()));
+		if(!receiver || !receiver->initStream(lpszUserId, streamId))
+            lmctrace("Warning: File stream " + QString::number(streamId) + " from user " + *lpszUserId + " not expected");
+		break;
+	case SO_Data:
+		receiver = getStreamReceiver(*lpszUserId, streamId);
+		if(receiver)
+			receiver->receiveChunk(data);
+		break;
+	case SO_Credit:
+		sender = getStreamSender(*lpszUserId, streamId);
+		if(sender && data.length() >= 4)
+			sender->addCredit(qFromBigEndian<quint32>((const uchar*)data.constData()));
+		break;
+	default:
+		break;
+	}
+}
+
+//	Applies the connection settings to a message stream
+void lmcTcpNetwork::configureStream(MsgStream* pMsgStream) {
+	pMsgStream->setQueueLimit(sendQueueLimit);
+	pMsgStream->setCoalesceDelay(coalesceDelay);
+	pMsgStream->setReceiveLimits(maxFrameSize, receiveBuffer);
+	pMsgStream->applySocketProfile();
 }
 
 //	Once a new incoming connection is established, the server sends a public key to client
@@ -357,12 +841,610 @@ void lmcTcpNetwork::sendSessionKey(QString* lpszUserId, QByteArray& publicKey)
 
 	if(msgStream) {
         lmctrace("Sending session key to user " + *lpszUserId);
-		QByteArray sessionKey = crypto->generateAES(lpszUserId, publicKey);
-          addHeader(DT_Handshake, sessionKey);
-		msgStream->sendMessage(sessionKey);
+		sealKey(*lpszUserId, publicKey, false);
 	}
 }
 
+//	The public key of the user is known from its announcement, so the session key
+//	goes out with the connection and messages can follow it straight away. The
+//	key is encrypted while the connection is being made.
+void lmcTcpNetwork::shareKey(const QString& szUserId, MsgStream* pMsgStream) {
+    lmctrace("Sharing session key with user " + szUserId + " on connecting");
+	pMsgStream->init(true);
+	sealKey(szUserId, peerKeys.value(szUserId), true);
+}
+
+//	The session key came with the connection, it is answered once it has been read
+void lmcTcpNetwork::receiveKeyShare(QString* lpszUserId, QByteArray& keyShare) {
+	MsgStream* msgStream = messageMap.value(*lpszUserId, NULL);
+	if(!msgStream || !connectingPeers.contains(*lpszUserId))
+		return;
+
+	openKey(*lpszUserId, keyShare, true);
+}
+
+//	Encrypts a new session key for the user on the crypto pool. Messages to the
+//	user are held until it has gone out.
+void lmcTcpNetwork::sealKey(const QString& szUserId, const QByteArray& publicKey, bool bShared) {
+	KeyJob job(nextKeyJob++, bShared);
+	sealJobs.insert(szUserId, job);
+	cryptoPool->seal(szUserId, job.id, publicKey, crypto->newSessionKey(lmcCrypto::modeFor(publicKey)));
+}
+
+//	Reads the session key sent by the user on the crypto pool. Frames from the
+//	user are held until it is known.
+void lmcTcpNetwork::openKey(const QString& szUserId, const QByteArray& sealedKey, bool bShared) {
+	KeyJob job(nextKeyJob++, bShared);
+	openJobs.insert(szUserId, job);
+	cryptoPool->open(szUserId, job.id, sealedKey);
+}
+
+//	The session key for the user is encrypted. A key shared with the connection
+//	that could not be encrypted still goes out empty, the user answers it with
+//	its public key and the full exchange takes over.
+void lmcTcpNetwork::crypto_keySealed(const QString& szUserId, quint32 nJobId, const QByteArray& keyIv, const QByteArray& sealedKey) {
+	//	the connection the key was for is gone
+	if(sealJobs.value(szUserId).id != nJobId)
+		return;
+
+	KeyJob job = sealJobs.take(szUserId);
+	QString userId = szUserId;
+	MsgStream* msgStream = getMsgStream(&userId);
+	if(!msgStream)
+		return;
+
+	bool sealed = !sealedKey.isEmpty();
+	if(sealed)
+		crypto->setSessionKey(&userId, keyIv, true);
+	else
+        lmctrace("Warning: Session key for user " + userId + " could not be encrypted");
+
+	if(job.shared) {
+		if(sealed)
+			keySharedPeers.insert(userId);
+		QByteArray keyShare = sealedKey;
+		addHeader(DT_KeyShare, keyShare);
+		msgStream->sendMessage(keyShare);
+		flushHeldMessages(&userId);
+		//	the local user details are asked for here, they travel in the same flight
+		QString address = peerAddresses.value(userId);
+		emit newConnection(&userId, &address);
+		return;
+	}
+
+	//	without a session key the handshake is left to time out
+	if(!sealed)
+		return;
+
+	QByteArray sessionKey = sealedKey;
+	addHeader(DT_Handshake, sessionKey);
+	msgStream->sendMessage(sessionKey);
+	sendHeldMessages(&userId);
+}
+
+//	The session key sent by the user has been read, frames that came after it are
+//	taken in now. A key shared with the connection is confirmed to the client, the
+//	user details it sent after the key are answered by the messaging layer. A key
+//	made for an earlier public key of this instance cannot be read, the full
+//	exchange takes over then.
+void lmcTcpNetwork::crypto_keyOpened(const QString& szUserId, quint32 nJobId, const QByteArray& keyIv) {
+	//	the connection the key came with is gone
+	if(openJobs.value(szUserId).id != nJobId)
+		return;
+
+	KeyJob job = openJobs.take(szUserId);
+	QString userId = szUserId;
+	QString address = peerAddresses.value(userId);
+
+	if(job.shared) {
+		MsgStream* msgStream = messageMap.value(userId, NULL);
+		if(!msgStream || !connectingPeers.contains(userId)) {
+			waitingFrames.remove(userId);
+			return;
+		}
+
+		if(keyIv.isEmpty()) {
+            lmctrace("Warning: Session key shared by user " + userId + " could not be read, exchanging keys, " +
+				QString::number(waitingFrames.value(userId).count()) + " frames dropped");
+			waitingFrames.remove(userId);
+			sendPublicKey(&userId);
+			return;
+		}
+
+        lmctrace("Session key shared by user " + userId + " accepted");
+		crypto->setSessionKey(&userId, keyIv, false);
+		if(userId.compare(localId) == 0)
+			crypto->setLoopback(&userId);
+		QByteArray reply;
+		addHeader(DT_KeyShare, reply);
+		msgStream->sendMessage(reply);
+		sendHeldMessages(&userId);
+	} else {
+		if(keyIv.isEmpty())
+            lmctrace("Warning: Session key from user " + userId + " could not be read");
+		else {
+			crypto->setSessionKey(&userId, keyIv, false);
+			//	both connections to the own machine read with this one session
+			if(userId.compare(localId) == 0)
+				crypto->setLoopback(&userId);
+		}
+		sendHeldMessages(&userId);
+		emit newConnection(&userId, &address);
+	}
+
+	receiveHeldFrames(&userId);
+}
+
+//	A result still being worked out for a connection that is closed is dropped
+//	when it comes back
+void lmcTcpNetwork::cancelKeyJobs(const QString& szUserId) {
+	sealJobs.remove(szUserId);
+	openJobs.remove(szUserId);
+	queuedKeyShares.remove(szUserId);
+	waitingFrames.remove(szUserId);
+}
+
+//	Frames held for a session key count against the receive buffer of the connection.
+//	A frame that does not fit cannot be dropped without the user knowing, the
+//	connection is closed instead and the user sees its messages fail.
+void lmcTcpNetwork::holdFrame(QString* lpszUserId, const QByteArray& datagram) {
+	QList<QByteArray>& frames = waitingFrames[*lpszUserId];
+	qint64 frameBytes = datagram.length();
+	for(int index = 0; index < frames.count(); index++)
+		frameBytes += frames[index].length();
+	if(frameBytes > receiveBuffer) {
+        lmctrace("Error: Frames from user " + *lpszUserId + " waiting for the session key are over the limit of " +
+			QString::number(receiveBuffer) + " bytes, closing connection. " + QString::number(frames.count()) + " frames dropped");
+		waitingFrames.remove(*lpszUserId);
+		MsgStream* msgStream = messageMap.value(*lpszUserId, NULL);
+		if(msgStream)
+			msgStream->stop();
+		return;
+	}
+
+	//	the frame refers to the receive buffer of the stream, it is kept as a copy
+	frames.append(QByteArray(datagram.constData(), datagram.length()));
+}
+
+//	Messages whose frames had not been handed to the socket in full when the
+//	connection was lost go out again once it is restored, ahead of those sent
+//	since. They are sent again from the clear data kept with their frames, and
+//	encrypted with the new session key. Control frames belong to the lost
+//	connection, and file data fails with its transfer.
+void lmcTcpNetwork::holdUnsentMessages(const QString& szUserId, MsgStream* pMsgStream) {
+	QList<QueuedFrame> frames = pMsgStream->takeUnsent();
+	if(frames.isEmpty())
+		return;
+
+	QList<HeldMessage> unsent;
+	for(int index = 0; index < frames.count(); index++)
+		unsent.append(HeldMessage(frames[index].message, frames[index].priority));
+
+    lmctrace(QString::number(unsent.count()) + " messages queued to user " + szUserId +
+		" are held until the connection is restored");
+	unsent.append(heldMessages.take(szUserId));
+	heldMessages.insert(szUserId, unsent);
+}
+
+void lmcTcpNetwork::receiveHeldFrames(QString* lpszUserId) {
+	QList<QByteArray> frames = waitingFrames.take(*lpszUserId);
+	QString address = peerAddresses.value(*lpszUserId);
+	for(int index = 0; index < frames.count(); index++)
+		receiveMessage(lpszUserId, &address, frames[index]);
+}
+
+MsgStream* lmcTcpNetwork::getMsgStream(QString* lpszUserId) {
+	if(lpszUserId->compare(localId) == 0)
+		return locMsgStream;
+
+	return messageMap.value(*lpszUserId, NULL);
+}
+
+//	Held messages count against the same limit as the send queue of a connection
+bool lmcTcpNetwork::holdMessage(QString* lpszReceiverId, QByteArray& clearData, MsgPriority priority) {
+	QList<HeldMessage>& held = heldMessages[*lpszReceiverId];
+	qint64 heldBytes = clearData.length();
+	for(int index = 0; index < held.count(); index++)
+		heldBytes += held[index].data.length();
+	if(heldBytes > sendQueueLimit) {
+        lmctrace("Warning: Messages held for user " + *lpszReceiverId + " are over the limit, " +
+			QString::number(held.count()) + " messages waiting");
+		return false;
+	}
+
+	held.append(HeldMessage(clearData, priority));
+	return true;
+}
+
+//	The session key with the user is known from here on
+void lmcTcpNetwork::sendHeldMessages(QString* lpszUserId) {
+	connectingPeers.remove(*lpszUserId);
+	recordHandshake(*lpszUserId);
+	finishHandshake(*lpszUserId);
+
+	if(lostPeers.contains(*lpszUserId)) {
+		LostPeer peer = lostPeers.take(*lpszUserId);
+        lmctrace("Connection to user " + *lpszUserId + " restored after " + QString::number(peer.lost.elapsed()) +
+			" ms, " + QString::number(heldMessages.value(*lpszUserId).count()) + " messages waiting");
+		if(lostPeers.isEmpty())
+			reconnectTimer->stop();
+		emit connectionSuspended(lpszUserId, false);
+	}
+
+	flushHeldMessages(lpszUserId);
+}
+
+void lmcTcpNetwork::flushHeldMessages(QString* lpszUserId) {
+	QList<HeldMessage> held = heldMessages.take(*lpszUserId);
+	for(int index = 0; index < held.count(); index++)
+		sendMessage(lpszUserId, held[index].data, held[index].priority);
+}
+
+void lmcTcpNetwork::idleTimer_timeout(void) {
+	checkHandshakes();
+	traceHandshakeStats();
+
+	if(!onDemand)
+		return;
+
+	QStringList idleUsers;
+	QMap<QString, MsgStream*>::const_iterator index = messageMap.constBegin();
+	while(index != messageMap.constEnd()) {
+		if(index.value()->idleTime() > idleTimeout && canCloseIdle(index.key()))
+			idleUsers.append(index.key());
+		index++;
+	}
+
+	for(int i = 0; i < idleUsers.count(); i++)
+		closeIdleStream(idleUsers[i]);
+}
+
+//	Tells the peer that the connection is closed for being idle, then closes it
+void lmcTcpNetwork::closeIdleStream(QString szUserId) {
+    lmctrace("Closing idle connection to user " + szUserId);
+	MsgStream* msgStream = messageMap.value(szUserId, NULL);
+	if(!msgStream)
+		return;
+
+	QByteArray data;
+	addHeader(DT_Idle, data);
+	msgStream->sendMessage(data);
+	releaseStream(szUserId);
+}
+
+//	Closes the connection without reporting it as lost, the user stays online
+//	and is connected again when there is something to send. The session key is
+//	dropped with the connection and a new one is exchanged then.
+void lmcTcpNetwork::releaseStream(QString szUserId) {
+	MsgStream* msgStream = messageMap.take(szUserId);
+	if(!msgStream)
+		return;
+
+	disconnect(msgStream, 0, this, 0);
+	msgStream->close();
+	crypto->removeKeys(&szUserId);
+	connectingPeers.remove(szUserId);
+	keySharedPeers.remove(szUserId);
+	cancelKeyJobs(szUserId);
+}
+
+//	A connection can be closed when the peer will not take it as the user leaving,
+//	and when nothing is waiting to be sent or being transferred on it
+bool lmcTcpNetwork::canCloseIdle(const QString& szUserId) {
+	MsgStream* msgStream = messageMap.value(szUserId, NULL);
+	if(!msgStream || !idlePeers.contains(szUserId) || connectingPeers.contains(szUserId) || msgStream->queueDepth() > 0)
+		return false;
+
+	for(int index = 0; index < sendList.count(); index++)
+		if(sendList[index]->isStreamed(szUserId))
+			return false;
+	for(int index = 0; index < receiveList.count(); index++)
+		if(receiveList[index]->isStreamed(szUserId))
+			return false;
+
+	return true;
+}
+
+//	Handshakes are admitted a few at a time, so that the public key operations and
+//	user details of many users connecting at once do not all land together. The
+//	others wait their turn in the order they came in.
+void lmcTcpNetwork::requestHandshake(QString* lpszUserId, bool bOutgoing, bool bEager) {
+	if(handshakes.count() < maxHandshakes) {
+		startHandshake(*lpszUserId, bOutgoing, bEager);
+		return;
+	}
+
+	if(bEager)
+		queuedKeyShares.insert(*lpszUserId);
+	handshakeQueue.enqueue(PendingHandshake(*lpszUserId, bOutgoing, bEager));
+    lmctrace("Handshake with user " + *lpszUserId + " queued, " + QString::number(handshakeQueue.count()) + " waiting");
+}
+
+//	An outgoing handshake starts by connecting, an incoming one by sending the public key.
+//	An eager one starts by reading the session key the client sent with the connection.
+void lmcTcpNetwork::startHandshake(const QString& szUserId, bool bOutgoing, bool bEager) {
+	QString userId = szUserId;
+	MsgStream* msgStream = bOutgoing ? getMsgStream(&userId) : messageMap.value(userId, NULL);
+	if(!msgStream)
+		return;
+
+	QElapsedTimer started;
+	started.start();
+	handshakes.insert(userId, started);
+
+	if(bEager) {
+		queuedKeyShares.remove(userId);
+		receiveHeldFrames(&userId);
+	} else if(bOutgoing && peerKeys.contains(userId))
+		shareKey(userId, msgStream);
+	else if(bOutgoing)
+		msgStream->init(false, framedIdPeers.contains(userId));
+	else
+		sendPublicKey(&userId);
+}
+
+//	Keeps the time the handshake with the user took, once the session key is known
+void lmcTcpNetwork::recordHandshake(const QString& szUserId) {
+	if(!handshakes.contains(szUserId))
+		return;
+
+	qint64 elapsed = handshakes.value(szUserId).elapsed();
+	if(handshakeTimes.count() < TN_HANDSHAKESAMPLES)
+		handshakeTimes.append(elapsed);
+	else
+		handshakeTimes[completedHandshakes % TN_HANDSHAKESAMPLES] = elapsed;
+	completedHandshakes++;
+}
+
+//	Traces the handshake rate and times since the last report, when any completed
+void lmcTcpNetwork::traceHandshakeStats(void) {
+	if(completedHandshakes == 0) {
+		statsTimer.restart();
+		return;
+	}
+
+	qint64 interval = qMax<qint64>(1, statsTimer.restart());
+	QList<qint64> times = handshakeTimes;
+	std::sort(times.begin(), times.end());
+	//	nearest rank percentiles
+	int count = times.count();
+	qint64 median = times[(count * 50 + 99) / 100 - 1];
+	qint64 p99 = times[(count * 99 + 99) / 100 - 1];
+    lmctrace("Handshakes: " + QString::number(completedHandshakes) + " completed at " +
+		QString::number(completedHandshakes * 1000.0 / interval, 'f', 1) + " per second, " +
+		QString::number(median) + " ms median, " + QString::number(p99) + " ms at the 99th percentile, " +
+		QString::number(cryptoPool ? cryptoPool->pendingJobs() : 0) + " key operations pending");
+
+	handshakeTimes.clear();
+	completedHandshakes = 0;
+}
+
+//	The session key has been exchanged or the connection is gone, the slot is free
+void lmcTcpNetwork::finishHandshake(const QString& szUserId) {
+	if(handshakes.remove(szUserId) > 0)
+		admitHandshakes();
+}
+
+void lmcTcpNetwork::admitHandshakes(void) {
+	while(handshakes.count() < maxHandshakes && !handshakeQueue.isEmpty()) {
+		PendingHandshake pending = handshakeQueue.dequeue();
+		//	the connection may have been lost while waiting
+		if(!connectingPeers.contains(pending.userId)) {
+			queuedKeyShares.remove(pending.userId);
+			continue;
+		}
+
+		qint64 wait = pending.queued.elapsed();
+		queuedHandshakes++;
+		totalHandshakeWait += wait;
+		maxHandshakeWait = qMax(maxHandshakeWait, wait);
+		startHandshake(pending.userId, pending.outgoing, pending.eager);
+	}
+
+	if(handshakeQueue.isEmpty() && queuedHandshakes > 0) {
+        lmctrace("Handshake queue cleared: " + QString::number(queuedHandshakes) + " handshakes waited " +
+			QString::number(totalHandshakeWait / queuedHandshakes) + " ms on average, " +
+			QString::number(maxHandshakeWait) + " ms at most");
+		queuedHandshakes = 0;
+		totalHandshakeWait = 0;
+		maxHandshakeWait = 0;
+	}
+}
+
+//	A handshake that has not completed in time is given up, a peer that went away
+//	while connecting would otherwise hold its slot for good
+void lmcTcpNetwork::checkHandshakes(void) {
+	QStringList expired;
+	QMap<QString, QElapsedTimer>::const_iterator index = handshakes.constBegin();
+	while(index != handshakes.constEnd()) {
+		if(index.value().elapsed() > TN_HANDSHAKETIMEOUT)
+			expired.append(index.key());
+		index++;
+	}
+
+	for(int i = 0; i < expired.count(); i++) {
+        lmctrace("Warning: Handshake with user " + expired[i] + " timed out");
+		//	a connection being restored is tried again, its messages keep waiting
+		if(!lostPeers.contains(expired[i]))
+			heldMessages.remove(expired[i]);
+		releaseStream(expired[i]);
+		finishHandshake(expired[i]);
+	}
+}
+
+//	Only connections to other machines are restored, and only while running
+bool lmcTcpNetwork::canReconnect(const QString& szUserId) {
+	return isRunning && reconnectGrace > 0 && szUserId.compare(localId) != 0 && peerAddresses.contains(szUserId);
+}
+
+//	The side that made the connection makes it again, the other side waits for it.
+//	Attempts start after TN_RECONNECTMIN ms and back off up to TN_RECONNECTMAX ms.
+void lmcTcpNetwork::beginReconnect(const QString& szUserId) {
+	if(lostPeers.contains(szUserId)) {
+        lmctrace("Warning: Attempt to restore connection to user " + szUserId + " failed");
+		return;
+	}
+
+	LostPeer peer;
+	peer.lost.start();
+	peer.lastAttempt.start();
+	peer.dialer = dialedPeers.contains(szUserId);
+	lostPeers.insert(szUserId, peer);
+    lmctrace("Connection to user " + szUserId + " lost, " + (peer.dialer ? "reconnecting" : "waiting for user to reconnect"));
+	QString userId = szUserId;
+	emit connectionSuspended(&userId, true);
+
+	if(!reconnectTimer->isActive())
+		reconnectTimer->start(TN_RECONNECTCHECK);
+}
+
+void lmcTcpNetwork::reconnectTimer_timeout(void) {
+	QStringList expired;
+	QStringList due;
+	QMap<QString, LostPeer>::const_iterator index = lostPeers.constBegin();
+	while(index != lostPeers.constEnd()) {
+		if(index.value().lost.elapsed() > reconnectGrace)
+			expired.append(index.key());
+		else if(index.value().dialer && !messageMap.contains(index.key()) && index.value().lastAttempt.elapsed() >= index.value().delay)
+			due.append(index.key());
+		index++;
+	}
+
+	for(int i = 0; i < expired.count(); i++)
+		giveUpReconnect(expired[i]);
+
+	for(int i = 0; i < due.count(); i++) {
+		LostPeer& peer = lostPeers[due[i]];
+		peer.attempts++;
+		peer.lastAttempt.restart();
+		peer.delay = qMin(peer.delay * 2, TN_RECONNECTMAX);
+        lmctrace("Restoring connection to user " + due[i] + ", attempt " + QString::number(peer.attempts));
+		QString address = peerAddresses.value(due[i]);
+		addConnection(&due[i], &address);
+	}
+
+	if(lostPeers.isEmpty())
+		reconnectTimer->stop();
+}
+
+//	The grace period is over, the user is reported gone and its messages are dropped
+void lmcTcpNetwork::giveUpReconnect(const QString& szUserId) {
+	QString userId = szUserId;
+    lmctrace("Warning: Connection to user " + userId + " could not be restored within " +
+		QString::number(reconnectGrace / 1000) + " seconds");
+	if(messageMap.contains(userId)) {
+		releaseStream(userId);
+		finishHandshake(userId);
+	}
+	dropPeer(userId);
+	emit connectionLost(&userId);
+}
+
+void lmcTcpNetwork::yieldTimer_timeout(void) {
+	QStringList expired;
+	QMap<QString, QElapsedTimer>::const_iterator index = yieldingPeers.constBegin();
+	while(index != yieldingPeers.constEnd()) {
+		if(index.value().elapsed() > TN_YIELDWAIT)
+			expired.append(index.key());
+		index++;
+	}
+
+	for(int i = 0; i < expired.count(); i++) {
+        lmctrace("Warning: User " + expired[i] + " did not connect within " + QString::number(TN_YIELDWAIT) + " ms");
+		dropPeer(expired[i]);
+		emit connectionLost(&expired[i]);
+	}
+
+	if(yieldingPeers.isEmpty())
+		yieldTimer->stop();
+}
+
+//	Forgets everything known about the connection to a user who is gone
+void lmcTcpNetwork::dropPeer(const QString& szUserId) {
+	yieldingPeers.remove(szUserId);
+	peerKeys.remove(szUserId);
+	compressPeers.remove(szUserId);
+	streamPeers.remove(szUserId);
+	idlePeers.remove(szUserId);
+	framedIdPeers.remove(szUserId);
+	tieBreakPeers.remove(szUserId);
+	heldMessages.remove(szUserId);
+	lostPeers.remove(szUserId);
+	dialedPeers.remove(szUserId);
+}
+
+//	The connection made by the user with the lower id is the one kept
+bool lmcTcpNetwork::winsTie(const QString& szUserId) {
+	return (localId.compare(szUserId) < 0);
+}
+
+//	Closes the connection to a user that another connection takes the place of.
+//	It is not reported lost, its handshake is given up.
+void lmcTcpNetwork::retireStream(const QString& szUserId) {
+	MsgStream* msgStream = messageMap.take(szUserId);
+	if(!msgStream)
+		return;
+
+	disconnect(msgStream, 0, this, 0);
+	msgStream->close();
+	keySharedPeers.remove(szUserId);
+	cancelKeyJobs(szUserId);
+	cancelHandshake(szUserId);
+}
+
+void lmcTcpNetwork::cancelHandshake(const QString& szUserId) {
+	for(int index = handshakeQueue.count() - 1; index >= 0; index--)
+		if(handshakeQueue[index].userId == szUserId)
+			handshakeQueue.removeAt(index);
+	finishHandshake(szUserId);
+}
+
+//	Transfers carried on a lost stream fail with it, a new connection cannot resume them
+void lmcTcpNetwork::failStreamedTransfers(const QString& szUserId) {
+	for(int index = 0; index < sendList.count(); index++)
+		if(sendList[index]->isStreamed(szUserId))
+			sendList[index]->streamLost();
+	for(int index = 0; index < receiveList.count(); index++)
+		if(receiveList[index]->isStreamed(szUserId))
+			receiveList[index]->streamLost();
+}
+
+//	Closes the least recently used connections until no more than nMaxStreams are open
+void lmcTcpNetwork::limitStreams(int nMaxStreams) {
+	while(messageMap.count() > nMaxStreams) {
+		QString lruUserId;
+		qint64 lruIdleTime = -1;
+		QMap<QString, MsgStream*>::const_iterator index = messageMap.constBegin();
+		while(index != messageMap.constEnd()) {
+			if(index.value()->idleTime() > lruIdleTime && canCloseIdle(index.key())) {
+				lruUserId = index.key();
+				lruIdleTime = index.value()->idleTime();
+			}
+			index++;
+		}
+
+		if(lruUserId.isNull())
+			return;
+		closeIdleStream(lruUserId);
+	}
+}
+
+//	The frame is laid out in one buffer, length and datagram type first,
+//	and the cipher text is written straight after them. The message is kept
+//	with the frame to be sent again if the connection is lost.
+bool lmcTcpNetwork::sendFrame(MsgStream* pMsgStream, QString* lpszReceiverId, DatagramType type, const QByteArray& payload,
+	MsgPriority priority, const QByteArray& message) {
+	QByteArray frame;
+	frame.reserve(MS_FRAMEHEADER + DT_TYPELENGTH + payload.length() + LC_MAXOVERHEAD);
+	frame.resize(MS_FRAMEHEADER);
+	frame.append(DatagramTypeNames[type].toLatin1());
+	if(!crypto->encrypt(lpszReceiverId, payload, frame)) {
+        lmctrace("Warning: Message could not be sent");
+		return false;
+	}
+	return pMsgStream->sendFrame(frame, priority, message);
+}
+
 FileSender* lmcTcpNetwork::getSender(QString id)
 {
 	for(int index = 0; index < sendList.count(); index++)
@@ -381,6 +1463,24 @@ FileReceiver* lmcTcpNetwork::getReceiver(QString id)
 	return NULL;
 }
 
+FileSender* lmcTcpNetwork::getStreamSender(const QString& szUserId, quint32 nStreamId)
+{
+	for(int index = 0; index < sendList.count(); index++)
+		if(sendList[index]->isStream(szUserId, nStreamId))
+			return sendList[index];
+
+	return NULL;
+}
+
+FileReceiver* lmcTcpNetwork::getStreamReceiver(const QString& szUserId, quint32 nStreamId)
+{
+	for(int index = 0; index < receiveList.count(); index++)
+		if(receiveList[index]->isStream(szUserId, nStreamId))
+			return receiveList[index];
+
+	return NULL;
+}
+
 
 void  lmcTcpNetwork::addHeader(DatagramType type, QByteArray& baData)
 {
@@ -391,36 +1491,32 @@ void  lmcTcpNetwork::addHeader(DatagramType type, QByteArray& baData)
 
 bool  lmcTcpNetwork::getHeader(QByteArray& baDatagram, DatagramHeader** ppHeader)
 {
-    QString datagramType(baDatagram.mid(0, 6));	// first 6 bytes represent datagram type
+    if(baDatagram.length() < DT_TYPELENGTH)
+        return false;
 
-    int type = indexOf(DatagramTypeNames, DT_Max, datagramType);
+    //	first 6 bytes represent datagram type
+    QString datagramType = QString::fromLatin1(baDatagram.constData(), DT_TYPELENGTH);
+
+    int type = nameIndex<DatagramType>(datagramType);
 
     if(type < 0)
         return false;
 
-    *ppHeader = new DatagramHeader( (DatagramType)type, QString(), QString()) ;
+    *ppHeader = MsgPool<DatagramHeader>::acquire();
+    (*ppHeader)->type = (DatagramType)type;
     return true;
 }
 
+//	The returned array refers to the datagram buffer instead of copying it,
+//	it must not outlive the datagram
 QByteArray  lmcTcpNetwork::getData( QByteArray& baDatagram )
 {
-    if ( baDatagram.length() > 6 )
-        return baDatagram.mid(6);
+    if ( baDatagram.length() > DT_TYPELENGTH )
+        return QByteArray::fromRawData(baDatagram.constData() + DT_TYPELENGTH, baDatagram.length() - DT_TYPELENGTH);
 
     return QByteArray();
 }
 
-int  lmcTcpNetwork::indexOf(const QString array[], int size, const QString& value)
-{
-    for(int index = 0; index < size; index++)
-    {
-        if(value == array[index])
-            return index;
-    }
-
-    return (-1);
-}
-
 
 
 
@@ -56,15 +56,82 @@
 #include <QTcpServer>
 #include <QMap>
 #include <QList>
+#include <QSet>
+#include <QtEndian>
+#include <QQueue>
+#include <QElapsedTimer>
 
 #include "trace.h"
 #include "crypto.h"
+#include "cryptopool.h"
 #include "settings.h"
 
 #include "xmlmessage.h"
 #include "datagram.h"
+#include "msgenvelope.h"
+#include "msgpool.h"
+#include "nametable.h"
 #include "netstreamer.h"
 
+#define TN_PREAMBLEMAX		64	// longest id a socket sends when it connects
+#define TN_FILEPREAMBLE		36	// "FILE" followed by a file id
+#define TN_PREAMBLEWAIT		100	// milliseconds of quiet after which the id of an older message socket is complete
+#define TN_IDLECHECK		5000	// milliseconds between checks for idle connections
+#define TN_HANDSHAKETIMEOUT	15000	// milliseconds a handshake may hold an admission slot
+#define TN_RECONNECTCHECK	250		// milliseconds between checks for lost connections to retry
+#define TN_RECONNECTMIN		500		// milliseconds before the first attempt to restore a connection
+#define TN_RECONNECTMAX		16000	// longest wait between attempts, the wait doubles after each one
+#define TN_PUBLICKEYPEM		"-----BEGIN RSA PUBLIC KEY-----"	// start of a public key as announced
+#define TN_YIELDWAIT		5000	// milliseconds to wait for the connection of a user that won a simultaneous connect
+#define TN_HANDSHAKESAMPLES	1024	// latest handshake times kept for the percentiles between two reports
+
+//	A handshake waiting for a free admission slot
+struct PendingHandshake
+{
+	QString userId;
+	bool outgoing;			// the connection is made from here, else it was accepted
+	bool eager;				// the session key came with the connection
+	QElapsedTimer queued;
+
+	PendingHandshake(void) : outgoing(false), eager(false) {}
+	PendingHandshake(const QString& szUserId, bool bOutgoing, bool bEager) : userId(szUserId), outgoing(bOutgoing), eager(bEager)
+	{
+		queued.start();
+	}
+};
+
+//	A message waiting for the session key, sent in its lane once it is exchanged
+struct HeldMessage
+{
+	QByteArray data;
+	MsgPriority priority;
+
+	HeldMessage(void) : priority(MP_Interactive) {}
+	HeldMessage(const QByteArray& clearData, MsgPriority msgPriority) : data(clearData), priority(msgPriority) {}
+};
+
+//	A public key operation of a handshake running on the crypto pool
+struct KeyJob
+{
+	quint32 id;
+	bool shared;			// the session key goes with the connection, else it answers the public key
+
+	KeyJob(void) : id(0), shared(false) {}
+	KeyJob(quint32 nId, bool bShared) : id(nId), shared(bShared) {}
+};
+
+//	A peer whose connection was lost, within its grace period
+struct LostPeer
+{
+	QElapsedTimer lost;
+	QElapsedTimer lastAttempt;
+	int delay;				// milliseconds from the last attempt to the next one
+	int attempts;
+	bool dialer;			// the connection is restored from here, else the peer connects back
+
+	LostPeer(void) : delay(TN_RECONNECTMIN), attempts(0), dialer(false) {}
+};
+
 class lmcTcpNetwork : public QObject
 {
 	Q_OBJECT
@@ -79,8 +146,14 @@ public:
 	void stop(void);
 	void setLocalId(QString* lpszLocalId);
 	void setCrypto(lmcCrypto* pCrypto);
-	void addConnection(QString* lpszUserId, QString* lpszAddress);
-	void sendMessage(QString* lpszReceiverId, QString* lpszData);
+	void addConnection(QString* lpszUserId, QString* lpszAddress, QString* lpszPublicKey = NULL);
+	void addPeer(QString* lpszUserId, QString* lpszAddress, QString* lpszPublicKey);
+	bool sendMessage(QString* lpszReceiverId, QByteArray& clearData, MsgPriority priority = MP_Interactive);
+	void setCompression(QString* lpszUserId, bool enable);
+	void setFileStreaming(QString* lpszUserId, bool enable);
+	void setIdleClose(QString* lpszUserId, bool enable);
+	void setFramedIds(QString* lpszUserId, bool enable);
+	void setTieBreak(QString* lpszUserId, bool enable);
 	void initSendFile(QString* lpszReceiverId, QString* lpszAddress, QString* lpszData);
 	void initReceiveFile(QString* lpszSenderId, QString* lpszAddress, QString* lpszData);
 	void fileOperation(FileMode mode, QString* lpszUserId, QString* lpszData);
@@ -90,33 +163,83 @@ public:
 signals:
 	void newConnection(QString* lpszUserId, QString* lpszAddress);
 	void connectionLost(QString* lpszUserId);
-	void messageReceived(DatagramHeader* pHeader, QString* lpszData);
+	void connectionSuspended(QString* lpszUserId, bool suspended);
+	void sendQueueFull(QString* lpszUserId, bool full);
+	void messageReceived(const MsgEnvelope& envelope);
 	void progressReceived(QString* lpszUserId, QString* lpszData);
 
 protected slots:
 	void server_newConnection(void);
 	void socket_readyRead(void);
+	void socket_disconnected(void);
+	void preamble_timeout(void);
+	void idleTimer_timeout(void);
+	void reconnectTimer_timeout(void);
+	void yieldTimer_timeout(void);
+	void crypto_keySealed(const QString& szUserId, quint32 nJobId, const QByteArray& keyIv, const QByteArray& sealedKey);
+	void crypto_keyOpened(const QString& szUserId, quint32 nJobId, const QByteArray& keyIv);
+	void stream_dataReady(QString* lpszUserId, quint32 nStreamId, StreamOp op, const QByteArray& data);
 	void msgStream_connectionLost(QString* lpszUserId);
 	void update(FileMode mode, FileOp op, FileType type, QString* lpszId, QString* lpszUserId, QString* lpszData);
 	void receiveMessage(QString* lpszUserId, QString* lpszAddress, QByteArray& data);
 
 protected:
+	void acceptSocket(QTcpSocket* pSocket);
 	void addFileSocket(QString* lpszId, QTcpSocket* pSocket);
-	void addMsgSocket(QString* lpszUserId, QTcpSocket* pSocket);
+	void addMsgSocket(QString* lpszUserId, QTcpSocket* pSocket, bool bEager = false);
+	void configureStream(MsgStream* pMsgStream);
+	void dumpSocketOptions(void);
+	MsgStream* getMsgStream(QString* lpszUserId);
+	bool holdMessage(QString* lpszReceiverId, QByteArray& clearData, MsgPriority priority);
+	void sendHeldMessages(QString* lpszUserId);
+	void flushHeldMessages(QString* lpszUserId);
+	void closeIdleStream(QString szUserId);
+	void releaseStream(QString szUserId);
+	bool canCloseIdle(const QString& szUserId);
+	void limitStreams(int nMaxStreams);
+	void requestHandshake(QString* lpszUserId, bool bOutgoing, bool bEager = false);
+	void startHandshake(const QString& szUserId, bool bOutgoing, bool bEager);
+	void finishHandshake(const QString& szUserId);
+	void admitHandshakes(void);
+	void checkHandshakes(void);
+	bool canReconnect(const QString& szUserId);
+	void beginReconnect(const QString& szUserId);
+	void giveUpReconnect(const QString& szUserId);
+	void dropPeer(const QString& szUserId);
+	bool winsTie(const QString& szUserId);
+	void retireStream(const QString& szUserId);
+	void cancelHandshake(const QString& szUserId);
+	void failStreamedTransfers(const QString& szUserId);
+	bool sendFrame(MsgStream* pMsgStream, QString* lpszReceiverId, DatagramType type, const QByteArray& payload,
+		MsgPriority priority, const QByteArray& message = QByteArray());
+	void receiveStreamData(QString* lpszUserId, const QByteArray& clearData);
+	QByteArray uncompressMessage(QString* lpszUserId, const QByteArray& compressed);
 	void sendPublicKey(QString* lpszUserId);
 	void sendSessionKey(QString* lpszUserId, QByteArray& publicKey);
+	void shareKey(const QString& szUserId, MsgStream* pMsgStream);
+	void receiveKeyShare(QString* lpszUserId, QByteArray& keyShare);
+	void sealKey(const QString& szUserId, const QByteArray& publicKey, bool bShared);
+	void openKey(const QString& szUserId, const QByteArray& sealedKey, bool bShared);
+	void cancelKeyJobs(const QString& szUserId);
+	void holdFrame(QString* lpszUserId, const QByteArray& datagram);
+	void receiveHeldFrames(QString* lpszUserId);
+	void holdUnsentMessages(const QString& szUserId, MsgStream* pMsgStream);
+	void recordHandshake(const QString& szUserId);
+	void traceHandshakeStats(void);
 	FileSender* getSender(QString id);
 	FileReceiver* getReceiver(QString id);
+	FileSender* getStreamSender(const QString& szUserId, quint32 nStreamId);
+	FileReceiver* getStreamReceiver(const QString& szUserId, quint32 nStreamId);
 
     void addHeader( DatagramType type, QByteArray& baData );
     bool getHeader( QByteArray& baDatagram, DatagramHeader** ppHeader );
     QByteArray getData( QByteArray& baDatagram );
-    int indexOf(const QString array[], int size, const QString& value);
 
 	QTcpServer*				  server;
 	QList<FileSender*>		  sendList;
 	QList<FileReceiver*>	  receiveList;
 	QMap<QString, MsgStream*> messageMap;
+	QMap<QTcpSocket*, QByteArray> pendingSockets;	// accepted sockets whose id is not complete yet
 	MsgStream*				  locMsgStream;
 	lmcSettings*			  pSettings;
 	bool					  isRunning;
@@ -124,6 +247,52 @@ protected:
 	QString					  localId;
 	lmcCrypto*				  crypto;
 	QHostAddress			  ipAddress;
+	QSet<QString>			  compressPeers;
+	bool					  compression;
+	int						  compressThreshold;
+	qint64					  sendQueueLimit;
+	qint64					  maxFrameSize;
+	qint64					  receiveBuffer;
+	int						  coalesceDelay;
+	QSet<QString>			  streamPeers;
+	qint64					  fileStreamLimit;
+	quint32					  nextStreamId;
+	QSet<QString>			  idlePeers;		// peers that understand an idle close
+	QSet<QString>			  framedIdPeers;	// peers that read the id of a message socket up to MS_IDEND
+	QSet<QString>			  tieBreakPeers;	// peers that keep one connection when both sides connect at once
+	QSet<QString>			  connectingPeers;	// session key not exchanged yet
+	QMap<QString, QString>	  peerAddresses;
+	QMap<QString, QList<HeldMessage> > heldMessages;	// sent once the session key is exchanged
+	QTimer*					  idleTimer;
+	bool					  onDemand;
+	int						  idleTimeout;
+	int						  maxConnections;
+	QMap<QString, QElapsedTimer> handshakes;		// handshakes in flight and when they started
+	QQueue<PendingHandshake>  handshakeQueue;
+	int						  maxHandshakes;
+	int						  queuedHandshakes;		// admitted after waiting, since the queue was last empty
+	qint64					  totalHandshakeWait;
+	qint64					  maxHandshakeWait;
+	QSet<QString>			  dialedPeers;		// connections made from here
+	QMap<QString, LostPeer>	  lostPeers;		// messages to these are held until the connection is restored
+	QTimer*					  reconnectTimer;
+	int						  reconnectGrace;
+	QMap<QString, QElapsedTimer> yieldingPeers;	// dialed at the same time as the user, waiting for its connection
+	QTimer*					  yieldTimer;
+	int						  duplicateConnections;	// closed because both sides connected at once
+	QMap<QString, QByteArray> peerKeys;			// public keys announced by users
+	QSet<QString>			  keySharedPeers;	// the session key went out with the connection, not confirmed yet
+	CryptoPool*				  cryptoPool;
+	int						  cryptoThreads;
+	quint32					  nextKeyJob;
+	QMap<QString, KeyJob>	  sealJobs;			// session keys being encrypted for users
+	QMap<QString, KeyJob>	  openJobs;			// session keys from users being read
+	QMap<QString, QList<QByteArray> > waitingFrames;	// received while the session key is being read
+	QSet<QString>			  queuedKeyShares;	// the session key came with the connection, waiting for admission
+	QList<qint64>			  handshakeTimes;	// milliseconds, since the last report
+	int						  completedHandshakes;
+	QElapsedTimer			  statsTimer;
+	QByteArray				  streamBuffer;		// clear text of the file stream frame being received
 
 };
 
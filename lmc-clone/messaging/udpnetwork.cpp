@@ -126,6 +126,12 @@ void lmcUdpNetwork::sendBroadcast(QString* lpszData) {
 	}
 }
 
+//	For an answer only one user needs, which is received like a broadcast
+void lmcUdpNetwork::sendUnicast(QString* lpszAddress, QString* lpszData) {
+	QByteArray datagram = lpszData->toUtf8();
+	sendDatagram(QHostAddress(*lpszAddress), datagram);
+}
+
 void lmcUdpNetwork::settingsChanged(void) {
 	QHostAddress address = QHostAddress(pSettings->value(IDS_MULTICAST, IDS_MULTICAST_VAL).toString());
 	if(multicastAddress != address) {
@@ -195,6 +201,8 @@ bool lmcUdpNetwork::startReceiving(void)
     }
 
     lmctrace("Success");
+    SocketProfile::apply(SC_Broadcast, pUdpReceiver);
+    lmctrace("Broadcast socket: " + SocketProfile::describe(pUdpReceiver));
     lmctrace("Joining multicast group " + multicastAddress.toString() +
         " on interface " + multicastInterface.humanReadableName());
 
@@ -210,9 +218,12 @@ bool lmcUdpNetwork::startReceiving(void)
 
 void lmcUdpNetwork::parseDatagram(QString* lpszAddress, QByteArray& baDatagram) {
     lmctrace("UDP datagram received from " + *lpszAddress);
-	DatagramHeader* pHeader = new DatagramHeader(DT_Broadcast, QString(), *lpszAddress);
+	DatagramHeader* pHeader = MsgPool<DatagramHeader>::acquire();
+	pHeader->type = DT_Broadcast;
+	pHeader->address = *lpszAddress;
 	QString szData = QString::fromUtf8(baDatagram.data(), baDatagram.length());
 	emit broadcastReceived(pHeader, &szData);
+	MsgPool<DatagramHeader>::release(pHeader);
 }
 
 void lmcUdpNetwork::setDefaultBroadcast(void) {
@@ -63,6 +63,8 @@
 #include "settings.h"
 
 #include "datagram.h"
+#include "msgpool.h"
+#include "socketprofile.h"
 
 class lmcUdpNetwork : public QObject
 {
@@ -79,6 +81,7 @@ public:
 	void setLocalId(QString* lpszLocalId);
 	void setCrypto(lmcCrypto* pCrypto);
 	void sendBroadcast(QString* lpszData);
+	void sendUnicast(QString* lpszAddress, QString* lpszData);
 	void settingsChanged(void);
 	void setMulticastInterface(const QNetworkInterface& networkInterface);
 	void setIPAddress(const QString& szAddress, const QString& szSubnet);
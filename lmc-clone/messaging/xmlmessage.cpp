@@ -12,12 +12,12 @@
     Everyone is permitted to copy and distribute verbatim copies of this license document, but changing it is not allowed.
     This version of the GNU Lesser General Public License incorporates the terms and conditions of version 3 of the GNU General Public License, supplemented by the additional permissions listed below.
      0. Additional Definitions.
-    As used herein, this License refers to version 3 of the GNU Lesser General Public License, and the GNU GPL refers to version 3 of the GNU General Public License.
-    The Library refers to a covered work governed by this License, other than an Application or a Combined Work as defined below.
-    An Application is any work that makes use of an interface provided by the Library, but which is not otherwise based on the Library. Defining a subclass of a class defined by the Library is deemed a mode of using an interface provided by the Library.
-    A Combined Work is a work produced by combining or linking an Application with the Library. The particular version of the Library with which the Combined Work was made is also called the Linked Version.
-    The Minimal Corresponding Source for a Combined Work means the Corresponding Source for the Combined Work, excluding any source code for portions of the Combined Work that, considered in isolation, are based on the Application, and not on the Linked Version.
-    The Corresponding Application Code for a Combined Work means the object code and/or source code for the Application, including any data and utility programs needed for reproducing the Combined Work from the Application, but excluding the System Libraries of the Combined Work.
+    As used herein, “this License” refers to version 3 of the GNU Lesser General Public License, and the “GNU GPL” refers to version 3 of the GNU General Public License.
+    “The Library” refers to a covered work governed by this License, other than an Application or a Combined Work as defined below.
+    An “Application” is any work that makes use of an interface provided by the Library, but which is not otherwise based on the Library. Defining a subclass of a class defined by the Library is deemed a mode of using an interface provided by the Library.
+    A “Combined Work” is a work produced by combining or linking an Application with the Library. The particular version of the Library with which the Combined Work was made is also called the “Linked Version”.
+    The “Minimal Corresponding Source” for a Combined Work means the Corresponding Source for the Combined Work, excluding any source code for portions of the Combined Work that, considered in isolation, are based on the Application, and not on the Linked Version.
+    The “Corresponding Application Code” for a Combined Work means the object code and/or source code for the Application, including any data and utility programs needed for reproducing the Combined Work from the Application, but excluding the System Libraries of the Combined Work.
      1. Exception to Section 3 of the GNU GPL.
     You may convey a covered work under sections 3 and 4 of this License without being bound by section 3 of the GNU GPL.
      2. Conveying Modified Versions.
@@ -43,31 +43,37 @@
     b) Give prominent notice with the combined library that part of it is a work based on the Library, and explaining where to find the accompanying uncombined form of the same work.
      6. Revised Versions of the GNU Lesser General Public License.
     The Free Software Foundation may publish revised and/or new versions of the GNU Lesser General Public License from time to time. Such new versions will be similar in spirit to the present version, but may differ in detail to address new problems or concerns.
-    Each version is given a distinguishing version number. If the Library as you received it specifies that a certain numbered version of the GNU Lesser General Public License or any later version applies to it, you have the option of following the terms and conditions either of that published version or of any later version published by the Free Software Foundation. If the Library as you received it does not specify a version number of the GNU Lesser General Public License, you may choose any version of the GNU Lesser General Public License ever published by the Free Software Foundation.
+    Each version is given a distinguishing version number. If the Library as you received it specifies that a certain numbered version of the GNU Lesser General Public License “or any later version” applies to it, you have the option of following the terms and conditions either of that published version or of any later version published by the Free Software Foundation. If the Library as you received it does not specify a version number of the GNU Lesser General Public License, you may choose any version of the GNU Lesser General Public License ever published by the Free Software Foundation.
     If the Library as you received it specifies that a proxy can decide whether future versions of the GNU Lesser General Public License shall apply, that proxy's public statement of acceptance of any version is permanent authorization for you to choose that version for the Library.
 */
 
 #include "xmlmessage.h"
+#include "nametable.h"
+
+#include <QXmlStreamWriter>
 
 //----------------------------------------------------------------------------
 
-XmlMessage::XmlMessage(void) : QDomDocument()
+XmlMessage::XmlMessage(void) : d(new XmlMessageData)
 {
-	QDomElement root = createElement(XN_ROOT);
-	appendChild(root);
-	
-	QDomElement head = createElement(XN_HEAD);
-	root.appendChild(head);
+}
+
+//----------------------------------------------------------------------------
 
-	QDomElement body = createElement(XN_BODY);
-	root.appendChild(body);
+XmlMessage::XmlMessage(const QString& text) : d(new XmlMessageData)
+{
+	QXmlStreamReader reader(text);
+	d->valid = parse(reader);
 }
 
 //----------------------------------------------------------------------------
 
-XmlMessage::XmlMessage(const QString& text) : QDomDocument()
+//	Parses utf-8 encoded xml text without converting the whole document
+//	to a string first
+XmlMessage::XmlMessage(const QByteArray& data) : d(new XmlMessageData)
 {
-	setContent(text);
+	QXmlStreamReader reader(data);
+	d->valid = parse(reader);
 }
 
 //----------------------------------------------------------------------------
@@ -80,174 +86,283 @@ XmlMessage::~XmlMessage(void)
 
 bool XmlMessage::addHeader(const QString& nodeName, const QString& nodeValue)
 {
-	return addXmlNode(XN_HEAD, nodeName, nodeValue);
+	return addXmlNode(XS_Head, nodeName, nodeValue);
 }
 
 //----------------------------------------------------------------------------
 
 bool XmlMessage::addData(const QString& nodeName, const QString& nodeValue)
 {
-	return addXmlNode(XN_BODY, nodeName, nodeValue);
+	return addXmlNode(XS_Body, nodeName, nodeValue);
 }
 
 //----------------------------------------------------------------------------
 
-QString XmlMessage::header(const QString& nodeName)
+QString XmlMessage::header(const QString& nodeName) const
 {
-	return getXmlNode(XN_HEAD, nodeName);
+	return getXmlNode(XS_Head, nodeName);
 }
 
 //----------------------------------------------------------------------------
 
-QString XmlMessage::data(const QString& nodeName)
+QString XmlMessage::data(const QString& nodeName) const
 {
-	return getXmlNode(XN_BODY, nodeName);
+	return getXmlNode(XS_Body, nodeName);
 }
 
 //----------------------------------------------------------------------------
 
 bool XmlMessage::removeHeader(const QString& nodeName)
 {
-	return removeXmlNode(XN_HEAD, nodeName);
+	return removeXmlNode(XS_Head, nodeName);
 }
 
 //----------------------------------------------------------------------------
 
 bool XmlMessage::removeData(const QString& nodeName)
 {
-	return removeXmlNode(XN_BODY, nodeName);
+	return removeXmlNode(XS_Body, nodeName);
 }
 
 //----------------------------------------------------------------------------
 
-bool XmlMessage::headerExists(const QString& nodeName)
+bool XmlMessage::headerExists(const QString& nodeName) const
 {
-	return xmlNodeExists(XN_HEAD, nodeName);
+	return xmlNodeExists(XS_Head, nodeName);
 }
 
 //----------------------------------------------------------------------------
 
-bool XmlMessage::dataExists(const QString& nodeName)
+bool XmlMessage::dataExists(const QString& nodeName) const
 {
-	return xmlNodeExists(XN_BODY, nodeName);
+	return xmlNodeExists(XS_Body, nodeName);
 }
 
 //----------------------------------------------------------------------------
 
-XmlMessage XmlMessage::clone(void)
+bool XmlMessage::isValid(void) const
 {
-	XmlMessage newMsg;
-	newMsg.setContent(toString());
-	return newMsg;
+	return d->valid;
 }
 
 //----------------------------------------------------------------------------
 
-bool XmlMessage::isValid(void)
+QString XmlMessage::toString(void) const
 {
-	QDomElement root = documentElement();
-	if(root.isNull())
-		return false;
+	if(!d->valid)
+		return QString::null;
+
+	QString text;
+	QXmlStreamWriter writer(&text);
+	writer.setAutoFormatting(true);
+	writer.setAutoFormattingIndent(1);
+
+	writer.writeStartElement(XN_ROOT);
 
-    if(root.tagName() == XN_ROOT)
-		return true;
-	
-	return false;
+	writer.writeStartElement(XN_HEAD);
+	for(int index = 0; index < d->fields[XS_Head].count(); index++)
+		writer.writeTextElement(d->fields[XS_Head][index].name, d->fields[XS_Head][index].value);
+	writer.writeEndElement();
+
+	writer.writeStartElement(XN_BODY);
+	for(int index = 0; index < d->fields[XS_Body].count(); index++)
+		writer.writeTextElement(d->fields[XS_Body][index].name, d->fields[XS_Body][index].value);
+	writer.writeEndElement();
+
+	writer.writeEndElement();
+	return text;
 }
 
 //----------------------------------------------------------------------------
 
-bool XmlMessage::addXmlNode(
-        const QString& parentNode,
-        const QString& nodeName,
-        const QString& nodeValue )
+qint64 XmlMessage::time(void) const
 {
-	QDomElement root = documentElement();
-	if(root.isNull())
-		return false;
+	return d->time;
+}
 
-	QDomNodeList nodes = root.elementsByTagName(parentNode);
-	if(nodes.isEmpty())
-		return false;
+//----------------------------------------------------------------------------
 
-	QDomElement parent = nodes.at(0).toElement();
-	QDomElement element = createElement(nodeName);
-	parent.appendChild(element);
-	QDomText elementText = createTextNode(nodeValue);
-	element.appendChild(elementText);
-	return true;
+void XmlMessage::setTime(qint64 msecs)
+{
+	d->time = msecs;
 }
 
 //----------------------------------------------------------------------------
 
-QString XmlMessage::getXmlNode(
-        const QString& parentNode,
-        const QString& nodeName )
+const ChatMessage& XmlMessage::chat(void) const
 {
-	QDomElement root = documentElement();
-	if(root.isNull())
-		return QString::null;
+	if(!d->chatValid) {
+		ChatMessage& chat = d->chat;
+		chat.thread = getXmlNode(XS_Body, XN_THREAD);
+		chat.message = getXmlNode(XS_Body, XN_MESSAGE);
+		chat.broadcast = getXmlNode(XS_Body, XN_BROADCAST);
+		chat.font = getXmlNode(XS_Body, XN_FONT);
+		chat.color = getXmlNode(XS_Body, XN_COLOR);
+		chat.chatState = getXmlNode(XS_Body, XN_CHATSTATE);
+		chat.groupMsgOp = (GroupMsgOp)nameIndex<GroupMsgOp>(getXmlNode(XS_Body, XN_GROUPMSGOP));
+		d->chatValid = true;
+	}
+	return d->chat;
+}
 
-	QDomNodeList nodes = root.elementsByTagName(parentNode);
-	if(nodes.isEmpty())
-		return QString::null;
+//----------------------------------------------------------------------------
 
-	QDomElement parent = nodes.at(0).toElement();
-	nodes = parent.elementsByTagName(nodeName);
-	if(nodes.isEmpty())
-		return QString::null;
+const FileMessage& XmlMessage::file(void) const
+{
+	if(!d->fileValid) {
+		FileMessage& file = d->file;
+		file.op = (FileOp)nameIndex<FileOp>(getXmlNode(XS_Body, XN_FILEOP));
+		file.mode = (FileMode)nameIndex<FileMode>(getXmlNode(XS_Body, XN_MODE));
+		file.type = (FileType)nameIndex<FileType>(getXmlNode(XS_Body, XN_FILETYPE));
+		file.id = getXmlNode(XS_Body, XN_FILEID);
+		file.path = getXmlNode(XS_Body, XN_FILEPATH);
+		file.name = getXmlNode(XS_Body, XN_FILENAME);
+		file.size = getXmlNode(XS_Body, XN_FILESIZE).toLongLong();
+		d->fileValid = true;
+	}
+	return d->file;
+}
 
-	QDomElement element = nodes.at(0).toElement();
-	return element.text();
+//----------------------------------------------------------------------------
+
+int XmlMessage::headerCount(void) const
+{
+	return d->fields[XS_Head].count();
 }
 
 //----------------------------------------------------------------------------
 
-bool XmlMessage::removeXmlNode(
-        const QString& parentNode,
-        const QString& nodeName )
+int XmlMessage::dataCount(void) const
 {
-	QDomElement root = documentElement();
-	if(root.isNull())
-		return false;
+	return d->fields[XS_Body].count();
+}
 
-	QDomNodeList nodes = root.elementsByTagName(parentNode);
-	if(nodes.isEmpty())
-		return false;
+//----------------------------------------------------------------------------
+
+QString XmlMessage::headerName(int index) const
+{
+	return d->fields[XS_Head].at(index).name;
+}
+
+//----------------------------------------------------------------------------
+
+QString XmlMessage::headerValue(int index) const
+{
+	return d->fields[XS_Head].at(index).value;
+}
+
+//----------------------------------------------------------------------------
+
+QString XmlMessage::dataName(int index) const
+{
+	return d->fields[XS_Body].at(index).name;
+}
 
-	QDomElement parent = nodes.at(0).toElement();
-	nodes = parent.elementsByTagName(nodeName);
-	if(nodes.isEmpty())
+//----------------------------------------------------------------------------
+
+QString XmlMessage::dataValue(int index) const
+{
+	return d->fields[XS_Body].at(index).value;
+}
+
+//----------------------------------------------------------------------------
+
+//	The message is read in a single pass. Only the first head and body
+//	sections of the root element are used, as with the earlier dom lookups.
+bool XmlMessage::parse(QXmlStreamReader& reader)
+{
+	if(!reader.readNextStartElement() || reader.name() != XN_ROOT)
 		return false;
 
-	QDomElement element = nodes.at(0).toElement();
-	QDomNode newNode = parent.removeChild(element);
-	if(newNode.isNull())
+	bool sectionRead[XS_Max] = { false, false };
+	while(reader.readNextStartElement()) {
+		if(reader.name() == XN_HEAD && !sectionRead[XS_Head]) {
+			parseSection(reader, XS_Head);
+			sectionRead[XS_Head] = true;
+		} else if(reader.name() == XN_BODY && !sectionRead[XS_Body]) {
+			parseSection(reader, XS_Body);
+			sectionRead[XS_Body] = true;
+		} else
+			reader.skipCurrentElement();
+	}
+
+	return !reader.hasError();
+}
+
+//----------------------------------------------------------------------------
+
+void XmlMessage::parseSection(QXmlStreamReader& reader, XmlSection section)
+{
+	while(reader.readNextStartElement()) {
+		QString name = reader.name().toString();
+		QString value = reader.readElementText(QXmlStreamReader::IncludeChildElements);
+		if(!d->fieldIndex[section].contains(name))
+			d->fieldIndex[section].insert(name, d->fields[section].count());
+		d->fields[section].append(XmlField(name, value));
+	}
+}
+
+//----------------------------------------------------------------------------
+
+bool XmlMessage::addXmlNode(
+        XmlSection section,
+        const QString& nodeName,
+        const QString& nodeValue )
+{
+	if(!d->valid)
 		return false;
 
+	d->chatValid = d->fileValid = false;
+	if(!d->fieldIndex[section].contains(nodeName))
+		d->fieldIndex[section].insert(nodeName, d->fields[section].count());
+	d->fields[section].append(XmlField(nodeName, nodeValue));
 	return true;
 }
 
 //----------------------------------------------------------------------------
 
-bool XmlMessage::xmlNodeExists(
-        const QString& parentNode,
+QString XmlMessage::getXmlNode(
+        XmlSection section,
+        const QString& nodeName ) const
+{
+	QHash<QString, int>::const_iterator it = d->fieldIndex[section].constFind(nodeName);
+	if(it == d->fieldIndex[section].constEnd())
+		return QString::null;
+
+	return d->fields[section].at(it.value()).value;
+}
+
+//----------------------------------------------------------------------------
+
+bool XmlMessage::removeXmlNode(
+        XmlSection section,
         const QString& nodeName )
 {
-	QDomElement root = documentElement();
-	if(root.isNull())
+	//	look up through the const pointer so that a miss does not detach
+	int position = d.constData()->fieldIndex[section].value(nodeName, -1);
+	if(position < 0)
 		return false;
 
-	QDomNodeList nodes = root.elementsByTagName(parentNode);
-	if(nodes.isEmpty())
-		return false;
+	d->fields[section].removeAt(position);
+	d->chatValid = d->fileValid = false;
 
-	QDomElement parent = nodes.at(0).toElement();
-	nodes = parent.elementsByTagName(nodeName);
-	if(nodes.isEmpty())
-		return false;
+	//	positions after the removed field have moved, rebuild the index
+	d->fieldIndex[section].clear();
+	for(int index = 0; index < d->fields[section].count(); index++) {
+		if(!d->fieldIndex[section].contains(d->fields[section][index].name))
+			d->fieldIndex[section].insert(d->fields[section][index].name, index);
+	}
 
 	return true;
 }
 
 //----------------------------------------------------------------------------
+
+bool XmlMessage::xmlNodeExists(
+        XmlSection section,
+        const QString& nodeName ) const
+{
+	return d->fieldIndex[section].contains(nodeName);
+}
+
+//----------------------------------------------------------------------------
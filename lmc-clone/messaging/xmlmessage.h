@@ -12,12 +12,12 @@
     Everyone is permitted to copy and distribute verbatim copies of this license document, but changing it is not allowed.
     This version of the GNU Lesser General Public License incorporates the terms and conditions of version 3 of the GNU General Public License, supplemented by the additional permissions listed below.
      0. Additional Definitions.
-    As used herein, this License refers to version 3 of the GNU Lesser General Public License, and the GNU GPL refers to version 3 of the GNU General Public License.
-    The Library refers to a covered work governed by this License, other than an Application or a Combined Work as defined below.
-    An Application is any work that makes use of an interface provided by the Library, but which is not otherwise based on the Library. Defining a subclass of a class defined by the Library is deemed a mode of using an interface provided by the Library.
-    A Combined Work is a work produced by combining or linking an Application with the Library. The particular version of the Library with which the Combined Work was made is also called the Linked Version.
-    The Minimal Corresponding Source for a Combined Work means the Corresponding Source for the Combined Work, excluding any source code for portions of the Combined Work that, considered in isolation, are based on the Application, and not on the Linked Version.
-    The Corresponding Application Code for a Combined Work means the object code and/or source code for the Application, including any data and utility programs needed for reproducing the Combined Work from the Application, but excluding the System Libraries of the Combined Work.
+    As used herein, “this License” refers to version 3 of the GNU Lesser General Public License, and the “GNU GPL” refers to version 3 of the GNU General Public License.
+    “The Library” refers to a covered work governed by this License, other than an Application or a Combined Work as defined below.
+    An “Application” is any work that makes use of an interface provided by the Library, but which is not otherwise based on the Library. Defining a subclass of a class defined by the Library is deemed a mode of using an interface provided by the Library.
+    A “Combined Work” is a work produced by combining or linking an Application with the Library. The particular version of the Library with which the Combined Work was made is also called the “Linked Version”.
+    The “Minimal Corresponding Source” for a Combined Work means the Corresponding Source for the Combined Work, excluding any source code for portions of the Combined Work that, considered in isolation, are based on the Application, and not on the Linked Version.
+    The “Corresponding Application Code” for a Combined Work means the object code and/or source code for the Application, including any data and utility programs needed for reproducing the Combined Work from the Application, but excluding the System Libraries of the Combined Work.
      1. Exception to Section 3 of the GNU GPL.
     You may convey a covered work under sections 3 and 4 of this License without being bound by section 3 of the GNU GPL.
      2. Conveying Modified Versions.
@@ -43,7 +43,7 @@
     b) Give prominent notice with the combined library that part of it is a work based on the Library, and explaining where to find the accompanying uncombined form of the same work.
      6. Revised Versions of the GNU Lesser General Public License.
     The Free Software Foundation may publish revised and/or new versions of the GNU Lesser General Public License from time to time. Such new versions will be similar in spirit to the present version, but may differ in detail to address new problems or concerns.
-    Each version is given a distinguishing version number. If the Library as you received it specifies that a certain numbered version of the GNU Lesser General Public License or any later version applies to it, you have the option of following the terms and conditions either of that published version or of any later version published by the Free Software Foundation. If the Library as you received it does not specify a version number of the GNU Lesser General Public License, you may choose any version of the GNU Lesser General Public License ever published by the Free Software Foundation.
+    Each version is given a distinguishing version number. If the Library as you received it specifies that a certain numbered version of the GNU Lesser General Public License “or any later version” applies to it, you have the option of following the terms and conditions either of that published version or of any later version published by the Free Software Foundation. If the Library as you received it does not specify a version number of the GNU Lesser General Public License, you may choose any version of the GNU Lesser General Public License ever published by the Free Software Foundation.
     If the Library as you received it specifies that a proxy can decide whether future versions of the GNU Lesser General Public License shall apply, that proxy's public statement of acceptance of any version is permanent authorization for you to choose that version for the Library.
 */
 
@@ -51,7 +51,15 @@
 #define XMLMESSAGE_H
 
 #include <QtGlobal>
-#include <QDomDocument>
+#include <QString>
+#include <QByteArray>
+#include <QList>
+#include <QHash>
+#include <QSharedData>
+#include <QSharedDataPointer>
+#include <QXmlStreamReader>
+
+#include "typedmessage.h"
 
 #define XN_ROOT				"lmcmessage"
 #define XN_HEAD				"head"
@@ -103,34 +111,93 @@
 #define XN_PORT				"port"
 #define XN_CONFIG			"config"
 
+//	Message sections
+enum XmlSection
+{
+	XS_Head = 0,
+	XS_Body,
+	XS_Max
+};
+
+struct XmlField
+{
+	QString name;
+	QString value;
+
+	XmlField(void) {}
+	XmlField(const QString& szName, const QString& szValue) : name(szName), value(szValue) {}
+};
+
+/**
+ * @brief The XmlMessageData class
+ * Field table shared between copies of an XmlMessage.
+ */
+class XmlMessageData : public QSharedData
+{
+public:
+	XmlMessageData(void) : valid(true), time(0), chatValid(false), fileValid(false) {}
+
+	bool					valid;
+	QList<XmlField>			fields[XS_Max];
+	QHash<QString, int>		fieldIndex[XS_Max];	// name to position of the first occurrence
+	qint64					time;	// local receive or send time, never put on the wire
+
+	//	typed views, decoded on first use and dropped when a field changes
+	mutable bool			chatValid;
+	mutable bool			fileValid;
+	mutable ChatMessage		chat;
+	mutable FileMessage		file;
+};
+
 /**
  * @brief The XmlMessage class
+ * Message fields are decoded once into a flat table per section (head and
+ * body) so that lookups do not need to walk a document tree.
+ * Copies are implicitly shared and only detach when one of them is modified,
+ * so a message can be passed around and stored by value cheaply.
  */
-class XmlMessage : public QDomDocument
+class XmlMessage
 {
 
 public:
 	XmlMessage(void);
 	XmlMessage(const QString& text);
+	XmlMessage(const QByteArray& data);
 	~XmlMessage(void);
 
 public:
 	bool addHeader(const QString& nodeName, const QString& nodeValue);
 	bool addData(const QString& nodeName, const QString& nodeValue);
-	QString header(const QString& nodeName);
-	QString data(const QString& nodeName);
+	QString header(const QString& nodeName) const;
+	QString data(const QString& nodeName) const;
 	bool removeHeader(const QString& nodeName);
 	bool removeData(const QString& nodeName);
-	bool headerExists(const QString& nodeName);
-	bool dataExists(const QString& nodeName);
-	XmlMessage clone(void);
-	bool isValid(void);
+	bool headerExists(const QString& nodeName) const;
+	bool dataExists(const QString& nodeName) const;
+	bool isValid(void) const;
+	QString toString(void) const;
+
+	qint64 time(void) const;
+	void setTime(qint64 msecs);
+	const ChatMessage& chat(void) const;
+	const FileMessage& file(void) const;
+
+	int headerCount(void) const;
+	int dataCount(void) const;
+	QString headerName(int index) const;
+	QString headerValue(int index) const;
+	QString dataName(int index) const;
+	QString dataValue(int index) const;
 
 private:
-	bool addXmlNode(const QString& parentNode, const QString& nodeName, const QString& nodeValue);
-	QString getXmlNode(const QString& parentNode, const QString& nodeName);
-	bool removeXmlNode(const QString& parentNode, const QString& nodeName);
-	bool xmlNodeExists(const QString& parentNode, const QString& nodeName);
+	bool parse(QXmlStreamReader& reader);
+	void parseSection(QXmlStreamReader& reader, XmlSection section);
+	bool addXmlNode(XmlSection section, const QString& nodeName, const QString& nodeValue);
+	QString getXmlNode(XmlSection section, const QString& nodeName) const;
+	bool removeXmlNode(XmlSection section, const QString& nodeName);
+	bool xmlNodeExists(XmlSection section, const QString& nodeName) const;
+
+	QSharedDataPointer<XmlMessageData> d;
 
 };
 
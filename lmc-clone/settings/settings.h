@@ -136,6 +136,45 @@
 #define IDS_UDPPORT_VAL			60000 // note: 50000 is a default port of lmc
 #define IDS_TCPPORT				"Connection/TCPPort"
 #define IDS_TCPPORT_VAL			60000 // note: 50000 is a default port of lmc
+#define IDS_COMPRESSION			"Connection/Compression"
+#define IDS_COMPRESSION_VAL		true
+#define IDS_COMPRESSTHRESHOLD	"Connection/CompressThreshold"
+#define IDS_COMPRESSTHRESHOLD_VAL	256	// messages smaller than this many bytes are sent as is
+#define IDS_SENDQUEUELIMIT		"Connection/SendQueueLimit"
+#define IDS_SENDQUEUELIMIT_VAL	4194304	// bytes waiting on a connection before further messages are refused
+#define IDS_COALESCEDELAY		"Connection/CoalesceDelay"
+#define IDS_COALESCEDELAY_VAL	0	// milliseconds to gather frames into one write, 0 ends with the event loop turn
+#define IDS_MAXFRAMESIZE		"Connection/MaxFrameSize"
+#define IDS_MAXFRAMESIZE_VAL	4194304	// largest frame accepted from a peer, a larger one closes the connection
+#define IDS_RECEIVEBUFFER		"Connection/ReceiveBuffer"
+#define IDS_RECEIVEBUFFER_VAL	8388608	// bytes of incoming data held for one connection
+#define IDS_RECEIVEBUDGET		"Connection/ReceiveBudget"
+#define IDS_RECEIVEBUDGET_VAL	268435456	// bytes of incoming data held for all connections together
+#define IDS_FILESTREAMLIMIT		"Connection/FileStreamLimit"
+#define IDS_FILESTREAMLIMIT_VAL	1048576	// files up to this many bytes are sent on the message connection
+#define IDS_CONNECTONDEMAND		"Connection/OnDemand"
+#define IDS_CONNECTONDEMAND_VAL	false	// connect to users when there is something to send, not on discovery
+#define IDS_IDLETIMEOUT			"Connection/IdleTimeout"
+#define IDS_IDLETIMEOUT_VAL		300	// seconds before a quiet connection is closed, in on demand mode
+#define IDS_MAXCONNECTIONS		"Connection/MaxConnections"
+#define IDS_MAXCONNECTIONS_VAL	256	// open connections kept in on demand mode, least recently used go first
+#define IDS_MAXHANDSHAKES		"Connection/MaxHandshakes"
+#define IDS_MAXHANDSHAKES_VAL	8	// connection handshakes in progress at once, others wait their turn
+#define IDS_CRYPTOTHREADS		"Connection/CryptoThreads"
+#define IDS_CRYPTOTHREADS_VAL	2	// threads that run the public key operations of handshakes
+#define IDS_RECONNECTGRACE		"Connection/ReconnectGrace"
+#define IDS_RECONNECTGRACE_VAL	60	// seconds a lost connection is retried before the user is reported gone, 0 reports it at once
+#define IDS_SOCKETPROFILE		"SocketProfile"	// one subgroup per channel: Message, File, Broadcast
+#define IDS_SP_NODELAY			"NoDelay"
+#define IDS_SP_KEEPALIVE		"KeepAlive"
+#define IDS_SP_KEEPALIVEIDLE	"KeepAliveIdle"
+#define IDS_SP_KEEPALIVEINTERVAL	"KeepAliveInterval"
+#define IDS_SP_KEEPALIVECOUNT	"KeepAliveCount"
+#define IDS_SP_USERTIMEOUT		"UserTimeout"
+#define IDS_SP_SENDBUFFER		"SendBuffer"
+#define IDS_SP_RECEIVEBUFFER	"ReceiveBuffer"
+#define IDS_SP_FASTOPEN			"FastOpen"
+#define IDS_SP_TYPEOFSERVICE	"TypeOfService"
 #define IDS_AUTOFILE			"FileTransfer/AutoFile"
 #define IDS_AUTOFILE_VAL		false
 #define	IDS_AUTOSHOWFILE		"FileTransfer/AutoShow"
@@ -0,0 +1,32 @@
+#-----------------------------------------------------------------------------
+#
+# crypto.pro
+#   checks of the session ciphers of lmcCrypto, run with "make check"
+#
+#-----------------------------------------------------------------------------
+
+TARGET = tst_crypto
+
+TEMPLATE = app
+
+QT += core testlib
+
+CONFIG += console testcase
+CONFIG -= app_bundle
+
+LMC = $$PWD/../..
+
+INCLUDEPATH += \
+    $$LMC/trace \
+    $$LMC/crypto
+
+win32:INCLUDEPATH += $$LMC/openssl/include
+win32:LIBS += -L$$LMC/openssl/lib/ -llibeay32
+unix:LIBS += -lcrypto
+
+HEADERS += \
+    $$LMC/crypto/crypto.h
+
+SOURCES += \
+    tst_crypto.cpp \
+    $$LMC/crypto/crypto.cpp
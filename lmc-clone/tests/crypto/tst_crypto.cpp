@@ -0,0 +1,336 @@
+/*
+    lmc-clone
+    http://code.google.com/p/lmc-clone
+
+    lmc is a lan messenger, instant messaging client.
+    http://lanmsngr.sourceforge.net/
+    http://sourceforge.net/projects/lanmsngr/
+
+    GNU LESSER GENERAL PUBLIC LICENSE
+    Version 3, 29 June 2007
+    Copyright (c) 2007 Free Software Foundation, Inc. <http://fsf.org/>
+    Everyone is permitted to copy and distribute verbatim copies of this license document, but changing it is not allowed.
+    This version of the GNU Lesser General Public License incorporates the terms and conditions of version 3 of the GNU General Public License, supplemented by the additional permissions listed below.
+     0. Additional Definitions.
+    As used herein, “this License” refers to version 3 of the GNU Lesser General Public License, and the “GNU GPL” refers to version 3 of the GNU General Public License.
+    “The Library” refers to a covered work governed by this License, other than an Application or a Combined Work as defined below.
+    An “Application” is any work that makes use of an interface provided by the Library, but which is not otherwise based on the Library. Defining a subclass of a class defined by the Library is deemed a mode of using an interface provided by the Library.
+    A “Combined Work” is a work produced by combining or linking an Application with the Library. The particular version of the Library with which the Combined Work was made is also called the “Linked Version”.
+    The “Minimal Corresponding Source” for a Combined Work means the Corresponding Source for the Combined Work, excluding any source code for portions of the Combined Work that, considered in isolation, are based on the Application, and not on the Linked Version.
+    The “Corresponding Application Code” for a Combined Work means the object code and/or source code for the Application, including any data and utility programs needed for reproducing the Combined Work from the Application, but excluding the System Libraries of the Combined Work.
+     1. Exception to Section 3 of the GNU GPL.
+    You may convey a covered work under sections 3 and 4 of this License without being bound by section 3 of the GNU GPL.
+     2. Conveying Modified Versions.
+    If you modify a copy of the Library, and, in your modifications, a facility refers to a function or data to be supplied by an Application that uses the facility (other than as an argument passed when the facility is invoked), then you may convey a copy of the modified version:
+    a) under this License, provided that you make a good faith effort to ensure that, in the event an Application does not supply the function or data, the facility still operates, and performs whatever part of its purpose remains meaningful, or
+    b) under the GNU GPL, with none of the additional permissions of this License applicable to that copy.
+     3. Object Code Incorporating Material from Library Header Files.
+    The object code form of an Application may incorporate material from a header file that is part of the Library. You may convey such object code under terms of your choice, provided that, if the incorporated material is not limited to numerical parameters, data structure layouts and accessors, or small macros, inline functions and templates (ten or fewer lines in length), you do both of the following:
+    a) Give prominent notice with each copy of the object code that the Library is used in it and that the Library and its use are covered by this License.
+    b) Accompany the object code with a copy of the GNU GPL and this license document.
+     4. Combined Works.
+    You may convey a Combined Work under terms of your choice that, taken together, effectively do not restrict modification of the portions of the Library contained in the Combined Work and reverse engineering for debugging such modifications, if you also do each of the following:
+    a) Give prominent notice with each copy of the Combined Work that the Library is used in it and that the Library and its use are covered by this License.
+    b) Accompany the Combined Work with a copy of the GNU GPL and this license document.
+    c) For a Combined Work that displays copyright notices during execution, include the copyright notice for the Library among these notices, as well as a reference directing the user to the copies of the GNU GPL and this license document.
+    d) Do one of the following:
+        0) Convey the Minimal Corresponding Source under the terms of this License, and the Corresponding Application Code in a form suitable for, and under terms that permit, the user to recombine or relink the Application with a modified version of the Linked Version to produce a modified Combined Work, in the manner specified by section 6 of the GNU GPL for conveying Corresponding Source.
+        1) Use a suitable shared library mechanism for linking with the Library. A suitable mechanism is one that (a) uses at run time a copy of the Library already present on the user's computer system, and (b) will operate properly with a modified version of the Library that is interface-compatible with the Linked Version.
+    e) Provide Installation Information, but only if you would otherwise be required to provide such information under section 6 of the GNU GPL, and only to the extent that such information is necessary to install and execute a modified version of the Combined Work produced by recombining or relinking the Application with a modified version of the Linked Version. (If you use option 4d0, the Installation Information must accompany the Minimal Corresponding Source and Corresponding Application Code. If you use option 4d1, you must provide the Installation Information in the manner specified by section 6 of the GNU GPL for conveying Corresponding Source.)
+     5. Combined Libraries.
+    You may place library facilities that are a work based on the Library side by side in a single library together with other library facilities that are not Applications and are not covered by this License, and convey such a combined library under terms of your choice, if you do both of the following:
+    a) Accompany the combined library with a copy of the same work based on the Library, uncombined with any other library facilities, conveyed under the terms of this License.
+    b) Give prominent notice with the combined library that part of it is a work based on the Library, and explaining where to find the accompanying uncombined form of the same work.
+     6. Revised Versions of the GNU Lesser General Public License.
+    The Free Software Foundation may publish revised and/or new versions of the GNU Lesser General Public License from time to time. Such new versions will be similar in spirit to the present version, but may differ in detail to address new problems or concerns.
+    Each version is given a distinguishing version number. If the Library as you received it specifies that a certain numbered version of the GNU Lesser General Public License “or any later version” applies to it, you have the option of following the terms and conditions either of that published version or of any later version published by the Free Software Foundation. If the Library as you received it does not specify a version number of the GNU Lesser General Public License, you may choose any version of the GNU Lesser General Public License ever published by the Free Software Foundation.
+    If the Library as you received it specifies that a proxy can decide whether future versions of the GNU Lesser General Public License shall apply, that proxy's public statement of acceptance of any version is permanent authorization for you to choose that version for the Library.
+*/
+
+#include <QtTest>
+#include <QtEndian>
+#include "crypto.h"
+
+/****************************************************************************
+** Class: tst_Crypto
+** Description: Checks the session ciphers of lmcCrypto between two
+**	instances, one that made the session key and one that received it, as
+**	the two ends of a connection hold them.
+****************************************************************************/
+class tst_Crypto : public QObject
+{
+	Q_OBJECT
+
+private slots:
+	void initTestCase(void);
+	void roundTrip_data(void);
+	void roundTrip(void);
+	void nonceLayout(void);
+	void tamperedMessage_data(void);
+	void tamperedMessage(void);
+	void shortMessage(void);
+	void replayedMessage(void);
+	void olderMessage(void);
+	void reflectedMessage(void);
+	void loopback(void);
+	void perPeerContexts(void);
+	void cbcKeyWithoutModeByte(void);
+	void noSessionKey(void);
+
+private:
+	lmcCrypto sender;
+	lmcCrypto receiver;
+	QString senderId;
+	QString receiverId;
+
+	void setSession(CipherMode mode);
+};
+
+void tst_Crypto::initTestCase(void) {
+	senderId = "001122334455johndoe";
+	receiverId = "66778899aabbjanedoe";
+}
+
+//	Each instance keeps the key under the id of the other end
+void tst_Crypto::setSession(CipherMode mode) {
+	QByteArray keyIv = sender.newSessionKey(mode);
+	sender.setSessionKey(&receiverId, keyIv, true);
+	receiver.setSessionKey(&senderId, keyIv, false);
+}
+
+void tst_Crypto::roundTrip_data(void) {
+	QTest::addColumn<int>("mode");
+	QTest::addColumn<int>("size");
+	QTest::newRow("gcm empty") << (int)CM_Gcm << 0;
+	QTest::newRow("gcm one block") << (int)CM_Gcm << 16;
+	QTest::newRow("gcm 2 KB") << (int)CM_Gcm << 2048;
+	QTest::newRow("gcm uneven") << (int)CM_Gcm << 1001;
+	QTest::newRow("cbc one block") << (int)CM_Cbc << 16;
+	QTest::newRow("cbc 2 KB") << (int)CM_Cbc << 2048;
+	QTest::newRow("cbc uneven") << (int)CM_Cbc << 1001;
+}
+
+//	Messages go both ways over the same contexts, several times, so that a
+//	context left in a bad state by the message before shows up
+void tst_Crypto::roundTrip(void) {
+	QFETCH(int, mode);
+	QFETCH(int, size);
+	setSession((CipherMode)mode);
+
+	for(int index = 0; index < 3; index++) {
+		QByteArray clearData(size, (char)('a' + index));
+		QByteArray cipherData = sender.encrypt(&receiverId, clearData);
+		QVERIFY(!cipherData.isEmpty());
+		QVERIFY(cipherData.length() <= clearData.length() + qMax(LC_MAXOVERHEAD, AES_BLOCK_SIZE));
+		QByteArray outData;
+		QVERIFY(receiver.decrypt(&senderId, cipherData, outData));
+		QCOMPARE(outData, clearData);
+
+		QByteArray reply(size, (char)('z' - index));
+		cipherData.clear();
+		QVERIFY(receiver.encrypt(&senderId, reply, cipherData));
+		QVERIFY(sender.decrypt(&receiverId, cipherData, outData));
+		QCOMPARE(outData, reply);
+	}
+}
+
+//	A gcm nonce is the direction byte, three bytes of the iv and the message
+//	counter in big endian, the two directions never share one
+void tst_Crypto::nonceLayout(void) {
+	QByteArray keyIv = sender.newSessionKey(CM_Gcm);
+	QCOMPARE(keyIv.length(), LC_KEYIVLENGTH + 1);
+	QCOMPARE((int)(quint8)keyIv.at(LC_KEYIVLENGTH), (int)CM_Gcm);
+	sender.setSessionKey(&receiverId, keyIv, true);
+	receiver.setSessionKey(&senderId, keyIv, false);
+
+	QByteArray clearData("hello");
+	for(quint64 counter = 0; counter < 3; counter++) {
+		QByteArray sent = sender.encrypt(&receiverId, clearData);
+		QByteArray replied = receiver.encrypt(&senderId, clearData);
+		QCOMPARE(sent.length(), LC_NONCELENGTH + clearData.length() + LC_TAGLENGTH);
+		QCOMPARE((int)(quint8)sent.at(0), 0x01);
+		QCOMPARE((int)(quint8)replied.at(0), 0x02);
+		QCOMPARE(sent.mid(1, 3), keyIv.mid(LC_KEYLENGTH + 1, 3));
+		QCOMPARE(replied.mid(1, 3), keyIv.mid(LC_KEYLENGTH + 1, 3));
+		QCOMPARE(qFromBigEndian<quint64>((const uchar*)sent.constData() + 4), counter);
+		QCOMPARE(qFromBigEndian<quint64>((const uchar*)replied.constData() + 4), counter);
+		QVERIFY(sent.mid(LC_NONCELENGTH) != replied.mid(LC_NONCELENGTH));
+	}
+}
+
+void tst_Crypto::tamperedMessage_data(void) {
+	QTest::addColumn<int>("offset");
+	QTest::newRow("direction byte") << 0;
+	QTest::newRow("counter high byte") << LC_NONCEPREFIX;
+	QTest::newRow("counter") << LC_NONCELENGTH - 1;
+	QTest::newRow("cipher text") << LC_NONCELENGTH + 5;
+	QTest::newRow("first tag byte") << -LC_TAGLENGTH;
+	QTest::newRow("last tag byte") << -1;
+}
+
+//	The tag is set before the cipher text is decrypted, so that a message
+//	changed on the way is refused and none of its text is handed on
+void tst_Crypto::tamperedMessage(void) {
+	QFETCH(int, offset);
+	setSession(CM_Gcm);
+
+	QByteArray clearData(64, 'm');
+	QByteArray cipherData = sender.encrypt(&receiverId, clearData);
+	if(offset < 0)
+		offset += cipherData.length();
+	cipherData[offset] = (char)(cipherData.at(offset) ^ 0x01);
+
+	QByteArray outData("left over");
+	QVERIFY(!receiver.decrypt(&senderId, cipherData, outData));
+	QVERIFY(outData.isEmpty());
+
+	//	the context is still good for the next message, and a changed counter
+	//	has not moved on the one expected
+	cipherData = sender.encrypt(&receiverId, clearData);
+	QVERIFY(receiver.decrypt(&senderId, cipherData, outData));
+	QCOMPARE(outData, clearData);
+}
+
+void tst_Crypto::shortMessage(void) {
+	setSession(CM_Gcm);
+
+	QByteArray clearData("hello");
+	QByteArray cipherData = sender.encrypt(&receiverId, clearData);
+	QByteArray outData;
+	QVERIFY(!receiver.decrypt(&senderId, cipherData.left(LC_NONCELENGTH + LC_TAGLENGTH - 1), outData));
+	QVERIFY(!receiver.decrypt(&senderId, cipherData.left(cipherData.length() - 1), outData));
+	QVERIFY(!receiver.decrypt(&senderId, QByteArray(), outData));
+}
+
+//	A message taken in once is refused when it comes again, the ones after it
+//	still come through
+void tst_Crypto::replayedMessage(void) {
+	setSession(CM_Gcm);
+
+	QByteArray clearData("hello");
+	QByteArray first = sender.encrypt(&receiverId, clearData);
+	QByteArray second = sender.encrypt(&receiverId, clearData);
+	QByteArray outData;
+	QVERIFY(receiver.decrypt(&senderId, first, outData));
+	QVERIFY(!receiver.decrypt(&senderId, first, outData));
+	QVERIFY(outData.isEmpty());
+	QVERIFY(receiver.decrypt(&senderId, second, outData));
+	QVERIFY(!receiver.decrypt(&senderId, second, outData));
+	QVERIFY(!receiver.decrypt(&senderId, first, outData));
+
+	QByteArray third = sender.encrypt(&receiverId, clearData);
+	QVERIFY(receiver.decrypt(&senderId, third, outData));
+	QCOMPARE(outData, clearData);
+}
+
+//	A connection delivers in order, so a message older than one taken in has
+//	been recorded and sent again
+void tst_Crypto::olderMessage(void) {
+	setSession(CM_Gcm);
+
+	QByteArray clearData("hello");
+	QByteArray first = sender.encrypt(&receiverId, clearData);
+	QByteArray second = sender.encrypt(&receiverId, clearData);
+	QByteArray outData;
+	QVERIFY(receiver.decrypt(&senderId, second, outData));
+	QVERIFY(!receiver.decrypt(&senderId, first, outData));
+}
+
+//	Both directions share the key, a message sent back to the end it came from
+//	is refused by its direction byte
+void tst_Crypto::reflectedMessage(void) {
+	setSession(CM_Gcm);
+
+	QByteArray clearData("hello");
+	QByteArray sent = sender.encrypt(&receiverId, clearData);
+	QByteArray replied = receiver.encrypt(&senderId, clearData);
+	QByteArray outData;
+	QVERIFY(!sender.decrypt(&receiverId, sent, outData));
+	QVERIFY(!receiver.decrypt(&senderId, replied, outData));
+
+	//	the refused messages have not used up the counters of the real ones
+	QVERIFY(receiver.decrypt(&senderId, sent, outData));
+	QCOMPARE(outData, clearData);
+	QVERIFY(sender.decrypt(&receiverId, replied, outData));
+	QCOMPARE(outData, clearData);
+}
+
+//	The connection of an instance to itself reads both its ends with one
+//	session, in whatever order the two connections deliver
+void tst_Crypto::loopback(void) {
+	lmcCrypto local;
+	QByteArray keyIv = local.newSessionKey(CM_Gcm);
+	local.setSessionKey(&senderId, keyIv, true);
+	local.setSessionKey(&senderId, keyIv, false);
+	local.setLoopback(&senderId);
+
+	QByteArray clearData("hello");
+	QByteArray first = local.encrypt(&senderId, clearData);
+	QByteArray second = local.encrypt(&senderId, clearData);
+	QByteArray outData;
+	QVERIFY(local.decrypt(&senderId, second, outData));
+	QCOMPARE(outData, clearData);
+	QVERIFY(local.decrypt(&senderId, first, outData));
+	QCOMPARE(outData, clearData);
+
+	first[first.length() - 1] = (char)(first.at(first.length() - 1) ^ 0x01);
+	QVERIFY(!local.decrypt(&senderId, first, outData));
+}
+
+//	Every peer has its own contexts and key, messages between them interleaved
+//	decrypt only with the key of the peer they were sent to
+void tst_Crypto::perPeerContexts(void) {
+	QString otherId = "ccddeeff0011jimdoe";
+	lmcCrypto other;
+	setSession(CM_Gcm);
+	QByteArray otherKeyIv = sender.newSessionKey(CM_Gcm);
+	sender.setSessionKey(&otherId, otherKeyIv, true);
+	other.setSessionKey(&senderId, otherKeyIv, false);
+
+	QByteArray toReceiver("for jane");
+	QByteArray toOther("for jim");
+	QByteArray outData;
+	for(int index = 0; index < 3; index++) {
+		QByteArray first = sender.encrypt(&receiverId, toReceiver);
+		QByteArray second = sender.encrypt(&otherId, toOther);
+		QVERIFY(!other.decrypt(&senderId, first, outData));
+		QVERIFY(!receiver.decrypt(&senderId, second, outData));
+		QVERIFY(receiver.decrypt(&senderId, first, outData));
+		QCOMPARE(outData, toReceiver);
+		QVERIFY(other.decrypt(&senderId, second, outData));
+		QCOMPARE(outData, toOther);
+	}
+
+	//	removing one peer leaves the other as it was
+	sender.removeKeys(&otherId);
+	QVERIFY(sender.encrypt(&otherId, toOther).isEmpty());
+	QVERIFY(receiver.decrypt(&senderId, sender.encrypt(&receiverId, toReceiver), outData));
+	QCOMPARE(outData, toReceiver);
+}
+
+//	A key from a version that only knows cbc has no mode byte
+void tst_Crypto::cbcKeyWithoutModeByte(void) {
+	QByteArray keyIv = sender.newSessionKey();
+	QCOMPARE(keyIv.length(), LC_KEYIVLENGTH);
+	sender.setSessionKey(&receiverId, keyIv, true);
+	receiver.setSessionKey(&senderId, keyIv, false);
+
+	QByteArray clearData("hello");
+	QByteArray cipherData = sender.encrypt(&receiverId, clearData);
+	QCOMPARE(cipherData.length(), AES_BLOCK_SIZE);
+	QCOMPARE(receiver.decrypt(&senderId, cipherData), clearData);
+}
+
+void tst_Crypto::noSessionKey(void) {
+	QString unknownId = "ffffffffffffnobody";
+	QByteArray clearData("hello");
+	QByteArray outData("left over");
+	QVERIFY(!sender.encrypt(&unknownId, clearData, outData));
+	QCOMPARE(outData, QByteArray("left over"));
+	QVERIFY(!sender.decrypt(&unknownId, clearData, outData));
+	QVERIFY(outData.isEmpty());
+}
+
+QTEST_MAIN(tst_Crypto)
+
+#include "tst_crypto.moc"
@@ -0,0 +1,42 @@
+#-----------------------------------------------------------------------------
+#
+# msgstream.pro
+#   checks of the receive limits of MsgStream, run with "make check"
+#
+#-----------------------------------------------------------------------------
+
+TARGET = tst_msgstream
+
+TEMPLATE = app
+
+QT += core network testlib widgets
+
+CONFIG += console testcase
+CONFIG -= app_bundle
+
+DEFINES += IDA_COMPANY=\"\\\"lmc-clone\\\"\"
+DEFINES += IDA_PRODUCT=\"\\\"lmc-clone\\\"\"
+DEFINES += IDA_VERSION=\"\\\"2.0.5\\\"\"
+DEFINES += IDS_VERSION_VAL=\"\\\"1.2.10\\\"\"
+
+LMC = $$PWD/../..
+
+INCLUDEPATH += \
+    $$LMC/trace \
+    $$LMC/settings \
+    $$LMC/messaging
+
+HEADERS += \
+    $$LMC/messaging/netstreamer.h \
+    $$LMC/messaging/socketprofile.h \
+    $$LMC/settings/settings.h \
+    $$LMC/settings/SettingsBase.h \
+    $$LMC/trace/trace.h
+
+SOURCES += \
+    tst_msgstream.cpp \
+    $$LMC/lmc/netstreamer.cpp \
+    $$LMC/messaging/socketprofile.cpp \
+    $$LMC/settings/settings.cpp \
+    $$LMC/settings/SettingsBase.cpp \
+    $$LMC/trace/trace.cpp
@@ -0,0 +1,160 @@
+/*
+    lmc-clone
+    http://code.google.com/p/lmc-clone
+
+    lmc is a lan messenger, instant messaging client.
+    http://lanmsngr.sourceforge.net/
+    http://sourceforge.net/projects/lanmsngr/
+
+    GNU LESSER GENERAL PUBLIC LICENSE
+    Version 3, 29 June 2007
+    Copyright (c) 2007 Free Software Foundation, Inc. <http://fsf.org/>
+    Everyone is permitted to copy and distribute verbatim copies of this license document, but changing it is not allowed.
+    This version of the GNU Lesser General Public License incorporates the terms and conditions of version 3 of the GNU General Public License, supplemented by the additional permissions listed below.
+     0. Additional Definitions.
+    As used herein, “this License” refers to version 3 of the GNU Lesser General Public License, and the “GNU GPL” refers to version 3 of the GNU General Public License.
+    “The Library” refers to a covered work governed by this License, other than an Application or a Combined Work as defined below.
+    An “Application” is any work that makes use of an interface provided by the Library, but which is not otherwise based on the Library. Defining a subclass of a class defined by the Library is deemed a mode of using an interface provided by the Library.
+    A “Combined Work” is a work produced by combining or linking an Application with the Library. The particular version of the Library with which the Combined Work was made is also called the “Linked Version”.
+    The “Minimal Corresponding Source” for a Combined Work means the Corresponding Source for the Combined Work, excluding any source code for portions of the Combined Work that, considered in isolation, are based on the Application, and not on the Linked Version.
+    The “Corresponding Application Code” for a Combined Work means the object code and/or source code for the Application, including any data and utility programs needed for reproducing the Combined Work from the Application, but excluding the System Libraries of the Combined Work.
+     1. Exception to Section 3 of the GNU GPL.
+    You may convey a covered work under sections 3 and 4 of this License without being bound by section 3 of the GNU GPL.
+     2. Conveying Modified Versions.
+    If you modify a copy of the Library, and, in your modifications, a facility refers to a function or data to be supplied by an Application that uses the facility (other than as an argument passed when the facility is invoked), then you may convey a copy of the modified version:
+    a) under this License, provided that you make a good faith effort to ensure that, in the event an Application does not supply the function or data, the facility still operates, and performs whatever part of its purpose remains meaningful, or
+    b) under the GNU GPL, with none of the additional permissions of this License applicable to that copy.
+     3. Object Code Incorporating Material from Library Header Files.
+    The object code form of an Application may incorporate material from a header file that is part of the Library. You may convey such object code under terms of your choice, provided that, if the incorporated material is not limited to numerical parameters, data structure layouts and accessors, or small macros, inline functions and templates (ten or fewer lines in length), you do both of the following:
+    a) Give prominent notice with each copy of the object code that the Library is used in it and that the Library and its use are covered by this License.
+    b) Accompany the object code with a copy of the GNU GPL and this license document.
+     4. Combined Works.
+    You may convey a Combined Work under terms of your choice that, taken together, effectively do not restrict modification of the portions of the Library contained in the Combined Work and reverse engineering for debugging such modifications, if you also do each of the following:
+    a) Give prominent notice with each copy of the Combined Work that the Library is used in it and that the Library and its use are covered by this License.
+    b) Accompany the Combined Work with a copy of the GNU GPL and this license document.
+    c) For a Combined Work that displays copyright notices during execution, include the copyright notice for the Library among these notices, as well as a reference directing the user to the copies of the GNU GPL and this license document.
+    d) Do one of the following:
+        0) Convey the Minimal Corresponding Source under the terms of this License, and the Corresponding Application Code in a form suitable for, and under terms that permit, the user to recombine or relink the Application with a modified version of the Linked Version to produce a modified Combined Work, in the manner specified by section 6 of the GNU GPL for conveying Corresponding Source.
+        1) Use a suitable shared library mechanism for linking with the Library. A suitable mechanism is one that (a) uses at run time a copy of the Library already present on the user's computer system, and (b) will operate properly with a modified version of the Library that is interface-compatible with the Linked Version.
+    e) Provide Installation Information, but only if you would otherwise be required to provide such information under section 6 of the GNU GPL, and only to the extent that such information is necessary to install and execute a modified version of the Combined Work produced by recombining or relinking the Application with a modified version of the Linked Version. (If you use option 4d0, the Installation Information must accompany the Minimal Corresponding Source and Corresponding Application Code. If you use option 4d1, you must provide the Installation Information in the manner specified by section 6 of the GNU GPL for conveying Corresponding Source.)
+     5. Combined Libraries.
+    You may place library facilities that are a work based on the Library side by side in a single library together with other library facilities that are not Applications and are not covered by this License, and convey such a combined library under terms of your choice, if you do both of the following:
+    a) Accompany the combined library with a copy of the same work based on the Library, uncombined with any other library facilities, conveyed under the terms of this License.
+    b) Give prominent notice with the combined library that part of it is a work based on the Library, and explaining where to find the accompanying uncombined form of the same work.
+     6. Revised Versions of the GNU Lesser General Public License.
+    The Free Software Foundation may publish revised and/or new versions of the GNU Lesser General Public License from time to time. Such new versions will be similar in spirit to the present version, but may differ in detail to address new problems or concerns.
+    Each version is given a distinguishing version number. If the Library as you received it specifies that a certain numbered version of the GNU Lesser General Public License “or any later version” applies to it, you have the option of following the terms and conditions either of that published version or of any later version published by the Free Software Foundation. If the Library as you received it does not specify a version number of the GNU Lesser General Public License, you may choose any version of the GNU Lesser General Public License ever published by the Free Software Foundation.
+    If the Library as you received it specifies that a proxy can decide whether future versions of the GNU Lesser General Public License shall apply, that proxy's public statement of acceptance of any version is permanent authorization for you to choose that version for the Library.
+*/
+
+#include <QtTest>
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QtEndian>
+#include "netstreamer.h"
+
+#define TS_BUDGET		65536		// receive budget shared by the streams under test
+#define TS_FRAMESIZE	262144		// each frame alone is over the budget
+#define TS_TIMEOUT		10000
+
+/****************************************************************************
+** Class: FrameCounter
+** Description: Counts the frames a stream delivers and checks their contents.
+****************************************************************************/
+class FrameCounter : public QObject
+{
+	Q_OBJECT
+
+public:
+	FrameCounter(void) { frames = 0; damaged = 0; }
+
+	int frames;
+	int damaged;
+
+public slots:
+	void messageReceived(QString* lpszUserId, QString* lpszAddress, QByteArray& data) {
+		Q_UNUSED(lpszUserId);
+		Q_UNUSED(lpszAddress);
+		frames++;
+		if(data.length() != TS_FRAMESIZE || data.count(data.at(0)) != data.length())
+			damaged++;
+	}
+};
+
+/****************************************************************************
+** Class: tst_MsgStream
+** Description: Runs MsgStream over loopback connections.
+****************************************************************************/
+class tst_MsgStream : public QObject
+{
+	Q_OBJECT
+
+private slots:
+	void cleanup(void);
+	void partialFramesOverBudget(void);
+
+private:
+	QTcpServer server;
+	QList<QTcpSocket*> senders;
+	QList<MsgStream*> streams;
+
+	MsgStream* acceptStream(QTcpSocket* pSender, FrameCounter* pCounter);
+};
+
+void tst_MsgStream::cleanup(void) {
+	qDeleteAll(streams);
+	streams.clear();
+	qDeleteAll(senders);
+	senders.clear();
+	server.close();
+	MsgStream::setReceiveBudget(IDS_RECEIVEBUDGET_VAL);
+}
+
+//	Connects the sender and reads what it sends through a new stream
+MsgStream* tst_MsgStream::acceptStream(QTcpSocket* pSender, FrameCounter* pCounter) {
+	pSender->connectToHost(QHostAddress::LocalHost, server.serverPort());
+	if(!pSender->waitForConnected(TS_TIMEOUT) || !server.waitForNewConnection(TS_TIMEOUT))
+		return NULL;
+
+	MsgStream* pStream = new MsgStream();
+	pStream->setReceiveLimits(TS_FRAMESIZE, TS_FRAMESIZE + MS_FRAMEHEADER);
+	pStream->init(server.nextPendingConnection());
+	connect(pStream, SIGNAL(messageReceived(QString*, QString*, QByteArray&)),
+		pCounter, SLOT(messageReceived(QString*, QString*, QByteArray&)));
+	streams.append(pStream);
+	return pStream;
+}
+
+//	Both streams hold half a frame, together more than the whole budget.
+//	Each has to be allowed to finish its frame, or neither ever does.
+void tst_MsgStream::partialFramesOverBudget(void) {
+	MsgStream::setReceiveBudget(TS_BUDGET);
+	QVERIFY(server.listen(QHostAddress::LocalHost));
+
+	FrameCounter counters[2];
+	QByteArray frames[2];
+	for(int index = 0; index < 2; index++) {
+		senders.append(new QTcpSocket());
+		QVERIFY(acceptStream(senders[index], &counters[index]));
+
+		frames[index].fill('a' + index, MS_FRAMEHEADER + TS_FRAMESIZE);
+		qToBigEndian<quint32>(TS_FRAMESIZE, (uchar*)frames[index].data());
+	}
+
+	int half = frames[0].length() / 2;
+	for(int index = 0; index < 2; index++)
+		senders[index]->write(frames[index].constData(), half);
+	QTRY_VERIFY_WITH_TIMEOUT(MsgStream::receiveBuffered() >= TS_BUDGET, TS_TIMEOUT);
+
+	for(int index = 0; index < 2; index++)
+		senders[index]->write(frames[index].constData() + half, frames[index].length() - half);
+
+	QTRY_COMPARE_WITH_TIMEOUT(counters[0].frames, 1, TS_TIMEOUT);
+	QTRY_COMPARE_WITH_TIMEOUT(counters[1].frames, 1, TS_TIMEOUT);
+	QCOMPARE(counters[0].damaged + counters[1].damaged, 0);
+	QCOMPARE(MsgStream::receiveBuffered(), (qint64)0);
+}
+
+QTEST_MAIN(tst_MsgStream)
+
+#include "tst_msgstream.moc"
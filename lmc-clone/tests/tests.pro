@@ -0,0 +1,12 @@
+#-----------------------------------------------------------------------------
+#
+# tests.pro
+#   unit tests, run all of them with "make check"
+#
+#-----------------------------------------------------------------------------
+
+TEMPLATE = subdirs
+
+SUBDIRS += \
+    crypto \
+    msgstream